@@ -4,9 +4,28 @@
 /* Get UCHAR_MAX. */
 #include <limits.h>
 
+#include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-# define BASE64_LENGTH(inlen) ((((inlen) + 2) / 3) * 4)
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+# define HAVE_NEON
+# include <arm_neon.h>
+#endif
+
+#include "base64.h"
 
 /* C89 compliant way to cast 'char' to 'unsigned char'. */
 static inline unsigned char
@@ -57,142 +76,1119 @@ base64_encode (const char *in, size_t inlen,
     *out = '\0';
 }
 
-/* Allocate a buffer and store zero terminated base64 encoded data
-   from array IN of size INLEN, returning BASE64_LENGTH(INLEN), i.e.,
-   the length of the encoded data, excluding the terminating zero.  On
-   return, the OUT variable will hold a pointer to newly allocated
-   memory that must be deallocated by the caller.  If output string
-   length would overflow, 0 is returned and OUT is set to NULL.  If
-   memory allocation failed, OUT is set to NULL, and the return value
-   indicates length of the requested memory block, i.e.,
-   BASE64_LENGTH(inlen) + 1. */
+/* Line wrapped encoding for message bodies. A full line takes 57 input
+   bytes; the first 48 go through a vector kernel producing 64 characters,
+   the remaining 9 through the scalar loop, then CRLF is appended. */
+
+#define LINE_IN 57
+#define BLOCK_IN 48
+
+typedef void (*base64_block_fn) (const unsigned char *in, char *out);
+
+static void
+base64_block_scalar (const unsigned char *in, char *out)
+{
+  base64_encode ((const char *) in, BLOCK_IN, out, BASE64_LENGTH (BLOCK_IN));
+}
+
+#ifdef HAVE_X86_SIMD
+/* Wojciech Muła's scheme: 12 input bytes in each 128-bit lane are spread
+   to 16 sextets with a shuffle and two multiplies, then turned into ASCII
+   by adding a per-range offset looked up with another shuffle. */
+__attribute__((target ("ssse3"))) static void
+base64_block_ssse3 (const unsigned char *in, char *out)
+{
+  const __m128i spread = _mm_setr_epi8 (1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m128i offsets = _mm_setr_epi8 ('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                         '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                         '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m128i vec, range;
+  int i;
+
+  for (i = 0; i < BLOCK_IN; i += 12, out += 16)
+    {
+      vec = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (in + i)), spread);
+      vec = _mm_or_si128 (_mm_mulhi_epu16 (_mm_and_si128 (vec, _mm_set1_epi32 (0x0fc0fc00)),
+                                           _mm_set1_epi32 (0x04000040)),
+                          _mm_mullo_epi16 (_mm_and_si128 (vec, _mm_set1_epi32 (0x003f03f0)),
+                                           _mm_set1_epi32 (0x01000010)));
+      range = _mm_or_si128 (_mm_subs_epu8 (vec, _mm_set1_epi8 (51)),
+                            _mm_and_si128 (_mm_cmpgt_epi8 (_mm_set1_epi8 (26), vec),
+                                           _mm_set1_epi8 (13)));
+      vec = _mm_add_epi8 (vec, _mm_shuffle_epi8 (offsets, range));
+      _mm_storeu_si128 ((__m128i *) out, vec);
+    }
+}
+
+/* the same on two lanes of 12 bytes each */
+__attribute__((target ("avx2"))) static void
+base64_block_avx2 (const unsigned char *in, char *out)
+{
+  const __m256i spread = _mm256_setr_epi8 (1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                           1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m256i offsets = _mm256_setr_epi8 ('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m256i vec, range;
+  int i;
+
+  for (i = 0; i < BLOCK_IN; i += 24, out += 32)
+    {
+      vec = _mm256_inserti128_si256 (
+              _mm256_castsi128_si256 (_mm_loadu_si128 ((const __m128i *) (in + i))),
+              _mm_loadu_si128 ((const __m128i *) (in + i + 12)), 1);
+      vec = _mm256_shuffle_epi8 (vec, spread);
+      vec = _mm256_or_si256 (_mm256_mulhi_epu16 (_mm256_and_si256 (vec, _mm256_set1_epi32 (0x0fc0fc00)),
+                                                 _mm256_set1_epi32 (0x04000040)),
+                             _mm256_mullo_epi16 (_mm256_and_si256 (vec, _mm256_set1_epi32 (0x003f03f0)),
+                                                 _mm256_set1_epi32 (0x01000010)));
+      range = _mm256_or_si256 (_mm256_subs_epu8 (vec, _mm256_set1_epi8 (51)),
+                               _mm256_and_si256 (_mm256_cmpgt_epi8 (_mm256_set1_epi8 (26), vec),
+                                                 _mm256_set1_epi8 (13)));
+      vec = _mm256_add_epi8 (vec, _mm256_shuffle_epi8 (offsets, range));
+      _mm256_storeu_si256 ((__m256i *) out, vec);
+    }
+}
+#endif
+
+#ifdef HAVE_NEON
+/* vld3/vst4 do the 3 -> 4 regrouping; the alphabet is applied with range
+   compares so that this also runs on ARMv7, which lacks vqtbl4q. */
+static uint8x16_t
+base64_neon_ascii (uint8x16_t idx)
+{
+  uint8x16_t res = vaddq_u8 (idx, vdupq_n_u8 ('A'));
+  res = vaddq_u8 (res, vandq_u8 (vcgeq_u8 (idx, vdupq_n_u8 (26)), vdupq_n_u8 ('a' - 26 - 'A')));
+  res = vaddq_u8 (res, vandq_u8 (vcgeq_u8 (idx, vdupq_n_u8 (52)),
+                                 vdupq_n_u8 ((unsigned char) ('0' - 52 - ('a' - 26)))));
+  res = vaddq_u8 (res, vandq_u8 (vcgeq_u8 (idx, vdupq_n_u8 (62)),
+                                 vdupq_n_u8 ((unsigned char) ('+' - 62 - ('0' - 52)))));
+  res = vaddq_u8 (res, vandq_u8 (vcgeq_u8 (idx, vdupq_n_u8 (63)),
+                                 vdupq_n_u8 ('/' - 63 - ('+' - 62))));
+  return res;
+}
+
+static void
+base64_block_neon (const unsigned char *in, char *out)
+{
+  uint8x16x3_t src = vld3q_u8 (in);
+  uint8x16x4_t dst;
+
+  dst.val[0] = vshrq_n_u8 (src.val[0], 2);
+  dst.val[1] = vandq_u8 (vorrq_u8 (vshlq_n_u8 (src.val[0], 4), vshrq_n_u8 (src.val[1], 4)),
+                         vdupq_n_u8 (0x3f));
+  dst.val[2] = vandq_u8 (vorrq_u8 (vshlq_n_u8 (src.val[1], 2), vshrq_n_u8 (src.val[2], 6)),
+                         vdupq_n_u8 (0x3f));
+  dst.val[3] = vandq_u8 (src.val[2], vdupq_n_u8 (0x3f));
+  dst.val[0] = base64_neon_ascii (dst.val[0]);
+  dst.val[1] = base64_neon_ascii (dst.val[1]);
+  dst.val[2] = base64_neon_ascii (dst.val[2]);
+  dst.val[3] = base64_neon_ascii (dst.val[3]);
+  vst4q_u8 ((unsigned char *) out, dst);
+}
+#endif
+
+static base64_block_fn base64_block = base64_block_scalar;
+static pthread_once_t base64_once = PTHREAD_ONCE_INIT;
+
+static void
+base64_pick_block (void)
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    base64_block = base64_block_avx2;
+  else if (__builtin_cpu_supports ("ssse3"))
+    base64_block = base64_block_ssse3;
+#endif
+#ifdef HAVE_NEON
+  base64_block = base64_block_neon;
+#endif
+}
+
+/* Encode IN as CRLF terminated lines of 76 characters into OUT, which must
+   hold BASE64_LINES_LENGTH(INLEN) bytes. Returns the number of bytes
+   written; no terminating zero is stored. */
 size_t
-base64_encode_alloc (const char *in, size_t inlen, char **out)
+base64_encode_lines (const char *in, size_t inlen, char *out)
+{
+  char *start = out;
+
+  pthread_once (&base64_once, base64_pick_block);
+  for (; inlen >= LINE_IN; in += LINE_IN, inlen -= LINE_IN)
+    {
+      base64_block ((const unsigned char *) in, out);
+      base64_encode (in + BLOCK_IN, LINE_IN - BLOCK_IN, out + 64, BASE64_LENGTH (LINE_IN - BLOCK_IN));
+      out[76] = '\r';
+      out[77] = '\n';
+      out += 78;
+    }
+  if (inlen)
+    {
+      base64_encode (in, inlen, out, BASE64_LENGTH (inlen));
+      out += BASE64_LENGTH (inlen);
+      *out++ = '\r';
+      *out++ = '\n';
+    }
+  return out - start;
+}
+
+/* The reference implementation of the above, kept for cross-checking the
+   vector kernels. */
+size_t
+base64_encode_lines_scalar (const char *in, size_t inlen, char *out)
+{
+  char *start = out;
+  size_t n;
+
+  for (; inlen; in += n, inlen -= n)
+    {
+      n = inlen < LINE_IN ? inlen : LINE_IN;
+      base64_encode (in, n, out, BASE64_LENGTH (n));
+      out += BASE64_LENGTH (n);
+      *out++ = '\r';
+      *out++ = '\n';
+    }
+  return out - start;
+}
+
+/* RFC 2047 header encoding. Values which are plain ASCII go out raw,
+   otherwise as "Q" or "B" encoded words, whichever is shorter. Long values
+   are folded into several words of at most 75 characters, split on UTF-8
+   character boundaries, so that no line exceeds 76 columns. */
+
+#define HDR_LINE 76
+#define HDR_WORD 75
+
+/* characters which may appear unescaped in a Q encoded word anywhere,
+   including display names (RFC 2047 5.(3)); space becomes '_' */
+static int
+q_safe (unsigned char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+         c == ' ' || c == '!' || c == '*' || c == '+' || c == '-' || c == '/';
+}
+
+/* Count the bytes of IN that Q encoding has to escape. Returns nonzero if
+   any of them is 8 bit or a control character, i.e. cannot go out raw. */
+static int
+header_scan (const unsigned char *in, size_t len, size_t *qunsafe)
+{
+  size_t i = 0, n = 0;
+  int binary = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+      __m128i lower = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+      __m128i safe;
+
+      /* signed compares: 8 bit bytes are negative and fall out of every range */
+      binary |= _mm_movemask_epi8 (_mm_or_si128 (_mm_cmplt_epi8 (v, _mm_set1_epi8 (0x20)),
+                                                 _mm_cmpeq_epi8 (v, _mm_set1_epi8 (0x7f))));
+      safe = _mm_and_si128 (_mm_cmpgt_epi8 (lower, _mm_set1_epi8 ('a' - 1)),
+                            _mm_cmplt_epi8 (lower, _mm_set1_epi8 ('z' + 1)));
+      safe = _mm_or_si128 (safe, _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 ('0' - 1)),
+                                                _mm_cmplt_epi8 (v, _mm_set1_epi8 ('9' + 1))));
+      safe = _mm_or_si128 (safe, _mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')));
+      safe = _mm_or_si128 (safe, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('!')));
+      safe = _mm_or_si128 (safe, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('*')));
+      safe = _mm_or_si128 (safe, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('+')));
+      safe = _mm_or_si128 (safe, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('-')));
+      safe = _mm_or_si128 (safe, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('/')));
+      n += 16 - __builtin_popcount (_mm_movemask_epi8 (safe));
+    }
+#elif defined(HAVE_NEON)
+  for (; i + 16 <= len; i += 16)
+    {
+      uint8x16_t v = vld1q_u8 (in + i);
+      uint8x16_t lower = vorrq_u8 (v, vdupq_n_u8 (0x20));
+      uint8x16_t bad, safe;
+      uint64x2_t sum;
+
+      bad = vorrq_u8 (vcltq_u8 (v, vdupq_n_u8 (0x20)), vcgeq_u8 (v, vdupq_n_u8 (0x7f)));
+      safe = vandq_u8 (vcgeq_u8 (lower, vdupq_n_u8 ('a')), vcleq_u8 (lower, vdupq_n_u8 ('z')));
+      safe = vorrq_u8 (safe, vandq_u8 (vcgeq_u8 (v, vdupq_n_u8 ('0')), vcleq_u8 (v, vdupq_n_u8 ('9'))));
+      safe = vorrq_u8 (safe, vceqq_u8 (v, vdupq_n_u8 (' ')));
+      safe = vorrq_u8 (safe, vceqq_u8 (v, vdupq_n_u8 ('!')));
+      safe = vorrq_u8 (safe, vceqq_u8 (v, vdupq_n_u8 ('*')));
+      safe = vorrq_u8 (safe, vceqq_u8 (v, vdupq_n_u8 ('+')));
+      safe = vorrq_u8 (safe, vceqq_u8 (v, vdupq_n_u8 ('-')));
+      safe = vorrq_u8 (safe, vceqq_u8 (v, vdupq_n_u8 ('/')));
+      sum = vpaddlq_u32 (vpaddlq_u16 (vpaddlq_u8 (vandq_u8 (vmvnq_u8 (safe), vdupq_n_u8 (1)))));
+      n += vgetq_lane_u64 (sum, 0) + vgetq_lane_u64 (sum, 1);
+      sum = vpaddlq_u32 (vpaddlq_u16 (vpaddlq_u8 (vandq_u8 (bad, vdupq_n_u8 (1)))));
+      binary |= (vgetq_lane_u64 (sum, 0) + vgetq_lane_u64 (sum, 1)) != 0;
+    }
+#endif
+  for (; i < len; i++)
+    {
+      if (in[i] < 0x20 || in[i] >= 0x7f)
+        binary = 1;
+      if (!q_safe (in[i]))
+        n++;
+    }
+  *qunsafe = n;
+  return binary != 0;
+}
+
+/* RFC 822 specials make a raw display name a quoted-string; encoding is
+   simpler. "=?" would be mistaken for an encoded word. */
+static int
+needs_encoding (const char *in, size_t len, int flags)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    if ((in[i] == '=' && i + 1 < len && in[i + 1] == '?') ||
+        ((flags & RFC2047_PHRASE) && strchr ("()<>@,;:\\\".[]", in[i])))
+      return 1;
+  return 0;
+}
+
+/* raw value, folded before a space where a line would get too long */
+static size_t
+fold_raw (const char *in, size_t len, int col, char *out)
 {
-  size_t outlen = 1 + BASE64_LENGTH (inlen);
+  char *start = out;
+  size_t i, brk;
 
-  /* Check for overflow in outlen computation.
-   *
-   * If there is no overflow, outlen >= inlen.
-   *
-   * If the operation (inlen + 2) overflows then it yields at most +1, so
-   * outlen is 0.
-   *
-   * If the multiplication overflows, we lose at least half of the
-   * correct value, so the result is < ((inlen + 2) / 3) * 2, which is
-   * less than (inlen + 2) * 0.66667, which is less than inlen as soon as
-   * (inlen > 4).
-   */
-  if (inlen > outlen)
+  while (col + len > HDR_LINE)
     {
-      *out = NULL;
-      return 0;
+      for (brk = 0, i = 1; i < len && (brk == 0 || col + i <= HDR_LINE); i++)
+        if (in[i] == ' ')
+          brk = i;
+      if (col > 1 && (!brk || col + brk > HDR_LINE))
+        {
+          /* not even the first word fits: give it a line of its own */
+          memcpy (out, "\r\n ", 3);
+          out += 3;
+          col = 1;
+          continue;
+        }
+      if (!brk)
+        break;
+      memcpy (out, in, brk);
+      out += brk;
+      *out++ = '\r';
+      *out++ = '\n';
+      in += brk;
+      len -= brk;
+      col = 0;
     }
+  memcpy (out, in, len);
+  return out + len - start;
+}
 
-  *out = malloc (outlen);
-  if (!*out)
-    return outlen;
+static size_t
+utf8_char_len (unsigned char c)
+{
+  return c < 0xc0 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+}
 
-  base64_encode (in, inlen, *out, outlen);
+static size_t
+encode_words (const char *in, size_t len, int col, int q, char *out)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  char *start = out;
+  size_t n, c;
+  int cost, budget;
 
-  return outlen - 1;
+  for (;;)
+    {
+      /* what is left of the line for the encoded text, after the 12
+         characters of "=?UTF-8?Q?" and "?=" */
+      budget = (HDR_LINE - col < HDR_WORD ? HDR_LINE - col : HDR_WORD) - 12;
+      c = utf8_char_len (in[0]);
+      if (c > len)
+        c = len;
+      cost = !q ? (int) BASE64_LENGTH (c) : q_safe (in[0]) ? 1 : 3 * (int) c;
+      if (budget < cost && col > 1)
+        {
+          /* not even one character fits: start on the next line */
+          memcpy (out, "\r\n ", 3);
+          out += 3;
+          col = 1;
+          continue;
+        }
+      memcpy (out, q ? "=?UTF-8?Q?" : "=?UTF-8?B?", 10);
+      out += 10;
+      if (q)
+        {
+          for (n = 0; n < len; n += c)
+            {
+              c = utf8_char_len (in[n]);
+              if (n + c > len)
+                c = len - n;
+              cost = q_safe (in[n]) ? 1 : 3 * (int) c;
+              if (cost > budget)
+                break;
+              budget -= cost;
+              if (cost == 1)
+                *out++ = in[n] == ' ' ? '_' : in[n];
+              else
+                for (cost = 0; cost < (int) c; cost++)
+                  {
+                    *out++ = '=';
+                    *out++ = hex[(unsigned char) in[n + cost] >> 4];
+                    *out++ = hex[in[n + cost] & 15];
+                  }
+            }
+        }
+      else
+        {
+          n = budget / 4 * 3;
+          if (n >= len)
+            n = len;
+          else
+            while (n && (in[n] & 0xc0) == 0x80)
+              n--;
+          base64_encode (in, n, out, BASE64_LENGTH (n));
+          out += BASE64_LENGTH (n);
+        }
+      *out++ = '?';
+      *out++ = '=';
+      in += n;
+      len -= n;
+      if (!len || !n)
+        break;
+      memcpy (out, "\r\n ", 3);
+      out += 3;
+      col = 1;
+    }
+  return out - start;
 }
 
+/* Encode the header value IN, which starts at column COL, into OUT. OUT
+   must hold RFC2047_LENGTH(INLEN) bytes. Returns the bytes written. */
 size_t
-base64_encode_alloc_with_header(const char*in,size_t inlen,char **out)
+rfc2047_encode (const char *in, size_t inlen, int col, int flags, char *out)
+{
+  size_t qunsafe;
+
+  if (!header_scan ((const unsigned char *) in, inlen, &qunsafe) &&
+      !needs_encoding (in, inlen, flags))
+    return fold_raw (in, inlen, col, out);
+  return encode_words (in, inlen, col, inlen + 2 * qunsafe <= BASE64_LENGTH (inlen), out);
+}
+
+/* Body encoding. One pass over the body classifies it, or the conversion
+   from UTF-16 does it on the way; the renderer then
+   picks 7bit, quoted-printable or base64, whichever is valid and smallest.
+   Bodies use LF line ends; all three encodings emit CRLF. */
+
+#define BODY_LINE 998 /* RFC 5322 limit for 7bit lines */
+#define QP_LINE 76
+
+static void
+body_line (body_class_t *bc, size_t *col, const unsigned char *p, size_t n)
 {
-    size_t outlen = 1 + BASE64_LENGTH (inlen);
+  size_t i;
 
-    if (inlen > outlen)
+  for (i = 0; i < n; i++)
     {
-        *out = NULL;
-        return 0;
+      if (p[i] == '\n')
+        {
+          if (*col > bc->longest)
+            bc->longest = *col;
+          *col = 0;
+          bc->newlines++;
+          continue;
+        }
+      ++*col;
+      if (p[i] >= 0x7f)
+        bc->eightbit++, bc->escapes++;
+      else if (p[i] < 0x20 && p[i] != '\t')
+        bc->ctrl = 1, bc->escapes++;
+      else if (p[i] == '=')
+        bc->escapes++;
     }
-    outlen += 12;
+}
 
-    *out = malloc (outlen);
-    if (!*out)
-        return outlen;
-    memcpy(*out,"=?UTF-8?B?",10);
-    base64_encode (in, inlen, *out+10, outlen-12);
-    memcpy(*out+outlen-3,"?=",2);
-    *(*out+outlen) = 0;
+/* 16 bytes at P, which continue the line at column COL */
+static inline void
+body_block (body_class_t *bc, size_t *col, const unsigned char *p)
+{
+#ifdef __SSE2__
+  __m128i v = _mm_loadu_si128 ((const __m128i *) p);
+  /* signed compares: 8 bit bytes are negative */
+  int high = _mm_movemask_epi8 (_mm_or_si128 (v, _mm_cmpeq_epi8 (v, _mm_set1_epi8 (0x7f))));
+  int low = _mm_movemask_epi8 (_mm_andnot_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')),
+                                                 _mm_cmplt_epi8 (v, _mm_set1_epi8 (0x20)))) & ~high;
+  int eq = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('=')));
+  int nl = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n')));
+
+  if (nl)
+    {
+      /* rare enough in message text to just walk the block */
+      body_line (bc, col, p, 16);
+      return;
+    }
+  *col += 16;
+  bc->eightbit += __builtin_popcount (high);
+  bc->escapes += __builtin_popcount (high | low | eq);
+  bc->ctrl |= low != 0;
+#elif defined(HAVE_NEON)
+  uint8x16_t v = vld1q_u8 (p);
+  uint8x16_t high = vcgeq_u8 (v, vdupq_n_u8 (0x7f));
+  uint8x16_t low = vbicq_u8 (vcltq_u8 (v, vdupq_n_u8 (0x20)), vceqq_u8 (v, vdupq_n_u8 ('\t')));
+  uint8x16_t esc = vorrq_u8 (vorrq_u8 (high, low), vceqq_u8 (v, vdupq_n_u8 ('=')));
+  uint8x16_t nl = vceqq_u8 (v, vdupq_n_u8 ('\n'));
+  uint8x8_t any = vorr_u8 (vget_low_u8 (nl), vget_high_u8 (nl));
+  uint64x2_t sum;
 
-    return outlen-1;
+  if (vget_lane_u64 (vreinterpret_u64_u8 (any), 0))
+    {
+      body_line (bc, col, p, 16);
+      return;
+    }
+  *col += 16;
+  sum = vpaddlq_u32 (vpaddlq_u16 (vpaddlq_u8 (vandq_u8 (high, vdupq_n_u8 (1)))));
+  bc->eightbit += vgetq_lane_u64 (sum, 0) + vgetq_lane_u64 (sum, 1);
+  sum = vpaddlq_u32 (vpaddlq_u16 (vpaddlq_u8 (vandq_u8 (esc, vdupq_n_u8 (1)))));
+  bc->escapes += vgetq_lane_u64 (sum, 0) + vgetq_lane_u64 (sum, 1);
+  any = vorr_u8 (vget_low_u8 (low), vget_high_u8 (low));
+  bc->ctrl |= vget_lane_u64 (vreinterpret_u64_u8 (any), 0) != 0;
+#else
+  body_line (bc, col, p, 16);
+#endif
+}
+
+static void
+body_classify (const unsigned char *in, size_t len, body_class_t *bc)
+{
+  size_t i = 0, col = 0;
+
+  memset (bc, 0, sizeof(*bc));
+  for (; i + 16 <= len; i += 16)
+    body_block (bc, &col, in + i);
+  body_line (bc, &col, in + i, len - i);
+  if (col > bc->longest)
+    bc->longest = col;
+}
+
+/* Runs of 16 ASCII code units are narrowed to bytes with vector
+   instructions; anything else goes one character at a time up to the end
+   of its block. The output is classified 16 bytes at a time right behind
+   the conversion, while it is still in cache. */
+size_t
+body_from_utf16 (const unsigned short *in, size_t len, char *out, body_class_t *bc)
+{
+  unsigned char *o = (unsigned char *) out, *done = o;
+  size_t i = 0, end, col = 0;
+  unsigned c;
+
+  memset (bc, 0, sizeof(*bc));
+  while (i < len)
+    {
+#ifdef __SSE2__
+      for (; i + 16 <= len; i += 16, o += 16)
+        {
+          __m128i a = _mm_loadu_si128 ((const __m128i *) (in + i));
+          __m128i b = _mm_loadu_si128 ((const __m128i *) (in + i + 8));
+          __m128i hi = _mm_and_si128 (_mm_or_si128 (a, b), _mm_set1_epi16 ((short) 0xff80));
+
+          if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (hi, _mm_setzero_si128 ())) != 0xffff)
+            break;
+          _mm_storeu_si128 ((__m128i *) o, _mm_packus_epi16 (a, b));
+        }
+#elif defined(HAVE_NEON)
+      for (; i + 16 <= len; i += 16, o += 16)
+        {
+          uint16x8_t a = vld1q_u16 (in + i), b = vld1q_u16 (in + i + 8);
+          uint64x2_t hi = vreinterpretq_u64_u16 (vandq_u16 (vorrq_u16 (a, b), vdupq_n_u16 (0xff80)));
+
+          if (vgetq_lane_u64 (hi, 0) | vgetq_lane_u64 (hi, 1))
+            break;
+          vst1q_u8 (o, vcombine_u8 (vmovn_u16 (a), vmovn_u16 (b)));
+        }
+#endif
+      for (end = i + 16 < len ? i + 16 : len; i < end; )
+        {
+          c = in[i++];
+          if (c < 0x80)
+            {
+              *o++ = c;
+            }
+          else if (c < 0x800)
+            {
+              *o++ = 0xc0 | c >> 6;
+              *o++ = 0x80 | (c & 0x3f);
+            }
+          else if (c >= 0xd800 && c < 0xdc00 && i < len && in[i] >= 0xdc00 && in[i] < 0xe000)
+            {
+              c = 0x10000 + ((c - 0xd800) << 10) + (in[i++] - 0xdc00);
+              *o++ = 0xf0 | c >> 18;
+              *o++ = 0x80 | ((c >> 12) & 0x3f);
+              *o++ = 0x80 | ((c >> 6) & 0x3f);
+              *o++ = 0x80 | (c & 0x3f);
+            }
+          else
+            {
+              if (c >= 0xd800 && c < 0xe000)
+                c = 0xfffd;
+              *o++ = 0xe0 | c >> 12;
+              *o++ = 0x80 | ((c >> 6) & 0x3f);
+              *o++ = 0x80 | (c & 0x3f);
+            }
+        }
+      for (; o - done >= 16; done += 16)
+        body_block (bc, &col, done);
+    }
+  body_line (bc, &col, done, o - done);
+  if (col > bc->longest)
+    bc->longest = col;
+  return o - (unsigned char *) out;
 }
-const char imap_subject_header[] = "Subject: ";
-const char imap_text_header[] = "\nMIME-Version: 1.0\nContent-Type: text/plain;\n charset=utf-8\nContent-Transfer-Encoding: base64\n";
 
-/* memset message before use */
+/* LF -> CRLF copy of a body which is valid 7bit */
+static size_t
+encode_7bit (const char *in, size_t len, char *out)
+{
+  char *start = out;
+  const char *nl;
+
+  while ((nl = memchr (in, '\n', len)))
+    {
+      memcpy (out, in, nl - in);
+      out += nl - in;
+      *out++ = '\r';
+      *out++ = '\n';
+      len -= nl + 1 - in;
+      in = nl + 1;
+    }
+  memcpy (out, in, len);
+  out += len;
+  if (len)
+    {
+      *out++ = '\r';
+      *out++ = '\n';
+    }
+  return out - start;
+}
+
+/* with OUT null only the size is computed */
+static size_t
+encode_qp (const char *in, size_t len, char *out)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  size_t i, n = 0, col = 0, w;
+  unsigned char c;
+
+  for (i = 0; i < len; i++)
+    {
+      c = in[i];
+      if (c == '\n')
+        {
+          if (out)
+            memcpy (out + n, "\r\n", 2);
+          n += 2;
+          col = 0;
+          continue;
+        }
+      /* whitespace at the end of a line must be encoded (RFC 2045 6.7.3) */
+      w = (c >= 33 && c <= 126 && c != '=') ||
+          ((c == ' ' || c == '\t') && i + 1 < len && in[i + 1] != '\n') ? 1 : 3;
+      if (col + w > QP_LINE - 1)
+        {
+          if (out)
+            memcpy (out + n, "=\r\n", 3);
+          n += 3;
+          col = 0;
+        }
+      if (out)
+        {
+          if (w == 1)
+            out[n] = c;
+          else
+            {
+              out[n] = '=';
+              out[n + 1] = hex[c >> 4];
+              out[n + 2] = hex[c & 15];
+            }
+        }
+      n += w;
+      col += w;
+    }
+  if (col)
+    {
+      if (out)
+        memcpy (out + n, "\r\n", 2);
+      n += 2;
+    }
+  return n;
+}
+
+const char imap_text_header[] = "\r\nMIME-Version: 1.0\r\n";
+
+static void
+add_string(msg_buf_t *message, const char *str)
+{
+    msg_buf_add(message, str, strlen(str));
+}
+
+static void
+add_encoded(msg_buf_t *message, const char *in, int col, int flags)
+{
+    size_t len = strlen(in);
+
+    message->len += rfc2047_encode(in, len, col, flags,
+                                   msg_buf_reserve(message, RFC2047_LENGTH (len)));
+}
+
+/* "Name <email>", the name encoded as if it started in column 6, which
+   is right after "From: " and leaves room for "To: ". The result fits
+   both headers, so it can be rendered once per contact. */
+void
+msg_render_address(msg_buf_t *message, const char *name, const char *email)
+{
+    add_encoded(message,name,6,RFC2047_PHRASE);
+    msg_buf_add(message," <",2);
+    add_string(message,email);
+    msg_buf_add(message,">",1);
+}
+
+static void
+add_slot(msg_tmpl_t *tmpl, int type)
+{
+    tmpl->slot[tmpl->nslots].at = tmpl->text.len;
+    tmpl->slot[tmpl->nslots].type = type;
+    tmpl->nslots++;
+}
+
+/* Lay out the headers of a channel once. Everything constant for the
+   channel is stored as literal, already encoded bytes; the per-event
+   values go into slots at fixed offsets. DIGEST lays out a day's digest
+   instead of a single event. */
 void
-imap_create_header(char* message, const char *subject)
+msg_tmpl_compile(msg_tmpl_t *tmpl, const char *label, const char *name,
+                 const char *email, const char *backup_time, int digest)
 {
-    char *encode;
-    size_t len;
-    memcpy(message,imap_subject_header,strlen(imap_subject_header));
-    len = base64_encode_alloc_with_header(subject,strlen(subject),&encode);
-    if(len)
+    static const char with[] = " with ";
+    int col;
+
+    msg_buf_init(&tmpl->text);
+    msg_buf_init(&tmpl->me);
+    tmpl->nslots = 0;
+    msg_render_address(&tmpl->me,name,email);
+
+    add_string(&tmpl->text,"Subject: ");
+    add_encoded(&tmpl->text,label,9,0);
+    msg_buf_add(&tmpl->text,with,sizeof(with)-1);
+    /* the contact name is a word of its own, encoded for where it lands */
+    for (col = 0; col < tmpl->text.len && tmpl->text.data[tmpl->text.len - col - 1] != '\n'; col++)
+        ;
+    tmpl->subject_col = col;
+    add_slot(tmpl,TMPL_SUBJECT);
+    add_string(&tmpl->text,imap_text_header);
+    add_string(&tmpl->text,"From: ");
+    add_slot(tmpl,TMPL_FROM);
+    add_string(&tmpl->text,"\r\nTo: ");
+    add_slot(tmpl,TMPL_TO);
+    add_string(&tmpl->text,"\r\nDate: ");
+    add_slot(tmpl,TMPL_DATE);
+    add_string(&tmpl->text,"\r\nMessage-ID: <");
+    add_slot(tmpl,TMPL_MESSAGE_ID);
+    add_string(&tmpl->text,">\r\nReferences: <");
+    add_slot(tmpl,TMPL_REFERENCES);
+    /* a digest covers a range of events */
+    add_string(&tmpl->text,digest ? ">\r\nX-smssync-ids: " : ">\r\nX-smssync-id: ");
+    add_slot(tmpl,TMPL_ID);
+    add_string(&tmpl->text,"\r\nX-smssync-address: ");
+    add_slot(tmpl,TMPL_ADDRESS);
+    add_string(&tmpl->text,"\r\nX-smssync-datatype: ");
+    add_string(&tmpl->text,label);
+    add_string(&tmpl->text,"\r\nX-smssync-backup-time: ");
+    add_string(&tmpl->text,backup_time);
+    add_string(&tmpl->text,"\r\n");
+    add_slot(tmpl,TMPL_BODY);
+}
+
+/* the contact name as it goes into this channel's subject */
+void
+msg_render_subject(const msg_tmpl_t *tmpl, msg_buf_t *message, const char *name)
+{
+    add_encoded(message,name,tmpl->subject_col,0);
+}
+
+void
+msg_tmpl_free(msg_tmpl_t *tmpl)
+{
+    free(tmpl->text.data);
+    free(tmpl->me.data);
+}
+
+static const char *const cte_names[] = { "7bit", "quoted-printable", "base64" };
+
+/* Pick the cheapest Content-Transfer-Encoding that is valid for the body
+   and work out the exact size of the encoded body. */
+static void
+plan_body(msg_fields_t *fields)
+{
+    size_t len = fields->body_len, b64 = BASE64_LINES_LENGTH (len), qp;
+    body_class_t bc;
+
+    if (fields->body_class)
+        bc = *fields->body_class;
+    else
+        body_classify((const unsigned char *)fields->body, len, &bc);
+    qp = len + 2 * bc.escapes + bc.newlines + 2;
+    qp += 3 * (qp / (QP_LINE - 1));
+    if (!bc.eightbit && !bc.ctrl && bc.longest <= BODY_LINE &&
+        (!fields->nparts || !strstr(fields->body, fields->boundary)))
+    {
+        fields->cte = CTE_7BIT;
+        fields->body_size = len + bc.newlines + (len && fields->body[len - 1] != '\n' ? 2 : 0);
+    }
+    else if (qp < b64 && (qp = encode_qp(fields->body, len, 0)) < b64)
     {
-        memcpy(message+strlen(message),encode,len);
-        free(encode);
+        fields->cte = CTE_QP;
+        fields->body_size = qp;
     }
-    memcpy(message+strlen(message),imap_text_header,strlen(imap_text_header));
+    else
+    {
+        fields->cte = CTE_BASE64;
+        fields->body_size = b64;
+    }
+    fields->saved = b64 - fields->body_size;
 }
 
-void imap_add_address(char *message,const char* id, const char* name, const char* email)
+/* Output of the small pieces of a message. With a null out only the size
+   is counted, which is how the sizing pass measures them. */
+typedef struct {
+    char *out;
+    size_t n;
+} emit_t;
+
+static void
+emit(emit_t *e, const char *s, size_t len)
 {
-    char *encode;
-    size_t len;
-    memcpy(message+strlen(message),id,strlen(id));
-    memcpy(message+strlen(message),": ",2);
-    len = base64_encode_alloc_with_header(name,strlen(name),&encode);
-    if(len)
+    if (e->out)
+        memcpy(e->out + e->n, s, len);
+    e->n += len;
+}
+
+static void
+emit_str(emit_t *e, const char *s)
+{
+    emit(e, s, strlen(s));
+}
+
+static void
+emit_text(emit_t *e, const msg_fields_t *fields)
+{
+    emit_str(e,"Content-Type: text/plain;\r\n charset=utf-8\r\nContent-Transfer-Encoding: ");
+    emit_str(e,cte_names[fields->cte]);
+    emit(e,"\r\n\r\n",4);
+    if (e->out)
     {
-        memcpy(message+strlen(message),encode,len);
-        free(encode);
+        if (fields->cte == CTE_7BIT)
+            encode_7bit(fields->body, fields->body_len, e->out + e->n);
+        else if (fields->cte == CTE_QP)
+            encode_qp(fields->body, fields->body_len, e->out + e->n);
+        else
+            base64_encode_lines(fields->body, fields->body_len, e->out + e->n);
     }
-    memcpy(message+strlen(message)," <",2);
-    memcpy(message+strlen(message),email,strlen(email));
-    memcpy(message+strlen(message),">\n",2);
+    e->n += fields->body_size;
 }
 
-void imap_add_header(char* message,const char* id , const char *content)
+/* headers and the text part: literal runs and slot values */
+static void
+emit_head(emit_t *e, const msg_fields_t *fields)
 {
-    memcpy(message+strlen(message),id,strlen(id));
-    memcpy(message+strlen(message),": ",2);
-    memcpy(message+strlen(message),content,strlen(content));
-    *(message+strlen(message)) = '\n';
+    const msg_tmpl_t *tmpl = fields->tmpl;
+    const char *value;
+    int i, at = 0;
+
+    for (i = 0; i < tmpl->nslots; i++)
+    {
+        emit(e, tmpl->text.data + at, tmpl->slot[i].at - at);
+        at = tmpl->slot[i].at;
+        value = 0;
+        switch (tmpl->slot[i].type)
+        {
+        case TMPL_SUBJECT:
+            emit(e,fields->subject,fields->subject_len);
+            break;
+        case TMPL_FROM:
+        case TMPL_TO:
+            if ((tmpl->slot[i].type == TMPL_FROM) == !!fields->inbound)
+                emit(e,fields->peer,fields->peer_len);
+            else
+                emit(e,tmpl->me.data,tmpl->me.len);
+            break;
+        case TMPL_DATE: value = fields->date; break;
+        case TMPL_MESSAGE_ID: value = fields->message_id; break;
+        case TMPL_REFERENCES: value = fields->references; break;
+        case TMPL_ID: value = fields->id; break;
+        case TMPL_ADDRESS: value = fields->address; break;
+        case TMPL_BODY:
+            if (fields->nparts)
+            {
+                emit_str(e,"Content-Type: multipart/mixed;\r\n boundary=\"");
+                emit_str(e,fields->boundary);
+                emit_str(e,"\"\r\n\r\n--");
+                emit_str(e,fields->boundary);
+                emit(e,"\r\n",2);
+            }
+            emit_text(e,fields);
+            break;
+        }
+        if (value)
+            emit_str(e,value);
+    }
+    emit(e, tmpl->text.data + at, tmpl->text.len - at);
 }
 
-void imap_add_identify(char* message,const char* id , const char *content)
+/* file name parameter; RFC 2231 when it is not plain ASCII */
+static void
+emit_filename(emit_t *e, const char *name)
 {
-    memcpy(message+strlen(message),id,strlen(id));
-    memcpy(message+strlen(message),": <",3);
-    memcpy(message+strlen(message),content,strlen(content));
-    memcpy(message+strlen(message),">\n",2);
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *p;
+    char esc[3];
+
+    for (p = (const unsigned char *)name; *p; p++)
+        if (*p < 0x20 || *p >= 0x7f || *p == '"' || *p == '\\' || *p == '%')
+            break;
+    if (!*p)
+    {
+        emit_str(e,"filename=\"");
+        emit_str(e,name);
+        emit(e,"\"",1);
+        return;
+    }
+    emit_str(e,"filename*=UTF-8''");
+    for (p = (const unsigned char *)name; *p; p++)
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+            strchr("!#$&+-.^_`|~", *p))
+            emit(e,(const char *)p,1);
+        else
+        {
+            esc[0] = '%';
+            esc[1] = hex[*p >> 4];
+            esc[2] = hex[*p & 15];
+            emit(e,esc,3);
+        }
 }
 
-void imap_add_contect(char *message,const char* content)
+static void
+emit_part_head(emit_t *e, const msg_fields_t *fields, const msg_part_t *part)
 {
-    char *encode;
-    size_t len,current;
-    *(message+strlen(message)) = '\n';
-    len = base64_encode_alloc(content,strlen(content),&encode);
-    current = 0;
-    if (len)
+    emit_str(e,"\r\n--");
+    emit_str(e,fields->boundary);
+    emit_str(e,"\r\nContent-Type: ");
+    emit_str(e,part->type);
+    emit_str(e,"\r\nContent-Transfer-Encoding: base64\r\n");
+    if (part->id && *part->id)
     {
-        while (len - current >= 76)
+        emit_str(e,"Content-ID: ");
+        if (*part->id == '<')
+            emit_str(e,part->id);
+        else
         {
-            memcpy(message+strlen(message),encode+current,76);
-            *(message+strlen(message)) = '\n';
-            current += 76;
+            emit(e,"<",1);
+            emit_str(e,part->id);
+            emit(e,">",1);
         }
-        if (len - current)
+        emit(e,"\r\n",2);
+    }
+    emit_str(e,"Content-Disposition: attachment;\r\n ");
+    emit_filename(e,part->name);
+    emit(e,"\r\n\r\n",4);
+}
+
+static void
+emit_close(emit_t *e, const msg_fields_t *fields)
+{
+    emit_str(e,"\r\n--");
+    emit_str(e,fields->boundary);
+    emit_str(e,"--\r\n");
+}
+
+/* size of segment SEG: 0 the head, then a header and the data of each
+   part, and the closing delimiter last */
+static size_t
+seg_size(const msg_fields_t *fields, int seg, const msg_part_t **part)
+{
+    emit_t e = { 0, 0 };
+
+    *part = seg ? &fields->parts[(seg - 1) / 2] : 0;
+    if (!seg)
+        emit_head(&e,fields);
+    else if (seg == 2 * fields->nparts + 1)
+        emit_close(&e,fields);
+    else if (!(*part)->map)
+        return 0; /* could not be read; left out */
+    else if (seg & 1)
+        emit_part_head(&e,fields,*part);
+    else
+        return BASE64_LINES_LENGTH ((*part)->size);
+    return e.n;
+}
+
+static void
+seg_emit(const msg_fields_t *fields, int seg, const msg_part_t *part, char *out)
+{
+    emit_t e = { out, 0 };
+
+    if (!seg)
+        emit_head(&e,fields);
+    else if (seg == 2 * fields->nparts + 1)
+        emit_close(&e,fields);
+    else
+        emit_part_head(&e,fields,part);
+}
+
+/* The write pass, resumable so that the driver can send a message of any
+   size through a fixed buffer. Headers are rendered straight to their
+   final place when they fit; attachments are base64 encoded line by line
+   from their mapping. Only leftovers that do not fit go through a carry
+   buffer. */
+static int
+stream_write(char *out, int off, int room, void *arg)
+{
+    msg_fields_t *fields = arg;
+    msg_stream_t *st = &fields->stream;
+    const msg_part_t *part;
+    size_t size, in, k;
+    int n = 0, nsegs = fields->nparts ? 2 * fields->nparts + 2 : 1;
+
+    if (!off)
+    {
+        st->seg = 0;
+        st->at = 0;
+        st->size = seg_size(fields, 0, &st->part);
+        st->carry_len = st->carry_off = 0;
+    }
+    while (n < room)
+    {
+        if (st->carry_off < st->carry_len)
+        {
+            k = st->carry_len - st->carry_off;
+            if (k > (size_t)(room - n))
+                k = room - n;
+            memcpy(out + n, st->carry + st->carry_off, k);
+            st->carry_off += k;
+            n += k;
+            continue;
+        }
+        if (st->seg == nsegs)
+            break;
+        if (st->at == st->size)
+        {
+            if (++st->seg < nsegs)
+                st->size = seg_size(fields, st->seg, &st->part);
+            st->at = 0;
+            continue;
+        }
+        size = st->size;
+        part = st->part;
+        if (!st->seg || (st->seg & 1) || st->seg == nsegs - 1)
+        {
+            if (size <= (size_t)(room - n))
+            {
+                seg_emit(fields, st->seg, part, out + n);
+                n += size;
+            }
+            else
+            {
+                st->spill = realloc(st->spill, size);
+                seg_emit(fields, st->seg, part, st->spill);
+                st->carry = st->spill;
+                st->carry_len = size;
+                st->carry_off = 0;
+            }
+            st->at = size;
+            continue;
+        }
+        in = st->at / (BASE64_LENGTH (LINE_IN) + 2) * LINE_IN;
+        k = (room - n) / (BASE64_LENGTH (LINE_IN) + 2) * LINE_IN;
+        if (k)
+        {
+            if (k > part->size - in)
+                k = part->size - in;
+            k = base64_encode_lines(part->map + in, k, out + n);
+            n += k;
+        }
+        else
+        {
+            k = part->size - in < LINE_IN ? part->size - in : LINE_IN;
+            k = base64_encode_lines(part->map + in, k, st->line);
+            st->carry = st->line;
+            st->carry_len = k;
+            st->carry_off = 0;
+        }
+        st->at += k;
+    }
+    return n;
+}
+
+/* The sizing pass: choose the body encoding, map the attachments and
+   compute the exact length of the message, so that it can be rendered
+   once into its final place, e.g. behind an IMAP APPEND command line.
+   FIELDS must stay valid until RENDER has been used; msg_tmpl_release()
+   frees what this sets up. Returns the bytes the body encoding saved over
+   base64. */
+size_t
+msg_tmpl_prepare(const msg_tmpl_t *tmpl, msg_fields_t *fields, msg_render_t *render)
+{
+    const msg_part_t *dummy;
+    msg_part_t *part;
+    struct stat st;
+    size_t size = 0;
+    int i, fd;
+
+    fields->tmpl = tmpl;
+    memset(&fields->stream, 0, sizeof(fields->stream));
+    if (fields->nparts)
+        snprintf(fields->boundary, sizeof(fields->boundary), "=_smssync_%.40s", fields->id);
+    for (i = 0; i < fields->nparts; i++)
+    {
+        part = &fields->parts[i];
+        part->map = 0;
+        part->size = 0;
+        if ((fd = open(part->path, O_RDONLY)) < 0)
+        {
+            perror(part->path);
+            continue;
+        }
+        if (!fstat(fd, &st) && st.st_size > 0)
         {
-            memcpy(message+strlen(message),encode+current,len-current);
-            *(message+strlen(message)) = '\n';
+            part->map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (part->map == MAP_FAILED)
+            {
+                perror(part->path);
+                part->map = 0;
+            }
+            else
+            {
+                part->size = st.st_size;
+                madvise((void *)part->map, part->size, MADV_SEQUENTIAL);
+            }
         }
-        free(encode);
+        close(fd);
     }
+    plan_body(fields);
+    for (i = 0; i < (fields->nparts ? 2 * fields->nparts + 2 : 1); i++)
+        size += seg_size(fields, i, &dummy);
+    render->len = size;
+    render->write = stream_write;
+    render->arg = fields;
+    return fields->saved;
 }
 
+void
+msg_tmpl_release(msg_fields_t *fields)
+{
+    int i;
+
+    for (i = 0; i < fields->nparts; i++)
+        if (fields->parts[i].map)
+            munmap((void *)fields->parts[i].map, fields->parts[i].size);
+    free(fields->stream.spill);
+}
@@ -1,19 +1,129 @@
 #ifndef BASE64_H
 #define BASE64_H
+
+#include "isync.h"
+
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define BASE64_LENGTH(inlen) ((((inlen) + 2) / 3) * 4)
+/* base64 wrapped into CRLF terminated lines of 76 characters */
+#define BASE64_LINES_LENGTH(inlen) (BASE64_LENGTH(inlen) + 2 * (((inlen) + 56) / 57))
+
 void
-imap_create_header(char* message, const char *subject);
+base64_encode (const char *in, size_t inlen, char *out, size_t outlen);
+size_t
+base64_encode_lines (const char *in, size_t inlen, char *out);
+size_t
+base64_encode_lines_scalar (const char *in, size_t inlen, char *out);
+
+#define RFC2047_PHRASE 1 /* display name: RFC 822 specials must be encoded too */
+/* upper bound of what rfc2047_encode() writes */
+#define RFC2047_LENGTH(inlen) (3 * (inlen) + 15 * ((inlen) / 8 + 2))
+size_t
+rfc2047_encode (const char *in, size_t inlen, int col, int flags, char *out);
+
+/* Per-channel header template: literal bytes with slots for the values
+   that change from event to event. */
+enum {
+    TMPL_SUBJECT,       /* contact name, after "<label> with " */
+    TMPL_FROM,
+    TMPL_TO,
+    TMPL_DATE,
+    TMPL_MESSAGE_ID,
+    TMPL_REFERENCES,
+    TMPL_ID,            /* event id, or "first-last" for a digest */
+    TMPL_ADDRESS,
+    TMPL_BODY,
+    TMPL_SLOTS
+};
+
+typedef struct {
+    msg_buf_t text;     /* literal header bytes, slots cut out */
+    msg_buf_t me;       /* our own address, rendered */
+    int subject_col;
+    int nslots;
+    struct {
+        int at;         /* offset into text */
+        int type;
+    } slot[TMPL_SLOTS];
+} msg_tmpl_t;
+
+enum { CTE_7BIT, CTE_QP, CTE_BASE64 };
+
+/* what the renderer needs to know about a body to pick its encoding */
+typedef struct {
+    size_t eightbit;    /* bytes >= 0x7f; none means pure ASCII */
+    size_t escapes;     /* bytes quoted-printable has to write as =XX */
+    size_t newlines;
+    size_t longest;     /* longest line, without the line end */
+    int ctrl;           /* control characters other than TAB and LF, e.g. CR or NUL */
+} body_class_t;
+
+/* Convert UTF-16 text to UTF-8 and classify it in the same pass. OUT
+   must hold 3 * LEN bytes. Unpaired surrogates become U+FFFD. Returns
+   the bytes written. */
+size_t
+body_from_utf16 (const unsigned short *in, size_t len, char *out, body_class_t *bc);
 
-void imap_add_address(char *message,const char* id, const char* name, const char* email);
+/* an attachment, e.g. an MMS picture; sent as a base64 part streamed from
+   the mapped file */
+typedef struct {
+    const char *type;   /* Content-Type */
+    const char *name;   /* file name for Content-Disposition */
+    const char *id;     /* Content-ID, may be null */
+    const char *path;
+    /* set up by msg_tmpl_prepare() */
+    const char *map;
+    size_t size;
+} msg_part_t;
 
-void imap_add_header(char* message,const char* id , const char *content);
+/* where the write pass is; see stream_write() */
+typedef struct {
+    int seg;
+    size_t size, at;    /* of the current segment */
+    const msg_part_t *part;
+    char *carry;
+    size_t carry_len, carry_off;
+    char *spill;
+    char line[80];
+} msg_stream_t;
 
-void imap_add_identify(char* message,const char* id , const char *content);
+typedef struct {
+    const char *peer;   /* the other party, from msg_render_address() */
+    int peer_len;
+    const char *subject; /* contact name, from msg_render_subject() */
+    int subject_len;
+    int inbound;
+    const char *date;
+    const char *message_id;
+    const char *references;
+    const char *id;
+    const char *address;
+    const char *body;
+    size_t body_len;
+    const body_class_t *body_class; /* from body_from_utf16(), or null */
+    msg_part_t *parts;  /* with any, the message becomes multipart/mixed */
+    int nparts;
+    /* filled in by msg_tmpl_prepare() */
+    const msg_tmpl_t *tmpl;
+    int cte;
+    size_t body_size;
+    size_t saved;
+    char boundary[64];
+    msg_stream_t stream;
+} msg_fields_t;
 
-void imap_add_contect(char *message,const char* content);
+void msg_tmpl_compile(msg_tmpl_t *tmpl, const char *label, const char *name,
+                      const char *email, const char *backup_time, int digest);
+void msg_tmpl_free(msg_tmpl_t *tmpl);
+void msg_render_address(msg_buf_t *message, const char *name, const char *email);
+void msg_render_subject(const msg_tmpl_t *tmpl, msg_buf_t *message, const char *name);
+size_t msg_tmpl_prepare(const msg_tmpl_t *tmpl, msg_fields_t *fields, msg_render_t *render);
+void msg_tmpl_release(msg_fields_t *fields);
 
 #ifdef __cplusplus
 }
@@ -32,9 +32,6 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-store_conf_t *stores;
-channel_conf_t *channels;
-
 int
 parse_bool( conffile_t *cfile )
 {
@@ -168,17 +165,17 @@ merge_ops( int cops, int *mops, int *sops )
 }
 
 int
-load_config( const char *where, int pseudo )
+load_config( config_t *conf, const char *where, int pseudo )
 {
 	conffile_t cfile;
-    store_conf_t *store, **storeapp = &stores;
-    channel_conf_t *channel, **channelapp = &channels;
+    store_conf_t *store, **storeapp = &conf->stores;
+    channel_conf_t *channel, **channelapp = &conf->channels;
     int err;
     char path[_POSIX_PATH_MAX];
 	char buf[1024];
 
 	if (!where) {
-		nfsnprintf( path, sizeof(path), "%s/." EXE "rc", Home );
+		nfsnprintf( path, sizeof(path), "%s/." EXE "rc", conf->home );
 		cfile.file = path;
 	} else
 		cfile.file = where;
@@ -199,7 +196,7 @@ load_config( const char *where, int pseudo )
     while (getcline( &cfile )) {
 		if (!cfile.cmd)
 			continue;
-		if (imap_driver.parse_store( &cfile, &store, &err ))
+		if (imap_driver.parse_store( conf, &cfile, &store, &err ))
 		{
 			if (store) {
 				if (!store->path)
@@ -208,6 +205,24 @@ load_config( const char *where, int pseudo )
 				storeapp = &store->next;
 				*storeapp = 0;
 			}
+        }else if (!strcasecmp( "Concurrency", cfile.cmd ))
+        {
+            conf->concurrency = parse_int( &cfile );
+        }else if (!strcasecmp( "SyntheticEvents", cfile.cmd ))
+        {
+            conf->synthetic_events = parse_int( &cfile );
+        }else if (!strcasecmp( "SyntheticSeed", cfile.cmd ))
+        {
+            conf->synthetic_seed = parse_int( &cfile );
+        }else if (!strcasecmp( "TrackerDatabase", cfile.cmd ))
+        {
+            conf->tracker_db = expand_strdup( cfile.val, conf->home );
+        }else if (!strcasecmp( "Daemon", cfile.cmd ))
+        {
+            conf->daemon = parse_bool( &cfile );
+        }else if (!strcasecmp( "KeepAlive", cfile.cmd ))
+        {
+            conf->keepalive = parse_int( &cfile );
         }else if (!strcasecmp( "Channel", cfile.cmd ))
         {
             channel = nfcalloc( sizeof(*channel) );
@@ -222,6 +237,8 @@ load_config( const char *where, int pseudo )
                     channel->label = nfstrdup(cfile.val);
                 else if (!strcasecmp( "Type", cfile.cmd ))
                     channel->type = nfstrdup(cfile.val);
+                else if (!strcasecmp( "Digest", cfile.cmd ))
+                    channel->digest = parse_bool( &cfile );
             }
 
             if(!channel->name || !channel->account || !channel->mail_box || !channel->label || !channel->type )
@@ -239,18 +256,31 @@ load_config( const char *where, int pseudo )
 	return err;
 }
 
+/* Generated events have timestamps of their own, so their watermarks go
+ * to a state file of their own; in the real one they would hide every
+ * older event of the phone from the next sync. */
+static void
+state_path( config_t *conf, char *path, int size )
+{
+    if (conf->synthetic_events > 0)
+        nfsnprintf( path, size, "%s/." EXE ".synthetic.state", conf->home );
+    else
+        nfsnprintf( path, size, "%s/." EXE ".state", conf->home );
+}
+
 int
-load_state_config( const char *where, int pseudo )
+load_state_config( config_t *conf, const char *where, int pseudo )
 {
     conffile_t cfile;
     int err;
     char path[_POSIX_PATH_MAX];
     char buf[1024];
-    char *sync_time;
+    char *sync_time, *store_name;
     channel_conf_t *channel;
+    store_conf_t *store;
 
     if (!where) {
-        nfsnprintf( path, sizeof(path), "%s/." EXE ".state", Home );
+        state_path( conf, path, sizeof(path) );
         cfile.file = path;
     } else
         cfile.file = where;
@@ -268,14 +298,14 @@ load_state_config( const char *where, int pseudo )
     cfile.line = 0;
 
     err = 0;
-    memset(stores->prefrence,0,25);
+    memset(conf->stores->prefrence,0,25);
 
     while (getcline( &cfile )) {
         if (!cfile.cmd)
             continue;
         if (!strcasecmp( "Preference", cfile.cmd ))
         {
-            memcpy(stores->prefrence,cfile.val,24);
+            memcpy(conf->stores->prefrence,cfile.val,24);
         }else if(!strcasecmp("Channel",cfile.cmd))
         {
             if(!(sync_time = next_arg(&cfile.rest)))
@@ -284,11 +314,20 @@ load_state_config( const char *where, int pseudo )
                          cfile.file, cfile.line,cfile.val);
                 continue;
             }
-            for(channel=channels;channel;channel=channel->next)
+            /* lines without a store predate multi-store support and
+               belong to the first store */
+            store = conf->stores;
+            if((store_name = next_arg(&cfile.rest)))
+                for(store=conf->stores;store;store=store->next)
+                    if(!strcmp(store->name, store_name))
+                        break;
+            if(!store)
+                continue;
+            for(channel=conf->channels;channel;channel=channel->next)
             {
                 if(!strcasecmp(channel->name, cfile.val))
                 {
-                    memcpy(channel->sync_time,sync_time,strlen(sync_time));
+                    strncpy(channel_state(channel, store)->sync_time,sync_time,24);
                     break;
                 }
             }
@@ -298,46 +337,70 @@ load_state_config( const char *where, int pseudo )
     return err;
 }
 
+/* The state is written to a temporary file, synced and renamed over the
+ * old one, so a crash leaves either the old or the new state behind. */
 int
-save_state_config( const char *where, int pseudo )
+save_state_config( config_t *conf, const char *where, int pseudo )
 {
     conffile_t cfile;
-    int err;
-    char path[_POSIX_PATH_MAX];
-    char message[100];
+    int err = 0;
+    char path[_POSIX_PATH_MAX], tmp[_POSIX_PATH_MAX];
 
     channel_conf_t *channel;
+    sync_state_t *state;
 
     if (!where) {
-        nfsnprintf( path, sizeof(path), "%s/." EXE ".state", Home );
+        state_path( conf, path, sizeof(path) );
         cfile.file = path;
     } else
         cfile.file = where;
+    nfsnprintf( tmp, sizeof(tmp), "%s.new", cfile.file );
 
     if (!pseudo)
         info( "Save configuration file %s\n", cfile.file );
 
-    if (!(cfile.fp = fopen( cfile.file, "w" ))) {
+    pthread_mutex_lock(&conf->state_lock);
+    if (!(cfile.fp = fopen( tmp, "w" ))) {
+        pthread_mutex_unlock(&conf->state_lock);
         perror( "Cannot open config file" );
         return 1;
     }
-    memset(message,0,sizeof(message));
-    sprintf(message,"Preference %s\n",stores->prefrence);
-    fputs(message,cfile.fp);
-    for(channel=channels;channel;channel=channel->next)
+    fprintf(cfile.fp,"Preference %s\n",conf->stores->prefrence);
+    for(channel=conf->channels;channel;channel=channel->next)
     {
-        if(channel->sync_time && *channel->sync_time)
-        {
-            memset(message,0,sizeof(message));
-            sprintf(message,"Channel %s %s\n",channel->name,channel->sync_time);
-            fputs(message,cfile.fp);
-        }
+        for(state=channel->states;state;state=state->next)
+            if(*state->sync_time)
+                fprintf(cfile.fp,"Channel %s %s %s\n",channel->name,state->sync_time,state->store->name);
     }
 
-    fclose (cfile.fp);
+    if (fflush( cfile.fp ) || fsync( fileno( cfile.fp ) ))
+        err = 1;
+    if (fclose( cfile.fp ))
+        err = 1;
+    if (!err && rename( tmp, cfile.file ))
+        err = 1;
+    if (err) {
+        perror( "Cannot save state file" );
+        unlink( tmp );
+    }
+    pthread_mutex_unlock(&conf->state_lock);
     return err;
 }
 
+sync_state_t *
+channel_state( channel_conf_t *channel, store_conf_t *store )
+{
+	sync_state_t *state, **stateapp;
+
+	for (stateapp = &channel->states; (state = *stateapp); stateapp = &state->next)
+		if (state->store == store)
+			return state;
+	state = nfcalloc( sizeof(*state) );
+	state->store = store;
+	*stateapp = state;
+	return state;
+}
+
 void
 parse_generic_store( store_conf_t *store, conffile_t *cfg, int *err )
 {
@@ -349,6 +412,8 @@ parse_generic_store( store_conf_t *store, conffile_t *cfg, int *err )
 		store->trash_only_new = parse_bool( cfg );
 	else if (!strcasecmp( "MaxSize", cfg->cmd ))
 		store->max_size = parse_size( cfg );
+	else if (!strcasecmp( "Connections", cfg->cmd ))
+		store->connections = parse_int( cfg );
 	else if (!strcasecmp( "MapInbox", cfg->cmd ))
 		store->map_inbox = nfstrdup( cfg->val );
 	else {
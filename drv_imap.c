@@ -106,7 +106,6 @@ typedef struct {
 
 struct imap_cmd;
 #define max_in_progress 50 /* make this configurable? */
-char *accountEmail;
 
 typedef struct imap {
 	int uidnext; /* from SELECT responses */
@@ -120,6 +119,8 @@ typedef struct imap {
 #if 1
 	SSL_CTX *SSLContext;
 #endif
+	arc4_t rs; /* TUID generator; per connection, so no locking is needed */
+	msg_buf_t wbuf; /* rendered APPENDs are staged here */
 	buffer_t buf; /* this is BIG, so put it last */
 } imap_t;
 
@@ -138,6 +139,10 @@ struct imap_cmd_cb {
 	int dlen;
 	int uid;
 	unsigned create:1, trycreate:1;
+	unsigned borrowed:1; /* data belongs to the caller; it is only sent */
+	void (*msg_done)( int sts, void *aux ); /* APPENDs issued by append_msg */
+	void *aux;
+	const msg_render_t *render; /* produces the literal when the command is sent */
 };
 
 struct imap_cmd {
@@ -408,6 +413,36 @@ buffer_gets( buffer_t * b, char **s )
 	/* not reached */
 }
 
+#define SEND_CHUNK 65536
+
+/* Render a literal into the staging buffer behind whatever is in it
+ * already, and send it SEND_CHUNK bytes at a time, so a message of any
+ * size goes out with constant memory. */
+static int
+send_rendered( imap_t *imap, const msg_render_t *render, int crlf )
+{
+	int off = 0, n, room;
+
+	for (;;) {
+		room = SEND_CHUNK - imap->wbuf.len;
+		if (room > render->len - off)
+			room = render->len - off;
+		n = render->write( msg_buf_reserve( &imap->wbuf, room ), off, room, render->arg );
+		imap->wbuf.len += n;
+		off += n;
+		if (off == render->len) {
+			if (crlf)
+				msg_buf_add( &imap->wbuf, "\r\n", 2 );
+		} else if (imap->wbuf.len < SEND_CHUNK)
+			continue;
+		if (socket_write( &imap->buf.sock, imap->wbuf.data, imap->wbuf.len ) != imap->wbuf.len)
+			return -1;
+		imap->wbuf.len = 0;
+		if (off == render->len)
+			return 0;
+	}
+}
+
 static struct imap_cmd *
 v_issue_imap_cmd( imap_store_t *ctx, struct imap_cmd_cb *cb,
                   const char *fmt, va_list ap )
@@ -429,7 +464,7 @@ v_issue_imap_cmd( imap_store_t *ctx, struct imap_cmd_cb *cb,
 	while (imap->literal_pending)
 		get_cmd_result( ctx, 0 );
 
-	bufl = nfsnprintf( buf, sizeof(buf), cmd->cb.data ? CAP(LITERALPLUS) ?
+	bufl = nfsnprintf( buf, sizeof(buf), cmd->cb.data || cmd->cb.render ? CAP(LITERALPLUS) ?
 	                   "%d %s{%d+}\r\n" : "%d %s{%d}\r\n" : "%d %s\r\n",
 	                   cmd->tag, cmd->cmd, cmd->cb.dlen );
 	if (Verbose) {
@@ -440,17 +475,31 @@ v_issue_imap_cmd( imap_store_t *ctx, struct imap_cmd_cb *cb,
 		else
 			printf( ">>> %d LOGIN <user> <pass>\n", cmd->tag );
 	}
+	if (cmd->cb.render && CAP(LITERALPLUS)) {
+		/* the message is rendered right where it is sent from */
+		imap->wbuf.len = 0;
+		msg_buf_add( &imap->wbuf, buf, bufl );
+		n = send_rendered( imap, cmd->cb.render, 1 );
+		cmd->cb.render = 0;
+		if (n) {
+			free( cmd->cmd );
+			free( cmd );
+			return NULL;
+		}
+		goto queue;
+	}
 	if (socket_write( &imap->buf.sock, buf, bufl ) != bufl) {
 		free( cmd->cmd );
 		free( cmd );
-		if (cb && cb->data)
+		if (cb && cb->data && !cb->borrowed)
 			free( cb->data );
 		return NULL;
 	}
 	if (cmd->cb.data) {
 		if (CAP(LITERALPLUS)) {
 			n = socket_write( &imap->buf.sock, cmd->cb.data, cmd->cb.dlen );
-			free( cmd->cb.data );
+			if (!cmd->cb.borrowed)
+				free( cmd->cb.data );
 			if (n != cmd->cb.dlen ||
 			    (n = socket_write( &imap->buf.sock, "\r\n", 2 )) != 2)
 			{
@@ -461,12 +510,18 @@ v_issue_imap_cmd( imap_store_t *ctx, struct imap_cmd_cb *cb,
 			cmd->cb.data = 0;
 		} else
 			imap->literal_pending = 1;
-	} else if (cmd->cb.cont)
+	} else if (cmd->cb.cont || cmd->cb.render)
 		imap->literal_pending = 1;
+  queue:
 	cmd->next = 0;
 	*imap->in_progress_append = cmd;
 	imap->in_progress_append = &cmd->next;
 	imap->num_in_progress++;
+	if (cmd->cb.render)
+		/* the literal follows the continuation request, and the
+		   renderer is only valid during this call */
+		while (imap->literal_pending && imap->buf.sock.fd != -1)
+			get_cmd_result( ctx, 0 );
 	return cmd;
 }
 
@@ -492,8 +547,9 @@ issue_imap_cmd_w( imap_store_t *ctx, struct imap_cmd_cb *cb, const char *fmt, ..
 	va_start( ap, fmt );
 	ret = v_issue_imap_cmd( ctx, cb, fmt, ap );
 	va_end( ap );
-	while (imap->num_in_progress > max_in_progress ||
-	       socket_pending( &imap->buf.sock ))
+	while (imap->buf.sock.fd != -1 &&
+	       (imap->num_in_progress > max_in_progress ||
+	        socket_pending( &imap->buf.sock )))
 		get_cmd_result( ctx, 0 );
 	return ret;
 }
@@ -967,9 +1023,16 @@ get_cmd_result( imap_store_t *ctx, struct imap_cmd *tcmd )
 			   it enforces a round-trip. */
 			cmdp = (struct imap_cmd *)((char *)imap->in_progress_append -
 			       offsetof(struct imap_cmd, next));
-			if (cmdp->cb.data) {
+			if (cmdp->cb.render) {
+				imap->wbuf.len = 0;
+				n = send_rendered( imap, cmdp->cb.render, 0 );
+				cmdp->cb.render = 0;
+				if (n)
+					return RESP_BAD;
+			} else if (cmdp->cb.data) {
 				n = socket_write( &imap->buf.sock, cmdp->cb.data, cmdp->cb.dlen );
-				free( cmdp->cb.data );
+				if (!cmdp->cb.borrowed)
+					free( cmdp->cb.data );
 				cmdp->cb.data = 0;
 				if (n != (int)cmdp->cb.dlen)
 					return RESP_BAD;
@@ -997,7 +1060,7 @@ get_cmd_result( imap_store_t *ctx, struct imap_cmd *tcmd )
 			if (!(*pcmdp = cmdp->next))
 				imap->in_progress_append = pcmdp;
 			imap->num_in_progress--;
-			if (cmdp->cb.cont || cmdp->cb.data)
+			if (cmdp->cb.cont || cmdp->cb.data || cmdp->cb.render)
 				imap->literal_pending = 0;
 			arg = next_arg( &cmd );
 			if (!strcmp( "OK", arg ))
@@ -1038,7 +1101,7 @@ get_cmd_result( imap_store_t *ctx, struct imap_cmd *tcmd )
 		  normal:
 			if (cmdp->cb.done)
 				cmdp->cb.done( ctx, cmdp, resp );
-			if (cmdp->cb.data)
+			if (cmdp->cb.data && !cmdp->cb.borrowed)
 				free( cmdp->cb.data );
 			free( cmdp->cmd );
 			free( cmdp );
@@ -1053,11 +1116,22 @@ static void
 imap_close_server( imap_store_t *ictx )
 {
 	imap_t *imap = ictx->imap;
+	struct imap_cmd *cmdp;
 
 	if (imap->buf.sock.fd != -1) {
 		imap_exec( ictx, 0, "LOGOUT" );
 		close( imap->buf.sock.fd );
 	}
+	/* whatever is still queued will never be answered */
+	while ((cmdp = imap->in_progress)) {
+		imap->in_progress = cmdp->next;
+		if (cmdp->cb.done)
+			cmdp->cb.done( ictx, cmdp, RESP_BAD );
+		if (cmdp->cb.data && !cmdp->cb.borrowed)
+			free( cmdp->cb.data );
+		free( cmdp->cmd );
+		free( cmdp );
+	}
 #if 1
 	if (imap->SSLContext)
 		SSL_CTX_free( imap->SSLContext );
@@ -1065,6 +1139,7 @@ imap_close_server( imap_store_t *ictx )
 	free_list( imap->ns_personal );
 	free_list( imap->ns_other );
 	free_list( imap->ns_shared );
+	free( imap->wbuf.data );
 	free( imap );
 }
 
@@ -1077,18 +1152,22 @@ imap_close_store( store_t *ctx )
 }
 
 #if 1
+static pthread_once_t ssl_once = PTHREAD_ONCE_INIT;
+
+static void
+init_ssl( void )
+{
+	SSL_library_init();
+	SSL_load_error_strings();
+}
+
 static int
 start_tls( imap_store_t *ctx )
 {
 	imap_t *imap = ctx->imap;
 	int ret;
-	static int ssl_inited;
 
-	if (!ssl_inited) {
-		SSL_library_init();
-		SSL_load_error_strings();
-		ssl_inited = 1;
-	}
+	pthread_once( &ssl_once, init_ssl );
 
         if (init_ssl_ctx( ctx ))
 		return 1;
@@ -1194,8 +1273,9 @@ imap_open_store( store_conf_t *conf, store_t *oldctx )
 	imap_store_t *ctx = (imap_store_t *)oldctx;
 	imap_t *imap;
 	char *arg, *rsp;
-	struct hostent *he;
+	struct addrinfo hints, *res;
 	struct sockaddr_in addr;
+	char addrstr[INET_ADDRSTRLEN];
 	int s, a[2], preauth;
 #if 1
 	int use_ssl;
@@ -1215,6 +1295,7 @@ imap_open_store( store_conf_t *conf, store_t *oldctx )
 	ctx->imap = imap = nfcalloc( sizeof(*imap) );
 	imap->buf.sock.fd = -1;
 	imap->in_progress_append = &imap->in_progress;
+	arc4_init( &imap->rs );
 
 	/* open connection to IMAP server */
 #if 1
@@ -1253,18 +1334,22 @@ imap_open_store( store_conf_t *conf, store_t *oldctx )
 		addr.sin_family = AF_INET;
 
 		info( "Resolving %s... ", srvc->host );
-		he = gethostbyname( srvc->host );
-		if (!he) {
-			perror( "gethostbyname" );
+		memset( &hints, 0, sizeof(hints) );
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if ((s = getaddrinfo( srvc->host, 0, &hints, &res ))) {
+			fprintf( stderr, "getaddrinfo: %s\n", gai_strerror( s ) );
 			goto bail;
 		}
 		info( "ok\n" );
 
-		addr.sin_addr.s_addr = *((int *) he->h_addr_list[0]);
+		addr.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+		freeaddrinfo( res );
 
 		s = socket( PF_INET, SOCK_STREAM, 0 );
 
-		info( "Connecting to %s:%hu... ", inet_ntoa( addr.sin_addr ), ntohs( addr.sin_port ) );
+		info( "Connecting to %s:%hu... ", inet_ntop( AF_INET, &addr.sin_addr, addrstr, sizeof(addrstr) ),
+		      ntohs( addr.sin_port ) );
 		if (connect( s, (struct sockaddr *)&addr, sizeof(addr) )) {
 			close( s );
 			perror( "connect" );
@@ -1546,6 +1631,45 @@ imap_trash_msg( store_t *gctx, message_t *msg )
 	                    msg->uid, ctx->prefix, gctx->conf->trash );
 }
 
+/* Remove the copies of a message that is about to be sent again. The
+ * SEARCH reports just the first UID, so it is repeated until nothing
+ * undeleted is left; only those messages are expunged, if the server
+ * can do that. */
+static int
+imap_delete_msgid( store_t *gctx, const char *message_id )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	imap_t *imap = ctx->imap;
+	struct imap_cmd_cb cb;
+	int ret, uid, n, bl = 0;
+	char buf[1000];
+
+	/* the mailbox stays selected until the next channel resets uidvalidity */
+	if (!gctx->uidvalidity &&
+	    (ret = imap_exec_b( ctx, 0, "SELECT \"%s%s\"",
+	                        strcmp( gctx->name, "INBOX" ) ? ctx->prefix : "", gctx->name )) != DRV_OK)
+		return ret == DRV_BOX_BAD ? DRV_OK : ret; /* no mailbox yet, so nothing to remove */
+
+	for (n = 0; n < 100 && bl < (int)sizeof(buf) - 12; n++) {
+		memset( &cb, 0, sizeof(cb) );
+		uid = 0;
+		cb.uid = -1; /* we're looking for a UID */
+		cb.ctx = &uid;
+		if ((ret = imap_exec_m( ctx, &cb, "UID SEARCH UNDELETED HEADER Message-ID \"<%s>\"", message_id )) != DRV_OK)
+			return ret;
+		if (!uid)
+			break;
+		if ((ret = imap_exec_b( ctx, 0, "UID STORE %d +FLAGS.SILENT (\\Deleted)", uid )) != DRV_OK)
+			return ret;
+		bl += sprintf( buf + bl, bl ? ",%d" : "%d", uid );
+	}
+	if (!bl)
+		return DRV_OK;
+	if (CAP(UIDPLUS))
+		return imap_exec_b( ctx, 0, "UID EXPUNGE %s", buf );
+	return imap_exec_b( ctx, 0, "EXPUNGE" );
+}
+
 #define TUIDL 8
 
 static int
@@ -1583,11 +1707,12 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int *uid )
 				goto nloop;
 			}
 		/* invalid message */
-		free( fmap );
+		if (!data->borrowed)
+			free( fmap );
 		return DRV_MSG_BAD;
 	 mktid:
 		for (j = 0; j < TUIDL; j++)
-			sprintf( tuid + j * 2, "%02x", arc4_getbyte() );
+			sprintf( tuid + j * 2, "%02x", arc4_getbyte( &imap->rs ) );
 		extra += 8 + TUIDL * 2 + 2;
 	}
 	if (nocr)
@@ -1628,7 +1753,8 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int *uid )
 	} else
 		memcpy( buf, fmap + i, len - i );
 
-	free( fmap );
+	if (!data->borrowed)
+		free( fmap );
 
 	d = 0;
 	if (data->flags) {
@@ -1671,6 +1797,94 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int *uid )
 	return imap_exec_m( ctx, &cb, "UID SEARCH HEADER X-TUID %s", tuid );
 }
 
+static void
+imap_append_done( imap_store_t *ctx, struct imap_cmd *cmd, int response )
+{
+	(void) ctx;
+	cmd->cb.msg_done( response == RESP_OK ? DRV_OK :
+	                  response == RESP_NO ? DRV_MSG_BAD : DRV_STORE_BAD, cmd->cb.aux );
+}
+
+/* Unlike imap_store_msg this does not wait for the tagged reply, so many
+ * APPENDs can be in flight on one connection. No UID is reported back;
+ * use check() to wait for the outstanding replies. A borrowed CRLF message
+ * is sent as is, so it must stay valid until done has been called. */
+static int
+imap_append_msg( store_t *gctx, msg_data_t *data, void (*done)( int sts, void *aux ), void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	struct imap_cmd_cb cb;
+	char *buf;
+	const char *prefix;
+	int i, d, extra;
+	char flagstr[128];
+
+	memset( &cb, 0, sizeof(cb) );
+
+	if (data->crlf) {
+		cb.dlen = data->len;
+		cb.data = data->data;
+		cb.borrowed = data->borrowed;
+	} else {
+		extra = 0;
+		for (i = 0; i < data->len; i++)
+			if (data->data[i] == '\n')
+				extra++;
+		cb.dlen = data->len + extra;
+		buf = cb.data = nfmalloc( cb.dlen );
+		for (i = 0; i < data->len; i++)
+			if (data->data[i] == '\n') {
+				*buf++ = '\r';
+				*buf++ = '\n';
+			} else
+				*buf++ = data->data[i];
+		if (!data->borrowed)
+			free( data->data );
+	}
+
+	d = 0;
+	if (data->flags) {
+		d = imap_make_flags( data->flags, flagstr );
+		flagstr[d++] = ' ';
+	}
+	flagstr[d] = 0;
+
+	prefix = !strcmp( gctx->name, "INBOX" ) ? "" : ctx->prefix;
+	cb.create = (gctx->opts & OPEN_CREATE) != 0;
+	cb.done = imap_append_done;
+	cb.msg_done = done;
+	cb.aux = aux;
+	if (!issue_imap_cmd_w( ctx, &cb, "APPEND \"%s%s\" %s", prefix, gctx->name, flagstr ))
+		return DRV_STORE_BAD;
+	gctx->count++;
+	return DRV_OK;
+}
+
+/* Like imap_append_msg, but the message is rendered piecewise into the
+ * staging buffer right behind the APPEND command line, so it is written
+ * exactly once before it goes to the socket, and memory use does not
+ * depend on its size. It has been sent when this returns. */
+static int
+imap_append_render( store_t *gctx, const msg_render_t *render, void (*done)( int sts, void *aux ), void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	struct imap_cmd_cb cb;
+	const char *prefix;
+
+	memset( &cb, 0, sizeof(cb) );
+	cb.dlen = render->len;
+	cb.render = render;
+	prefix = !strcmp( gctx->name, "INBOX" ) ? "" : ctx->prefix;
+	cb.create = (gctx->opts & OPEN_CREATE) != 0;
+	cb.done = imap_append_done;
+	cb.msg_done = done;
+	cb.aux = aux;
+	if (!issue_imap_cmd_w( ctx, &cb, "APPEND \"%s%s\" ", prefix, gctx->name ))
+		return DRV_STORE_BAD;
+	gctx->count++;
+	return DRV_OK;
+}
+
 static int
 imap_list( store_t *gctx, string_list_t **retb )
 {
@@ -1688,25 +1902,51 @@ imap_list( store_t *gctx, string_list_t **retb )
 static int
 imap_check( store_t *gctx )
 {
-	(void) gctx;
-	/* flush queue here */
-	return DRV_OK;
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	imap_t *imap = ctx->imap;
+
+	/* flush queue */
+	while (imap->num_in_progress) {
+		if (imap->buf.sock.fd == -1)
+			return DRV_STORE_BAD;
+		get_cmd_result( ctx, 0 );
+	}
+	return imap->buf.sock.fd == -1 ? DRV_STORE_BAD : DRV_OK;
+}
+
+static int
+imap_poll( store_t *gctx )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	imap_t *imap = ctx->imap;
+
+	while (imap->buf.sock.fd != -1 && socket_pending( &imap->buf.sock ))
+		get_cmd_result( ctx, 0 );
+	return imap->buf.sock.fd == -1 ? DRV_STORE_BAD : DRV_OK;
 }
 
-imap_server_conf_t *servers, **serverapp = &servers;
+static int
+imap_noop( store_t *gctx )
+{
+	int ret;
+
+	if ((ret = imap_check( gctx )) != DRV_OK)
+		return ret;
+	return imap_exec_b( (imap_store_t *)gctx, 0, "NOOP" );
+}
 
 static int
-imap_parse_store( conffile_t *cfg, store_conf_t **storep, int *err )
+imap_parse_store( config_t *conf, conffile_t *cfg, store_conf_t **storep, int *err )
 {
 	imap_store_conf_t *store;
-	imap_server_conf_t *server, *srv, sserver;
+	imap_server_conf_t *server, *srv, sserver, **serverapp;
 	int acc_opt = 0;
 
 	if (!strcasecmp( "IMAPAccount", cfg->cmd )) {
 		server = nfcalloc( sizeof(*server) );
 		server->name = nfstrdup( cfg->val );
+		for (serverapp = (imap_server_conf_t **)&conf->servers; *serverapp; serverapp = &(*serverapp)->next);
 		*serverapp = server;
-		serverapp = &server->next;
 		store = 0;
 		*storep = 0;
 	} else if (!strcasecmp( "IMAPStore", cfg->cmd )) {
@@ -1750,7 +1990,8 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep, int *err )
 		else if (!strcasecmp( "User", cfg->cmd ))
         {
 			server->user = nfstrdup( cfg->val );
-            accountEmail = nfstrdup(cfg->val);
+            free(conf->account_email);
+            conf->account_email = nfstrdup(cfg->val);
         }
 		else if (!strcasecmp( "Pass", cfg->cmd ))
 			server->pass = nfstrdup( cfg->val );
@@ -1758,7 +1999,7 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep, int *err )
 			server->port = parse_int( cfg );
 #if 1
 		else if (!strcasecmp( "CertificateFile", cfg->cmd )) {
-			server->cert_file = expand_strdup( cfg->val );
+			server->cert_file = expand_strdup( cfg->val, conf->home );
 			if (access( server->cert_file, R_OK )) {
 				fprintf( stderr, "%s:%d: CertificateFile '%s': %s\n",
 				         cfg->file, cfg->line, server->cert_file, strerror( errno ) );
@@ -1781,7 +2022,7 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep, int *err )
 			server->tunnel = nfstrdup( cfg->val );
 		else if (store) {
 			if (!strcasecmp( "Account", cfg->cmd )) {
-				for (srv = servers; srv; srv = srv->next)
+				for (srv = conf->servers; srv; srv = srv->next)
 					if (srv->name && !strcmp( srv->name, cfg->val ))
 						goto gotsrv;
 				fprintf( stderr, "%s:%d: unknown IMAP account '%s'\n",
@@ -1836,8 +2077,13 @@ struct driver imap_driver = {
 	imap_select,
 	imap_fetch_msg,
 	imap_store_msg,
+	imap_append_msg,
+	imap_append_render,
 	imap_set_flags,
 	imap_trash_msg,
+	imap_delete_msgid,
 	imap_check,
+	imap_poll,
+	imap_noop,
 	imap_close
 };
@@ -27,6 +27,8 @@
 #include <sys/types.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 
 #define as(ar) (sizeof(ar)/sizeof(ar[0]))
 
@@ -80,6 +82,7 @@ typedef struct store_conf {
 	char *map_inbox;
 	char *trash;
 	unsigned max_size; /* off_t is overkill */
+	int connections; /* size of the upload connection pool */
 	unsigned trash_remote_new:1, trash_only_new:1;
     char prefrence[25]; /* prefrence is 24 bit */
 } store_conf_t;
@@ -89,6 +92,13 @@ typedef struct string_list {
 	char string[1];
 } string_list_t;
 
+/* per-store watermark of a channel; one line each in the state file */
+typedef struct sync_state {
+	struct sync_state *next;
+	store_conf_t *store;
+	char sync_time[25];
+} sync_state_t;
+
 typedef struct channel_conf {
 	struct channel_conf *next;
 	char *name;
@@ -96,9 +106,26 @@ typedef struct channel_conf {
     char *mail_box;
     char *label;
     char *type;
-    char sync_time[25];
+    int digest; /* one message per contact and day */
+    sync_state_t *states;
 } channel_conf_t;
 
+/* Everything read from ~/.mbsyncrc and the state file. Independent
+ * configs can be used from different threads at the same time. */
+typedef struct config {
+	const char *home;
+	store_conf_t *stores;
+	channel_conf_t *channels;
+	void *servers; /* IMAPAccount sections; private to drv_imap.c */
+	char *account_email;
+	int concurrency; /* channels uploading at once */
+	int synthetic_events, synthetic_seed; /* generate events instead, for benchmarks */
+	char *tracker_db; /* read events straight from tracker's SQLite file */
+	int daemon; /* stay up and sync new events as they come */
+	int keepalive; /* seconds between pings of idle connections */
+	pthread_mutex_t state_lock; /* serializes state file writes */
+} config_t;
+
 typedef struct group_conf {
 	struct group_conf *next;
 	char *name;
@@ -160,15 +187,32 @@ typedef struct {
 	int len;
 	unsigned char flags;
 	unsigned char crlf:1;
+	unsigned char borrowed:1; /* data is owned by the caller and must not be freed */
 } msg_data_t;
 
+/* growable message buffer; the renderers append CRLF-terminated lines */
+typedef struct {
+	char *data;
+	int len;
+	int size;
+} msg_buf_t;
+
+/* a message of len CRLF bytes that is rendered on demand, in pieces:
+ * write() puts the next at most room bytes at out and returns how many.
+ * Calls are sequential; off is where the piece starts, and 0 starts over. */
+typedef struct {
+	int len;
+	int (*write)( char *out, int off, int room, void *arg );
+	void *arg;
+} msg_render_t;
+
 #define DRV_OK          0
 #define DRV_MSG_BAD     -1
 #define DRV_BOX_BAD     -2
 #define DRV_STORE_BAD   -3
 
 struct driver {
-	int (*parse_store)( conffile_t *cfg, store_conf_t **storep, int *err );
+	int (*parse_store)( config_t *conf, conffile_t *cfg, store_conf_t **storep, int *err );
 	store_t *(*open_store)( store_conf_t *conf, store_t *oldctx );
 	void (*close_store)( store_t *ctx );
 	int (*list)( store_t *ctx, string_list_t **boxes );
@@ -176,9 +220,14 @@ struct driver {
 	int (*select)( store_t *ctx, int minuid, int maxuid, int *excs, int nexcs );
 	int (*fetch_msg)( store_t *ctx, message_t *msg, msg_data_t *data );
 	int (*store_msg)( store_t *ctx, msg_data_t *data, int *uid ); /* if uid is null, store to trash */
+	int (*append_msg)( store_t *ctx, msg_data_t *data, void (*done)( int sts, void *aux ), void *aux ); /* pipelined, no UID; done is called iff DRV_OK is returned */
+	int (*append_render)( store_t *ctx, const msg_render_t *render, void (*done)( int sts, void *aux ), void *aux ); /* ditto, rendered straight into the send buffer; optional */
 	int (*set_flags)( store_t *ctx, message_t *msg, int uid, int add, int del ); /* msg can be null, therefore uid as a fallback */
 	int (*trash_msg)( store_t *ctx, message_t *msg ); /* This may expunge the original message immediately, but it needn't to */
+	int (*delete_msgid)( store_t *ctx, const char *message_id ); /* expunge the mailbox's messages with this Message-ID, given without the angle brackets; optional */
 	int (*check)( store_t *ctx ); /* IMAP-style: flush */
+	int (*poll)( store_t *ctx ); /* take the replies that have arrived, without waiting; optional */
+	int (*noop)( store_t *ctx ); /* flush and ping, so an idle login stays up */
 	int (*close)( store_t *ctx ); /* IMAP-style: expunge inclusive */
 };
 
@@ -187,8 +236,6 @@ struct driver {
 
 extern int Pid;
 extern char Hostname[256];
-extern const char *Home;
-extern char *accountEmail;
 
 
 /* util.c */
@@ -209,6 +256,35 @@ void free_generic_messages( message_t * );
 
 void strip_cr( msg_data_t *msgdata );
 
+void msg_buf_init( msg_buf_t *buf );
+char *msg_buf_reserve( msg_buf_t *buf, int len );
+void msg_buf_add( msg_buf_t *buf, const char *str, int len );
+
+/* formats times for many events in a row; one per thread. The zone
+ * offset comes from localtime_r(), asked for the first and last second
+ * of each UTC day and bisected for the change when they differ, and is
+ * cached for the last DATE_FMT_DAYS days seen; a zone that changes its
+ * offset twice in one UTC day is not supported. The date prefixes are
+ * laid out once per local day. */
+#define DATE_FMT_DAYS 64
+typedef struct {
+	struct {
+		long day; /* UTC day number, -1 if unused */
+		long change; /* offset is off[1] from here on */
+		int off[2];
+	} zone[DATE_FMT_DAYS];
+	long day; /* local day of the prefixes below */
+	char rfc5322[20]; /* "Mon, 3 Feb 2014 " */
+	int rfc5322_len;
+	char stamp[12]; /* "2014-02-03-" */
+} date_fmt_t;
+
+#define RFC5322_DATE_LENGTH 32
+
+void date_fmt_init( date_fmt_t *fmt );
+int date_fmt_rfc5322( date_fmt_t *fmt, time_t t, char *out );
+int date_fmt_stamp( date_fmt_t *fmt, time_t t, int msec, char *out );
+
 void *nfmalloc( size_t sz );
 void *nfcalloc( size_t sz );
 void *nfrealloc( void *mem, size_t sz );
@@ -218,12 +294,18 @@ int nfasprintf( char **str, const char *fmt, ... );
 int nfsnprintf( char *buf, int blen, const char *fmt, ... );
 void ATTR_NORETURN oob( void );
 
-char *expand_strdup( const char *s );
+char *expand_strdup( const char *s, const char *home );
 
 void sort_ints( int *arr, int len );
 
-void arc4_init( void );
-unsigned char arc4_getbyte( void );
+long long get_usec( void );
+
+typedef struct {
+	unsigned char i, j, s[256];
+} arc4_t;
+
+void arc4_init( arc4_t *rs );
+unsigned char arc4_getbyte( arc4_t *rs );
 
 /* sync.c */
 
@@ -238,31 +320,37 @@ int sync_boxes( store_t *, const char *,
 
 /* config.c */
 
-extern channel_conf_t *channels;
-extern store_conf_t *stores;
-
 int parse_bool( conffile_t *cfile );
 int parse_int( conffile_t *cfile );
 int parse_size( conffile_t *cfile );
 int getcline( conffile_t *cfile );
 int merge_ops( int cops, int *mops, int *sops );
-int load_config( const char *filename, int pseudo );
+int load_config( config_t *conf, const char *filename, int pseudo );
 void parse_generic_store( store_conf_t *store, conffile_t *cfg, int *err );
 
 /* drv_*.c */
 extern driver_t maildir_driver, imap_driver;
-int
-sms_imap_sync_one(const char *message);
-void sms_imap_close();
-int sms_imap_init();
-int sms_imap_config();
-int sms_imap_select_mailbox(const char* mailBox);
 
-extern char sync_date[50];
+/* an upload session: its own connections to every store */
+typedef struct sync_session sync_session_t;
+
+int
+sms_imap_sync_render(sync_session_t *session, const msg_render_t *render, const char *stamp, const char *commit);
+int sms_imap_sync_buffer(sync_session_t *session, char *data, int len, const char *stamp, const char *commit);
+int sms_imap_sync_replace(sync_session_t *session, const msg_render_t *render, const char *message_id, const char *stamp, const char *commit);
+void sms_imap_close(sync_session_t *session);
+sync_session_t *sms_imap_init(config_t *conf, int share);
+int sms_imap_config(config_t *conf);
+const char *sms_imap_begin_channel(sync_session_t *session, channel_conf_t *channel);
+int sms_imap_checkpoint(sync_session_t *session, int final);
+int sms_imap_refresh(sync_session_t *session, int ping);
+
+sync_state_t *
+channel_state( channel_conf_t *channel, store_conf_t *store );
 int
-save_state_config( const char *where, int pseudo );
+save_state_config( config_t *conf, const char *where, int pseudo );
 int
-load_state_config( const char *where, int pseudo );
+load_state_config( config_t *conf, const char *where, int pseudo );
 #ifdef __cplusplus
 }
 #endif
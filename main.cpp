@@ -8,39 +8,390 @@
 #include <QContactOnlineAccount>
 #include <QContactDetailFilter>
 #include <QFile>
+#include <QFileInfo>
+#include <QVector>
+#include <CommHistory/MessagePart>
 #include "isync.h"
 #include "qmlapplicationviewer.h"
 #include "base64.h"
 #include "syncmessagemodel.h"
+#include "synceventgenerator.h"
+#include "syncsqlitesource.h"
+#include "syncwatcher.h"
+#include "pool.h"
 
 using namespace CommHistory;
 QTM_USE_NAMESPACE;
 
 const char refrence_format[] = "%1.%2@n9-sms-backup-local";
-const char message_header_format[] = "%1 with %2";
 const char sync_date_format[] = "yyyy-MM-dd-hh:mm:ss:zzz";
 
+/* a contact as it goes into the message, rendered once */
 struct SMSSyncContact{
-    QString name;
-    QString email;
+    QByteArray name;        /* UTF-8, to re-render the subject for another channel */
+    QByteArray address;     /* "Name <email>", encoded */
+    QByteArray subject;     /* the name, encoded for the subject */
+    int subjectCol;
 };
 
-QString getTimeZone()
+/* one contact's events of one day, for channels in digest mode */
+struct SMSSyncDigest{
+    QString number;
+    QDate day;
+    time_t first;
+    int groupId;
+    QByteArray firstId;
+    QByteArray lastId;
+    QByteArray stamp;       /* of the last event */
+    QByteArray transcript;
+};
+
+/* what an event's message is rendered from; once collected it is only
+   read, so the render pool can work on it */
+struct SMSSyncEvent{
+    QByteArray peer;        /* the contact's, shared with the cache */
+    QByteArray subject;
+    bool inbound;
+    QByteArray date;
+    QByteArray messageId;
+    QByteArray references;
+    QByteArray id;
+    QByteArray address;
+    QByteArray body;
+    body_class_t bodyClass; /* worked out while converting the body */
+    QByteArray stamp;
+    QList<QByteArray> partStrings;  /* type, name, id and path per attachment */
+    size_t saved;           /* set by whoever renders it */
+};
+
+/* A channel is a pipeline: the main thread fetches events a page at a
+   time, collects them and resolves contacts, the render pool turns them
+   into messages, and an upload thread sends them in order and writes
+   checkpoints. The main thread fetches the next page while the upload
+   thread works on the last one, but stays at most pageQueue pages
+   ahead, so memory is bounded by the page size however long the
+   history. A big backlog is cut into time slices that tracker queries
+   side by side, each a page ahead, read back in order. Up to
+   Concurrency channels upload at once, each over its own session;
+   collecting stays on the main thread, one channel after the other,
+   with one contact cache for all of them. */
+static const int pageSize = 1000;
+static const int pageQueue = 2;
+static const int maxSlices = 4;         /* queried side by side */
+static const int sliceEvents = 20000;
+static const int poolBatch = 64;
+static const int poolBudget = 8 << 20;  /* rendered messages not sent yet */
+static const int publishEvery = 16;
+static const int batchDelay = 2000;    /* ms from a new event to its sync, in daemon mode */
+
+struct SMSSyncPipeline;
+
+/* a page of events with its own render pool */
+struct SMSSyncPage{
+    SMSSyncPipeline *pipe;
+    QVector<SMSSyncEvent> store;    /* sized up front, so events never move */
+    SMSSyncEvent *events;
+    int total;
+    int first;              /* events in the pages before */
+    render_pool_t *pool;
+    SMSSyncPage *next;
+};
+
+struct SMSSyncPipeline{
+    const char *name;       /* of the channel */
+    msg_tmpl_t tmpl;
+    sync_session_t *session;
+    quint64 saved;
+    long long started;
+    long long collectTime;  /* set before the last page is queued */
+    long long busy;         /* upload thread, in the session */
+    render_pool_stats_t stats;  /* of all pages */
+
+    /* guarded by lock */
+    pthread_mutex_t lock;
+    pthread_cond_t queued;  /* a page was queued, or the last one */
+    pthread_cond_t room;    /* a page was done with, or the upload failed */
+    SMSSyncPage *head, **tail;
+    int pages;
+    bool collected;         /* no more pages coming */
+    bool failed;
+    bool threaded;          /* else nobody takes pages while collecting */
+
+    bool done;              /* guarded by slotLock */
+};
+
+/* a session and the channel it is uploading */
+struct SMSSyncSlot{
+    sync_session_t *session;
+    SMSSyncPipeline *pipe;
+    pthread_t thread;
+    bool failed;            /* an upload on it failed this pass */
+};
+
+static pthread_mutex_t slotLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slotFree = PTHREAD_COND_INITIALIZER;
+
+static void fillFields(const SMSSyncEvent &event,msg_fields_t *fields,QVector<msg_part_t> &parts)
+{
+    for (int p = 0; p+3 < event.partStrings.size(); p += 4)
+    {
+        msg_part_t part;
+        part.type = event.partStrings.at(p).constData();
+        part.name = event.partStrings.at(p+1).constData();
+        part.id = event.partStrings.at(p+2).constData();
+        part.path = event.partStrings.at(p+3).constData();
+        parts.append(part);
+    }
+    fields->peer = event.peer.constData();
+    fields->peer_len = event.peer.size();
+    fields->subject = event.subject.constData();
+    fields->subject_len = event.subject.size();
+    fields->inbound = event.inbound;
+    fields->date = event.date.constData();
+    fields->message_id = event.messageId.constData();
+    fields->references = event.references.constData();
+    fields->id = event.id.constData();
+    fields->address = event.address.constData();
+    fields->body = event.body.constData();
+    fields->body_len = event.body.size();
+    fields->body_class = &event.bodyClass;
+    fields->parts = parts.data();
+    fields->nparts = parts.size();
+}
+
+/* runs on a pool thread; messages with attachments are left to the
+   sender, which streams them from their files */
+static int renderEvent(void *arg,int i,msg_buf_t *out)
+{
+    SMSSyncPage *page = (SMSSyncPage *)arg;
+    SMSSyncPipeline *pipe = page->pipe;
+    SMSSyncEvent &event = page->events[i];
+    if (!event.partStrings.isEmpty())
+        return -1;
+    QVector<msg_part_t> parts;
+    msg_fields_t fields;
+    msg_render_t render;
+    fillFields(event,&fields,parts);
+    event.saved = msg_tmpl_prepare(&pipe->tmpl,&fields,&render);
+    out->len = render.write(msg_buf_reserve(out,render.len),0,render.len,render.arg);
+    msg_tmpl_release(&fields);
+    return 0;
+}
+
+/* The upload stage; the session is only used from here until it returns.
+   Returns nonzero if every store failed. */
+static int uploadEvents(SMSSyncPage *page)
+{
+    SMSSyncPipeline *pipe = page->pipe;
+    msg_buf_t buf;
+    int ret, failed = 0;
+
+    for (int i = 0; (ret = render_pool_take(page->pool,i,&buf)) <= 0; i++)
+    {
+        long long start = get_usec();
+        SMSSyncEvent &event = page->events[i];
+        int n = page->first+i;
+        if (!ret)
+        {
+            failed = sms_imap_sync_buffer(pipe->session,buf.data,buf.len,event.stamp.constData(),0);
+        }
+        else
+        {
+            QVector<msg_part_t> parts;
+            msg_fields_t fields;
+            msg_render_t render;
+            fillFields(event,&fields,parts);
+            event.saved = msg_tmpl_prepare(&pipe->tmpl,&fields,&render);
+            failed = sms_imap_sync_render(pipe->session,&render,event.stamp.constData(),0);
+            msg_tmpl_release(&fields);
+        }
+        pipe->saved += event.saved;
+        if(failed)
+        {
+            /* every store failed */
+            qDebug() << pipe->name << "sync network error!";
+            pipe->busy += get_usec() - start;
+            break;
+        }
+        if(page->total-i <= 10 || (n%10 == 9))
+            qDebug() << pipe->name << (n+1) <<" synced!";
+
+        /* backup status every 10 backups */
+        if(n%10 == 9)
+            sms_imap_checkpoint(pipe->session,0);
+        pipe->busy += get_usec() - start;
+    }
+    return failed;
+}
+
+/* Hand a page to the upload thread, waiting while it is pageQueue pages
+   behind. Returns nonzero once the upload failed. */
+static int queuePage(SMSSyncPipeline *pipe,SMSSyncPage *page)
+{
+    int failed;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->threaded && pipe->pages >= pageQueue && !pipe->failed)
+        pthread_cond_wait(&pipe->room,&pipe->lock);
+    page->next = 0;
+    *pipe->tail = page;
+    pipe->tail = &page->next;
+    pipe->pages++;
+    pthread_cond_signal(&pipe->queued);
+    failed = pipe->failed;
+    pthread_mutex_unlock(&pipe->lock);
+    return failed;
+}
+
+static void lastPage(SMSSyncPipeline *pipe)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->collected = true;
+    pthread_cond_signal(&pipe->queued);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/* a channel's upload thread */
+static void *runChannel(void *arg)
+{
+    SMSSyncPipeline *pipe = (SMSSyncPipeline *)arg;
+    render_pool_stats_t stats;
+    SMSSyncPage *page;
+    bool failed = false;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pipe->lock);
+        while (!pipe->head && !pipe->collected)
+            pthread_cond_wait(&pipe->queued,&pipe->lock);
+        if ((page = pipe->head))
+        {
+            if (!(pipe->head = page->next))
+                pipe->tail = &pipe->head;
+        }
+        pthread_mutex_unlock(&pipe->lock);
+        if (!page)
+            break;
+
+        /* after a failure the pages are only cleared away, and the
+           collector learns at its next publish */
+        if (failed || uploadEvents(page))
+        {
+            failed = true;
+            render_pool_cancel(page->pool);
+        }
+        render_pool_stop(page->pool,&stats);
+        pipe->stats.threads = stats.threads;
+        pipe->stats.render_busy += stats.render_busy;
+        pipe->stats.render_idle += stats.render_idle;
+        pipe->stats.wait_produce += stats.wait_produce;
+        pipe->stats.wait_render += stats.wait_render;
+        delete page;
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->pages--;
+        pipe->failed = failed;
+        pthread_cond_signal(&pipe->room);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+    sms_imap_checkpoint(pipe->session,1);
+
+    /* the busiest stage is the one that limits the channel */
+    long long elapsed = get_usec() - pipe->started;
+    if (!elapsed)
+        elapsed = 1;
+    stats = pipe->stats;
+    qDebug() << pipe->name << "stages: collect" << 100*pipe->collectTime/elapsed << "% busy,"
+             << "render" << 100*stats.render_busy/(stats.threads ? stats.threads*elapsed : elapsed)
+             << "% busy on" << stats.threads << "threads,"
+             << "upload" << 100*pipe->busy/elapsed << "% busy, waited"
+             << stats.wait_produce/1000 << "ms for events and" << stats.wait_render/1000 << "ms for renders";
+
+    pthread_mutex_lock(&slotLock);
+    pipe->done = true;
+    pthread_cond_broadcast(&slotFree);
+    pthread_mutex_unlock(&slotLock);
+    return 0;
+}
+
+/* Wait until a slot is free and clean up after the channel it ran;
+   returns the bytes that channel saved. */
+static quint64 reapSlot(SMSSyncSlot *slot)
 {
-    QDateTime dt1 = QDateTime::currentDateTime();
-    QDateTime dt2 = dt1.toUTC();
-    dt1.setTimeSpec(Qt::UTC);
+    SMSSyncPipeline *pipe = slot->pipe;
+    quint64 saved;
+
+    if (!pipe)
+        return 0;
+    pthread_mutex_lock(&slotLock);
+    while (!pipe->done)
+        pthread_cond_wait(&slotFree,&slotLock);
+    pthread_mutex_unlock(&slotLock);
+    if (pipe->threaded)
+        pthread_join(slot->thread,0);
+    saved = pipe->saved;
+    if (pipe->failed)
+        slot->failed = true;
+    msg_tmpl_free(&pipe->tmpl);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->queued);
+    pthread_cond_destroy(&pipe->room);
+    delete pipe;
+    slot->pipe = 0;
+    return saved;
+}
 
-    int offset = dt2.secsTo(dt1)/60;
-    if(offset <0)
+/* whether a store's watermark trails another's for some channel, as when
+   it could not be reached for part of a pass; between passes, when no
+   session touches the watermarks */
+static bool storeBehind(const config_t &config)
+{
+    for (channel_conf_t *channel = config.channels; channel; channel = channel->next)
+        for (sync_state_t *state = channel->states; state && state->next; state = state->next)
+            if (strcmp(state->sync_time,state->next->sync_time))
+                return true;
+    return false;
+}
+
+static SMSSyncSlot *freeSlot(QVector<SMSSyncSlot> &slots,quint64 *saved)
+{
+    int i;
+
+    pthread_mutex_lock(&slotLock);
+    for (;;)
     {
-        offset = -offset;
-        return QString().sprintf("-%d%02d",offset/60,offset%60);
-    }else
+        for (i = 0; i < slots.size(); i++)
+            if (!slots[i].pipe || slots[i].pipe->done)
+                break;
+        if (i < slots.size())
+            break;
+        pthread_cond_wait(&slotFree,&slotLock);
+    }
+    pthread_mutex_unlock(&slotLock);
+    *saved += reapSlot(&slots[i]);
+    return &slots[i];
+}
+
+static QByteArray takeBuffer(msg_buf_t *buf)
+{
+    QByteArray bytes(buf->data,buf->len);
+    free(buf->data);
+    return bytes;
+}
+
+/* the contact with its subject rendered for this template */
+static const SMSSyncContact &channelContact(SMSSyncContact &contact,const msg_tmpl_t *tmpl)
+{
+    if(contact.subjectCol != tmpl->subject_col)
     {
-        return QString().sprintf("+%d%02d",offset/60,offset%60);
+        msg_buf_t buf;
+        msg_buf_init(&buf);
+        msg_render_subject(tmpl,&buf,contact.name.constData());
+        contact.subject = takeBuffer(&buf);
+        contact.subjectCol = tmpl->subject_col;
     }
- }
+    return contact;
+}
 
 QString createMessageId(QDateTime time,QString address,int type)
 {
@@ -57,6 +408,222 @@ QContactFilter IMAccountFilter(const QString &id)
     return l;
 }
 
+/* What differs between the event types is where the Message-ID comes
+   from and what goes into the body. Each type has its own reader, which
+   only looks at the columns its channel fetched; a channel picks its
+   reader once. */
+typedef void (*SMSSyncReader)(const SyncEventBatch &batch,int row,const QString &number,SMSSyncEvent &event);
+
+/* UTF-16 straight to UTF-8, classified for the encoding on the way */
+static void setBody(SMSSyncEvent &event,const ushort *text,int length)
+{
+    event.body.resize(3*length);
+    event.body.resize(body_from_utf16(text,length,event.body.data(),&event.bodyClass));
+}
+
+static void setBody(SMSSyncEvent &event,const SyncEventBatch &batch,const SyncEventBatch::Text &text)
+{
+    setBody(event,batch.utf16(text),text.length);
+}
+
+template<Event::EventType Type>
+static void readEvent(const SyncEventBatch &batch,int row,const QString &number,SMSSyncEvent &event)
+{
+    event.messageId = createMessageId(QDateTime::fromMSecsSinceEpoch(batch.startTimes.at(row)),number,Type)
+            .append("@n9-sms-backup.local").toUtf8();
+    setBody(event,batch,batch.freeTexts.at(row));
+}
+
+template<>
+void readEvent<Event::SMSEvent>(const SyncEventBatch &batch,int row,const QString &,SMSSyncEvent &event)
+{
+    event.messageId = batch.string(batch.tokens.at(row)).append("@n9-sms-backup.local").toUtf8();
+    setBody(event,batch,batch.freeTexts.at(row));
+}
+
+/* MMS pictures and other attachments are streamed from their files; the
+   text is already in FreeText and SMIL is layout */
+template<>
+void readEvent<Event::MMSEvent>(const SyncEventBatch &batch,int row,const QString &number,SMSSyncEvent &event)
+{
+    readEvent<Event::SMSEvent>(batch,row,number,event);
+    foreach (const MessagePart &messagePart, batch.parts.at(row))
+    {
+        if (messagePart.contentLocation().isEmpty() ||
+            messagePart.contentType().startsWith("text/plain") ||
+            messagePart.contentType() == "application/smil")
+            continue;
+        event.partStrings << messagePart.contentType().toUtf8()
+                          << QFileInfo(messagePart.contentLocation()).fileName().toUtf8()
+                          << messagePart.contentId().toUtf8()
+                          << QFile::encodeName(messagePart.contentLocation());
+    }
+}
+
+template<>
+void readEvent<Event::CallEvent>(const SyncEventBatch &batch,int row,const QString &number,SMSSyncEvent &event)
+{
+    qint64 startTime = batch.startTimes.at(row), endTime = batch.endTimes.at(row);
+    int direction = batch.directions.at(row);
+    event.messageId = createMessageId(QDateTime::fromMSecsSinceEpoch(startTime),number,Event::CallEvent)
+            .append("@n9-sms-backup.local").toUtf8();
+    QString content;
+    bool missed = (direction != Event::Outbound) && (batch.flags.at(row) & SyncEventBatch::MissedCall);
+    if (!missed)
+    {
+        int seconds = endTime/1000 - startTime/1000;
+        if(seconds<0)
+            seconds = -seconds;
+        int mins = seconds/60;
+        int secs = seconds%60;
+        int hours = mins/60;
+        mins %= 60;
+        content = content.sprintf("%ds(%02d:%02d:%02d)\n",seconds,hours,mins,secs);
+    }
+    if(direction == Event::Outbound)
+        content.append(number).append("(Outgoing Call)");
+    else if(missed)
+        content.append(number).append("(Missed Call)");
+    else
+        content.append(number).append("(Incoming Call)");
+    setBody(event,content.utf16(),content.size());
+}
+
+/* a channel while its events are collected, on the main thread */
+struct SMSSyncChannel{
+    channel_conf_t *conf;
+    Event::EventType type;
+    SMSSyncReader reader;
+    SMSSyncSlot *slot;
+    SMSSyncPipeline *pipe;
+    QByteArray since;
+    SyncEventBatch batch;   /* its share of the current page */
+    int nevents;
+    bool failed;
+    QList<SMSSyncDigest> digests;   /* of the latest day seen only */
+    QHash<QString,int> digestIndex;
+    QByteArray dayEnd;      /* stamp of that day's last event so far */
+    QByteArray committed;   /* the watermark the digests sent carry */
+    int ndigests;           /* sent */
+};
+
+static SyncEventSource *startSource(SyncEventSource *source,const QList<SMSSyncChannel *> &group)
+{
+    source->setPageSize(pageSize);
+    foreach (SMSSyncChannel *member, group)
+        source->addSyncType(member->type,QDateTime().fromString(QString(member->since),sync_date_format));
+    if (source->start())
+        return source;
+    delete source;
+    return 0;
+}
+
+/* Generated events stand in for tracker when benchmarking. Tracker's
+   database is read directly if configured and understood, else through
+   SPARQL. */
+static SyncEventSource *openSource(const config_t &config,const QList<SMSSyncChannel *> &group)
+{
+    const char *account = group.first()->conf->account;
+    SyncEventSource *source;
+
+    if (config.synthetic_events > 0)
+        return startSource(new SyncEventGenerator(config.synthetic_seed,config.synthetic_events),group);
+    if (config.tracker_db && (source = startSource(new SyncSqliteSource(config.tracker_db,account),group)))
+        return source;
+    if (config.tracker_db)
+        qDebug() << "Reading" << account << "through SPARQL instead";
+    SyncMessageStream *stream = new SyncMessageStream(account);
+    stream->setSlicing(maxSlices,sliceEvents);
+    stream->setPageSize(pageSize);
+    foreach (SMSSyncChannel *member, group)
+        stream->addSyncType(member->type,QDateTime().fromString(QString(member->since),sync_date_format));
+    stream->start();    /* a failure shows in hasFailed() once the first page is taken */
+    return stream;
+}
+
+/* The watermark passes a day only with its last digest, so a day cut
+   short is sent again as a whole. It never passes the open day, whose
+   digests are issued again, with the same Message-ID, until the day is
+   over. So the digests of any day past the watermark replace what the
+   store holds under their Message-ID. Before the first day is committed
+   only the open day is looked up; a round trip per digest of a whole
+   backlog is too dear. An open day's digest goes out again only once it
+   has new events; a store that missed it gets it with the next one, or
+   when the day is over.
+
+   Sends and frees the digests of the member's day, which is over if
+   closed is set. Returns nonzero if every store failed. */
+static int sendDigests(SMSSyncChannel *member,bool closed,const config_t &config,date_fmt_t *dates,
+                       QHash<QString,struct SMSSyncContact> &contactPool,
+                       QHash<QByteArray,QByteArray> &sentDigests)
+{
+    SMSSyncPipeline *pipe = member->pipe;
+    sync_session_t *session = pipe->session;
+    const QList<SMSSyncDigest> &digests = member->digests;
+    QDate today = QDate::currentDate();
+    char dateBuf[RFC5322_DATE_LENGTH];
+    int failed = 0;
+
+    for (int d = 0; d < digests.size() && !failed; d++)
+    {
+        const SMSSyncDigest &digest = digests.at(d);
+        if (d+1 == digests.size() && closed && digest.day < today)
+            member->committed = member->dayEnd;
+
+        QByteArray messageId = QString("digest-%1-%2-%3@n9-sms-backup.local")
+                .arg(digest.day.toString(Qt::ISODate)).arg(digest.number).arg(member->type).toUtf8();
+        QByteArray sentKey = QByteArray(member->conf->name) + " " + messageId;
+        if (digest.day >= today && sentDigests.value(sentKey) == digest.stamp)
+            continue;
+
+        const SMSSyncContact &contact = channelContact(contactPool[digest.number],&pipe->tmpl);
+        QByteArray date(dateBuf,date_fmt_rfc5322(dates,digest.first,dateBuf));
+        QByteArray references = QString(refrence_format).arg(config.stores->prefrence).arg(digest.groupId).toUtf8();
+        QByteArray ids = digest.firstId + "-" + digest.lastId;
+        QByteArray address = digest.number.toUtf8();
+
+        msg_fields_t fields;
+        fields.peer = contact.address.constData();
+        fields.peer_len = contact.address.size();
+        fields.subject = contact.subject.constData();
+        fields.subject_len = contact.subject.size();
+        fields.inbound = 1;
+        fields.date = date.constData();
+        fields.message_id = messageId.constData();
+        fields.references = references.constData();
+        fields.id = ids.constData();
+        fields.address = address.constData();
+        fields.body = digest.transcript.constData();
+        fields.body_len = digest.transcript.size();
+        fields.body_class = 0;
+        fields.parts = 0;
+        fields.nparts = 0;
+        msg_render_t render;
+        pipe->saved += msg_tmpl_prepare(&pipe->tmpl,&fields,&render);
+        if (!member->since.isEmpty() || digest.day >= today)
+            failed = sms_imap_sync_replace(session,&render,messageId.constData(),
+                                           digest.stamp.constData(),member->committed.constData());
+        else
+            failed = sms_imap_sync_render(session,&render,digest.stamp.constData(),member->committed.constData());
+        msg_tmpl_release(&fields);
+        if (failed)
+        {
+            qDebug() << member->conf->name << "sync network error!";
+            break;
+        }
+        if (digest.day >= today)
+            sentDigests.insert(sentKey,digest.stamp);
+        if (++member->ndigests % 10 == 0)
+        {
+            qDebug() << member->conf->name << member->ndigests << "digests synced!";
+            sms_imap_checkpoint(session,0);
+        }
+    }
+    member->digests.clear();
+    member->digestIndex.clear();
+    return failed;
+}
+
 Q_DECL_EXPORT int main(int argc, char *argv[])
 {
    // QLocale::setDefault(QLocale(QLocale::English,QLocale::UnitedStates));
@@ -64,175 +631,412 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
     QCoreApplication app(argc, argv);
 
 
-    char message[8192]; // This should be large enough for messages
-    if(sms_imap_config())
+    config_t config;
+    if(sms_imap_config(&config))
     {
         qDebug() << "Config error!";
         return 1;
     }
-    QString myEmail = QString().fromAscii(accountEmail);
+    if (config.synthetic_events > 0)
+        qDebug() << "Uploading" << config.synthetic_events
+                 << "synthetic events to the configured stores, state in ~/.mbsync.synthetic.state";
+    QString myEmail = QString().fromAscii(config.account_email);
     QString myName = myEmail.split("@").at(0);
-    QString timeZone = getTimeZone();
+    date_fmt_t dates;
+    date_fmt_init(&dates);
+    char dateBuf[RFC5322_DATE_LENGTH];
 
     QContactManager m_contactManager("tracker");
     QHash<QString,struct SMSSyncContact> contactPool;
 
     channel_conf_t *channel;
+    quint64 savedBytes = 0;
+    quint64 contactLookups = 0, contactHits = 0;
 
-    if(sms_imap_init())
+    /* the stores' connections and the cores are shared out between the
+       channels that upload at once */
+    int nchannels = 0;
+    for(channel=config.channels;channel;channel=channel->next)
+        nchannels++;
+    int concurrency = config.concurrency > 0 ? config.concurrency : 2;
+    if (concurrency > nchannels)
+        concurrency = nchannels;
+    QVector<SMSSyncSlot> slots;
+    for (int i = 0; i < concurrency; i++)
+    {
+        SMSSyncSlot slot;
+        if (!(slot.session = sms_imap_init(&config,concurrency)))
+            break;
+        slot.pipe = 0;
+        slot.failed = false;
+        slots.append(slot);
+    }
+    if (slots.isEmpty())
     {
         qDebug() << "Config error or network error";
         return 1;
     }
+    int cpus = render_pool_cpus();
+    int renderThreads = (cpus-1)/slots.size();
+    if (renderThreads < 1 && cpus > 1)
+        renderThreads = 1;
 
-    for(channel=channels;channel;channel=channel->next)
+    /* In daemon mode the sessions and the contact manager outlive a pass.
+       After one it waits for commhistory to report new events and syncs
+       just those, over connections that are still logged in, which are
+       pinged while nothing happens. The idle wake-up is a pass only after
+       one that left something behind, to retry it. The contact cache is
+       kept until the address book changes. */
+    SyncWatcher watcher;
+    bool daemon = config.daemon;
+    if (daemon && !watcher.subscribe())
     {
-        qDebug() << "Channel "<<channel->name;
-        Event::EventType eventType;
-        if(!strcasecmp( channel->type, "SMS"))
-            eventType = Event::SMSEvent;
-        else if (!strcasecmp( channel->type, "IM"))
-            eventType = Event::IMEvent;
-        else if (!strcasecmp( channel->type, "CALL"))
-            eventType = Event::CallEvent;
-        else
-        {
-            qDebug() << "Wrong type for channel "<<channel->name<<"!";
-            qDebug() <<"Only SMS/IM/CALL is supported!";
-            continue;
-        }
-
-        sms_imap_select_mailbox(channel->mail_box);
-
-        SyncMessageModel syncModel(ALL,eventType,channel->account,
-                                   QDateTime().fromString(QString(channel->sync_time),sync_date_format));
-
-        syncModel.setQueryMode(EventModel::SyncQuery);
-        syncModel.getEvents();
+        qDebug() << "Cannot watch commhistory for new events, syncing once";
+        daemon = false;
+    }
+    if (daemon)
+        watcher.watchContacts(&m_contactManager);
+    int keepalive = 1000 * (config.keepalive > 0 ? config.keepalive : 300);
 
-        qDebug() << "Total " << syncModel.rowCount() <<" messages need to sync!";
+    /* the open day's digests as last sent, by channel and Message-ID, with
+       the stamp of their last event */
+    QHash<QByteArray,QByteArray> sentDigests;
+    QDate sentDay;
 
-        for (int i= 0 ;i < syncModel.rowCount();i++)
+    for (;;)
+    {
+        bool retry = false;
+        if (sentDay != QDate::currentDate())
         {
+            sentDigests.clear();
+            sentDay = QDate::currentDate();
+        }
 
-            memset(message,0,8192);
+        QList<SMSSyncChannel *> pending;
+        for(channel=config.channels;channel;channel=channel->next)
+        {
+            SMSSyncChannel *member = new SMSSyncChannel;
+            member->conf = channel;
+            if(!strcasecmp( channel->type, "SMS"))
+            {
+                member->type = Event::SMSEvent;
+                member->reader = readEvent<Event::SMSEvent>;
+            }
+            else if (!strcasecmp( channel->type, "MMS"))
+            {
+                member->type = Event::MMSEvent;
+                member->reader = readEvent<Event::MMSEvent>;
+            }
+            else if (!strcasecmp( channel->type, "IM"))
+            {
+                member->type = Event::IMEvent;
+                member->reader = readEvent<Event::IMEvent>;
+            }
+            else if (!strcasecmp( channel->type, "CALL"))
+            {
+                member->type = Event::CallEvent;
+                member->reader = readEvent<Event::CallEvent>;
+            }
+            else
+            {
+                qDebug() << "Wrong type for channel "<<channel->name<<"!";
+                qDebug() <<"Only SMS/MMS/IM/CALL is supported!";
+                delete member;
+                continue;
+            }
+            pending.append(member);
+        }
 
-            QString number = syncModel.data(syncModel.index(i,EventModel::RemoteUid),0).toString();
-            int direction = syncModel.data(syncModel.index(i,EventModel::Direction),0).toInt();
-            SMSSyncContact contact = contactPool.value(number);
-            if(contact.name.isEmpty())
+        /* Channels on the same account are fetched with one query, each type
+           with its own watermark, and its rows are handed out by type. A group
+           has at most one channel per type and no more channels than there
+           are sessions, since all of them upload while the query is read. */
+        while (!pending.isEmpty())
+        {
+            QList<SMSSyncChannel *> group;
+            group.append(pending.takeFirst());
+            for (int j = 0; j < pending.size() && group.size() < slots.size(); )
             {
-                QList<QContact> contacts = m_contactManager.contacts(
-                            (eventType == Event::IMEvent) ? IMAccountFilter(number):QContactPhoneNumber::match(number));
-                if (contacts.isEmpty())
-                {
-                    contact.name = number;
-                    contact.email = QString(number).append("@unknown.email");
-                }
+                bool fits = !strcmp(pending.at(j)->conf->account,group.first()->conf->account);
+                for (int k = 0; fits && k < group.size(); k++)
+                    fits = group.at(k)->type != pending.at(j)->type;
+                if (fits)
+                    group.append(pending.takeAt(j));
                 else
-                {
-                    contact.name = ((QContactDisplayLabel)contacts.first().detail<QContactDisplayLabel>()).label();
-                    if(contact.name.isEmpty())
-                        contact.name = number;
-                    contact.email = ((QContactEmailAddress)contacts.first().detail<QContactEmailAddress>()).emailAddress();
-                    if(contact.email.isEmpty())
-                        contact.email = QString(number).append("@unknown.email");
-
-                }
-                contactPool.insert(number,contact);
+                    j++;
             }
 
-            imap_create_header(message,QString(message_header_format).arg(channel->label).arg(contact.name).toUtf8().data());
+            QHash<int,SyncEventBatch *> batches;
 
-            if (direction == Event::Inbound)
-            {
-                imap_add_address(message,"From",contact.name.toUtf8().data(),contact.email.toUtf8().data());
-                imap_add_address(message,"To",myName.toUtf8().data(),myEmail.toUtf8().data());
-            }else
+            foreach (SMSSyncChannel *member, group)
             {
-                imap_add_address(message,"From",myName.toUtf8().data(),myEmail.toUtf8().data());
-                imap_add_address(message,"To",contact.name.toUtf8().data(),contact.email.toUtf8().data());
+                channel = member->conf;
+                qDebug() << "Channel "<<channel->name;
+                member->slot = freeSlot(slots,&savedBytes);
+                member->since = sms_imap_begin_channel(member->slot->session,channel);
+                batches.insert(member->type,&member->batch);
+                member->nevents = 0;
+                member->failed = false;
+                member->committed = member->since;
+                member->ndigests = 0;
+
+                /* everything but the per-event values is laid out once per channel */
+                SMSSyncPipeline *pipe = member->pipe = new SMSSyncPipeline;
+                date_fmt_rfc5322(&dates,time(0),dateBuf);
+                msg_tmpl_compile(&pipe->tmpl,channel->label,myName.toUtf8().constData(),myEmail.toUtf8().constData(),
+                                 dateBuf,
+                                 channel->digest);
+                pipe->name = channel->name;
+                pipe->session = member->slot->session;
+                pipe->saved = 0;
+                pipe->started = get_usec();
+                pipe->collectTime = 0;
+                pipe->busy = 0;
+                pipe->stats = render_pool_stats_t();
+                pthread_mutex_init(&pipe->lock,0);
+                pthread_cond_init(&pipe->queued,0);
+                pthread_cond_init(&pipe->room,0);
+                pipe->head = 0;
+                pipe->tail = &pipe->head;
+                pipe->pages = 0;
+                pipe->collected = false;
+                pipe->failed = false;
+                pipe->threaded = false;
+                pipe->done = false;
+                member->slot->pipe = pipe;
+                /* without a thread of its own the upload runs once everything is collected */
+                if (!channel->digest)
+                    pipe->threaded = !pthread_create(&member->slot->thread,0,runChannel,pipe);
             }
 
-            imap_add_header(message,"Date",
-                            syncModel.data(syncModel.index(i,EventModel::StartTime),0).toDateTime()
-                            .toLocalTime().toString("ddd, d MMM yyyy H:m:s ").append(timeZone).toUtf8().data());
+            long long fetchStart = get_usec();
+            SyncEventSource *source = openSource(config,group);
+            if (source->sliceCount() > 1)
+                qDebug() << "Fetching in" << source->sliceCount() << "time slices";
+            int live = group.size();
+            while (live && source->takePage(batches))
+            {
+                /* the query is charged to every channel it served */
+                long long fetchTime = get_usec() - fetchStart;
 
-            if (eventType == Event::SMSEvent)
-                imap_add_identify(message,"Message-ID",
-                                  syncModel.data(syncModel.index(i,EventModel::MessageToken),0).toString().append("@n9-sms-backup.local").toUtf8().data());
-            else
-                imap_add_identify(message,"Message-ID",
-                                  createMessageId(
-                                      syncModel.data(syncModel.index(i,EventModel::StartTime),0).toDateTime(),
-                                      number,eventType).append("@n9-sms-backup.local").toUtf8().data());
+                foreach (SMSSyncChannel *member, group)
+                {
+                    if (member->failed)
+                        continue;
+                    channel = member->conf;
+                    SMSSyncPipeline *pipe = member->pipe;
+                    const msg_tmpl_t &tmpl = pipe->tmpl;
+                    const SyncEventBatch &batch = member->batch;
+                    long long collectStart = get_usec();
+                    pipe->collectTime += fetchTime;
+                    qDebug() << channel->name << member->nevents+batch.size() << "messages to sync so far";
 
-            imap_add_identify(message,"References",QString(refrence_format).
-                              arg(stores->prefrence).arg(syncModel.data(syncModel.index(i,EventModel::GroupId),0).toInt()).toUtf8().data());
+                    SMSSyncPage *page = 0;
+                    int n = 0;
+                    if (!channel->digest)
+                    {
+                        page = new SMSSyncPage;
+                        page->pipe = pipe;
+                        page->store.resize(batch.size());
+                        page->events = page->store.data();
+                        page->total = batch.size();
+                        page->first = member->nevents;
+                        page->pool = render_pool_start(renderThreads,page->total,poolBatch,poolBudget,renderEvent,page);
+                        pipe->collectTime += get_usec() - collectStart;
+                        if ((member->failed = queuePage(pipe,page)))
+                        {
+                            render_pool_publish(page->pool,0,1);
+                            live--;
+                            continue;
+                        }
+                        collectStart = get_usec();
+                    }
 
-            imap_add_header(message,"X-smssync-id",syncModel.data(syncModel.index(i,EventModel::EventId),0).toString().toUtf8().data());
-            imap_add_header(message,"X-smssync-address",number.toUtf8().data());
-            imap_add_header(message,"X-smssync-datatype",channel->label);
+                    /* contacts are resolved once per remote uid, not per event */
+                    QVector<SMSSyncContact> peers(batch.remoteUids.size());
+                    QVector<QByteArray> addresses(batch.remoteUids.size());
+                    for (int r = 0; r < batch.remoteUids.size(); r++)
+                    {
+                        const QString &number = batch.remoteUids.at(r);
+                        QHash<QString,struct SMSSyncContact>::iterator contact = contactPool.find(number);
+                        contactLookups++;
+                        if(contact == contactPool.end())
+                        {
+                            QString name, email;
+                            QList<QContact> contacts;
+                            if (config.synthetic_events <= 0)
+                                contacts = m_contactManager.contacts(
+                                            (member->type == Event::IMEvent) ? IMAccountFilter(number):QContactPhoneNumber::match(number));
+                            if (contacts.isEmpty())
+                            {
+                                name = number;
+                                email = QString(number).append("@unknown.email");
+                            }
+                            else
+                            {
+                                name = ((QContactDisplayLabel)contacts.first().detail<QContactDisplayLabel>()).label();
+                                if(name.isEmpty())
+                                    name = number;
+                                email = ((QContactEmailAddress)contacts.first().detail<QContactEmailAddress>()).emailAddress();
+                                if(email.isEmpty())
+                                    email = QString(number).append("@unknown.email");
 
+                            }
+                            SMSSyncContact entry;
+                            msg_buf_t buf;
+                            entry.name = name.toUtf8();
+                            msg_buf_init(&buf);
+                            msg_render_address(&buf,entry.name.constData(),email.toUtf8().constData());
+                            entry.address = takeBuffer(&buf);
+                            entry.subjectCol = -1;
+                            contact = contactPool.insert(number,entry);
+                        }
+                        else
+                            contactHits++;
+                        peers[r] = channelContact(*contact,&tmpl);
+                        addresses[r] = number.toUtf8();
+                    }
 
-            imap_add_header(message,"X-smssync-backup-time",QDateTime::currentDateTime().toLocalTime().
-                            toString("ddd, d MMM yyyy H:m:s ").append(timeZone).toUtf8().data());
+                    for (int i= 0 ;i < batch.size();i++)
+                    {
+                        const QString &number = batch.remoteUids.at(batch.remotes.at(i));
+                        const SMSSyncContact &contact = peers.at(batch.remotes.at(i));
+                        int direction = batch.directions.at(i);
+                        qint64 startTime = batch.startTimes.at(i), endTime = batch.endTimes.at(i);
+                        SMSSyncEvent event;
+                        event.peer = contact.address;
+                        event.subject = contact.subject;
+                        event.inbound = (direction == Event::Inbound);
+                        event.date = QByteArray(dateBuf,date_fmt_rfc5322(&dates,startTime/1000,dateBuf));
+                        event.references = QString(refrence_format).
+                                arg(config.stores->prefrence).arg(batch.groupIds.at(i)).toUtf8();
+                        event.id = QByteArray::number(batch.ids.at(i));
+                        event.address = addresses.at(batch.remotes.at(i));
+                        event.stamp = QByteArray(dateBuf,date_fmt_stamp(&dates,endTime/1000,endTime%1000,dateBuf));
+                        event.saved = 0;
+                        member->reader(batch,i,number,event);
 
-            if(eventType != Event::CallEvent)
-                imap_add_contect(message,syncModel.data(syncModel.index(i,EventModel::FreeText),0).toString().toUtf8().data());
-            else
-            {
-                QString content;
-                if ((direction == Event::Outbound)  || !syncModel.data(syncModel.index(i,EventModel::IsMissedCall)).toBool())
-                {
-                    QDateTime start = syncModel.data(syncModel.index(i,EventModel::StartTime),0).toDateTime();
-                    QDateTime end = syncModel.data(syncModel.index(i,EventModel::EndTime),0).toDateTime();
-                    int seconds = start.secsTo(end);
-                    if(seconds<0)
-                        seconds = -seconds;
-                    int mins = seconds/60;
-                    int secs = seconds%60;
-                    int hours = mins/60;
-                    mins %= 60;
-                    content = content.sprintf("%ds(%02d:%02d:%02d)\n",seconds,hours,mins,secs);
+                        if(channel->digest)
+                        {
+                            /* Collect the transcript. Events come in end time order,
+                               so one of a later day closes the digests so far. */
+                            QDate day = QDateTime::fromMSecsSinceEpoch(endTime).date();
+                            if (!member->digests.isEmpty() && member->digests.first().day != day &&
+                                (member->failed = sendDigests(member,true,config,&dates,contactPool,sentDigests)))
+                                break;
+                            QString key = QString("%1 %2").arg(day.toString(Qt::ISODate)).arg(number);
+                            QHash<QString,int>::iterator index = member->digestIndex.find(key);
+                            if(index == member->digestIndex.end())
+                            {
+                                SMSSyncDigest digest;
+                                digest.number = number;
+                                digest.day = day;
+                                digest.first = startTime/1000;
+                                digest.groupId = batch.groupIds.at(i);
+                                digest.firstId = event.id;
+                                member->digests.append(digest);
+                                index = member->digestIndex.insert(key,member->digests.size()-1);
+                            }
+                            SMSSyncDigest &digest = member->digests[*index];
+                            digest.transcript += QDateTime::fromMSecsSinceEpoch(startTime).toString("hh:mm:ss ").toUtf8();
+                            digest.transcript += (direction == Event::Inbound) ? contact.name : myName.toUtf8();
+                            digest.transcript += ": ";
+                            digest.transcript += (member->type == Event::CallEvent) ? event.body.replace('\n',' ') : event.body;
+                            digest.transcript += "\n";
+                            digest.lastId = event.id;
+                            digest.stamp = event.stamp;
+                            member->dayEnd = event.stamp;
+                            continue;
+                        }
+
+                        page->events[n++] = event;
+                        if (n % publishEvery == 0 && (member->failed = render_pool_publish(page->pool,n,0)))
+                            break;  /* the upload gave up */
+                    }
+                    if (page)
+                        render_pool_publish(page->pool,n,1);
+                    if (member->failed)
+                        live--;
+                    member->nevents += batch.size();
+                    pipe->collectTime += get_usec() - collectStart;
                 }
-                if(direction == Event::Outbound)
-                    content.append(number).append("(Outgoing Call)");
-                else if(syncModel.data(syncModel.index(i,EventModel::IsMissedCall)).toBool())
-                    content.append(number).append("(Missed Call)");
-                else
-                    content.append(number).append("(Incoming Call)");
-                imap_add_contect(message,content.toUtf8().data());
+                fetchStart = get_usec();
             }
-
-            if(sms_imap_sync_one(message))
+            bool queryFailed = source->hasFailed();
+            if (queryFailed)
             {
-                /* sync error */
-                qDebug() << "Sync network error!";
-                char *date = syncModel.data(syncModel.index(i-1,EventModel::EndTime),0).toDateTime()
-                .toLocalTime().toString(sync_date_format).toUtf8().data();
-                memcpy(channel->sync_time,date,strlen(date));
-                channel->sync_time[strlen(date)] = 0;
-                save_state_config(0,0);
-                break;
+                qDebug() << "Query failed, the rest is synced next time";
+                retry = true;
             }
-            if(syncModel.rowCount()-i <= 10 || (i%10 == 9))
-                qDebug() << (i+1) << "/" <<syncModel.rowCount() <<" synced!";
+            delete source;
 
-            if((i%10 == 9) || (i == syncModel.rowCount()-1))
+            foreach (SMSSyncChannel *member, group)
             {
-                /* backup status every 10 backups */
-                char *date = syncModel.data(syncModel.index(i,EventModel::EndTime),0).toDateTime()
-                        .toLocalTime().toString(sync_date_format).toUtf8().data();
-                memcpy(channel->sync_time,date,strlen(date));
-                channel->sync_time[strlen(date)] = 0;
-                save_state_config(0,1);
+                SMSSyncPipeline *pipe = member->pipe;
+                member->batch.clear();
+                if (!member->conf->digest)
+                {
+                    lastPage(pipe);
+                    if (!pipe->threaded)
+                        runChannel(pipe);
+                    delete member;
+                    continue;
+                }
+
+                /* the last day is over only if the query got to its end */
+                if (!member->failed && !member->digests.isEmpty() &&
+                    sendDigests(member,!queryFailed,config,&dates,contactPool,sentDigests))
+                    member->failed = true;
+                if (member->failed)
+                    retry = true;
+                else
+                    qDebug() << member->conf->name << member->ndigests << "digests synced!";
+                sms_imap_checkpoint(pipe->session,1);
+                pthread_mutex_lock(&slotLock);
+                pipe->done = true;
+                pthread_mutex_unlock(&slotLock);
+                delete member;
             }
         }
+
+        for (int i = 0; i < slots.size(); i++)
+        {
+            savedBytes += reapSlot(&slots[i]);
+            if (slots[i].failed)
+                retry = true;
+            slots[i].failed = false;
+        }
+        qDebug() << "Sync done," << savedBytes << "bytes saved over base64 bodies";
+        if(contactLookups)
+        {
+            quint64 contactBytes = 0;
+            foreach(const SMSSyncContact &entry, contactPool)
+                contactBytes += entry.name.size() + entry.address.size() + entry.subject.size();
+            qDebug() << "Contact cache:" << contactHits << "of" << contactLookups << "lookups hit,"
+                     << QString("%1%,").arg(100 * contactHits / contactLookups) << contactPool.size() << "entries,"
+                     << (contactPool.isEmpty() ? 0 : contactBytes / contactPool.size()) << "bytes per entry";
+        }
+
+        if (!daemon)
+            break;
+
+        if (storeBehind(config))
+            retry = true;
+        for (;;)
+        {
+            bool idle = watcher.wait(batchDelay,keepalive) == SyncWatcher::Idle;
+            for (int i = 0; i < slots.size(); i++)
+                if (sms_imap_refresh(slots[i].session,idle))
+                    qDebug() << "No store reachable, trying again later";
+            if (!idle || retry)
+                break;
+        }
+        if (watcher.takeContactsChanged())
+            contactPool.clear();    /* names and addresses may have changed */
     }
 
-    sms_imap_close();
-    qDebug() << "Sync done";
+    for (int i = 0; i < slots.size(); i++)
+        sms_imap_close(slots[i].session);
 
 
     /*
@@ -0,0 +1,291 @@
+/*
+ * Render pool: messages are rendered on worker threads, in batches of
+ * consecutive events, while the producer is still collecting events and
+ * the sender sends them in order.
+ *
+ * Batches are dealt out round robin, so every worker starts near the
+ * front of the backlog. A worker takes its own batches from the front of
+ * its deque and, once that is empty, steals from the back of the fullest
+ * other deque. Batches are coarse, so one lock for the whole pool is
+ * cheap enough. A job is only rendered once the producer has published
+ * it.
+ *
+ * Rendered messages wait in their slot until the sender takes them.
+ * While they add up to more than the memory budget, workers only render
+ * batches the sender is already waiting for. If the sender gets to a
+ * batch nobody has claimed yet, it takes the batch over and renders it
+ * itself, so it never waits for a worker that waits for it.
+ */
+
+#include "pool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+enum { SLOT_TODO, SLOT_READY, SLOT_DECLINED };
+enum { BATCH_FREE, BATCH_WORKER, BATCH_SENDER };
+
+typedef struct {
+	char *data;
+	int len;
+	int state;
+} pool_slot_t;
+
+typedef struct {
+	int *batches;
+	int head, tail;
+} pool_deque_t;
+
+typedef struct {
+	render_pool_t *pool;
+	int id;
+	pthread_t thread;
+} pool_worker_t;
+
+struct render_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t room;  /* the sender took something, more was published, or quit */
+	pthread_cond_t ready; /* a slot was filled, or more was published */
+	render_fn_t render;
+	void *arg;
+	int njobs, batch, nthreads;
+	int published; /* jobs the producer is done with */
+	int budget, pending; /* bytes rendered but not taken yet */
+	int next; /* what the sender waits for */
+	int quit;
+	pool_slot_t *slots;
+	char *claimed; /* BATCH_* per batch */
+	pool_deque_t *deques;
+	pool_worker_t *workers;
+	long long started;
+	render_pool_stats_t stats;
+};
+
+/* own batches from the front, stolen ones from the back */
+static int
+claim_batch( render_pool_t *pool, int id )
+{
+	pool_deque_t *dq = &pool->deques[id], *victim;
+	int b, i;
+
+	for (;;) {
+		if (dq->head < dq->tail) {
+			b = dq->batches[dq->head++];
+		} else {
+			victim = 0;
+			for (i = 0; i < pool->nthreads; i++)
+				if (!victim || pool->deques[i].tail - pool->deques[i].head > victim->tail - victim->head)
+					victim = &pool->deques[i];
+			if (victim->head == victim->tail)
+				return -1;
+			b = victim->batches[--victim->tail];
+		}
+		if (pool->claimed[b] == BATCH_FREE) { /* else the sender took it over */
+			pool->claimed[b] = BATCH_WORKER;
+			return b;
+		}
+	}
+}
+
+/* the caller holds the lock; the time asleep is charged to *idle */
+static void
+pool_wait( pthread_cond_t *cond, render_pool_t *pool, long long *idle )
+{
+	long long start = get_usec();
+
+	pthread_cond_wait( cond, &pool->lock );
+	*idle += get_usec() - start;
+}
+
+static void *
+pool_worker( void *aux )
+{
+	pool_worker_t *worker = aux;
+	render_pool_t *pool = worker->pool;
+	msg_buf_t out;
+	long long start;
+	int b, i, ret;
+
+	pthread_mutex_lock( &pool->lock );
+	while (!pool->quit && (b = claim_batch( pool, worker->id )) >= 0) {
+		/* over budget only the batch the sender waits for may go on */
+		while (!pool->quit && pool->pending >= pool->budget && b * pool->batch > pool->next)
+			pool_wait( &pool->room, pool, &pool->stats.render_idle );
+		for (i = b * pool->batch; i < (b + 1) * pool->batch; i++) {
+			while (!pool->quit && i >= pool->published && i < pool->njobs)
+				pool_wait( &pool->room, pool, &pool->stats.render_idle );
+			if (pool->quit || i >= pool->njobs)
+				break;
+			pthread_mutex_unlock( &pool->lock );
+			start = get_usec();
+			msg_buf_init( &out );
+			ret = pool->render( pool->arg, i, &out );
+			start = get_usec() - start;
+			pthread_mutex_lock( &pool->lock );
+			pool->stats.render_busy += start;
+			if (ret < 0) {
+				free( out.data );
+				pool->slots[i].state = SLOT_DECLINED;
+			} else {
+				pool->slots[i].data = out.data;
+				pool->slots[i].len = out.len;
+				pool->slots[i].state = SLOT_READY;
+				pool->pending += out.len;
+			}
+			pthread_cond_broadcast( &pool->ready );
+		}
+	}
+	pthread_mutex_unlock( &pool->lock );
+	return 0;
+}
+
+int
+render_pool_cpus( void )
+{
+	long n = sysconf( _SC_NPROCESSORS_ONLN );
+
+	return n > 0 ? n : 1;
+}
+
+/* njobs is how many jobs there may be; render_pool_publish() hands them
+ * over as they are ready. With no threads the sender renders them all,
+ * which on a single CPU beats handing each over between threads. */
+render_pool_t *
+render_pool_start( int nthreads, int njobs, int batch, int budget,
+                   render_fn_t render, void *arg )
+{
+	render_pool_t *pool;
+	pool_deque_t *dq;
+	int b, nbatches = (njobs + batch - 1) / batch, i;
+
+	pool = nfcalloc( sizeof(*pool) );
+	pthread_mutex_init( &pool->lock, 0 );
+	pthread_cond_init( &pool->room, 0 );
+	pthread_cond_init( &pool->ready, 0 );
+	pool->render = render;
+	pool->arg = arg;
+	pool->njobs = njobs;
+	pool->batch = batch;
+	pool->nthreads = nthreads;
+	pool->budget = budget;
+	pool->started = get_usec();
+	pool->slots = nfcalloc( (njobs ? njobs : 1) * sizeof(*pool->slots) );
+	pool->claimed = nfcalloc( nbatches ? nbatches : 1 );
+	pool->deques = nfcalloc( (nthreads ? nthreads : 1) * sizeof(*pool->deques) );
+	for (i = 0; i < nthreads; i++)
+		pool->deques[i].batches = nfmalloc( (nbatches / nthreads + 1) * sizeof(int) );
+	for (b = 0; nthreads && b < nbatches; b++) {
+		dq = &pool->deques[b % nthreads];
+		dq->batches[dq->tail++] = b;
+	}
+	pool->workers = nfcalloc( (nthreads ? nthreads : 1) * sizeof(*pool->workers) );
+	for (i = 0; i < nthreads; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		if (pthread_create( &pool->workers[i].thread, 0, pool_worker, &pool->workers[i] )) {
+			/* run with the workers we got; the sender renders the rest.
+			 * The running ones may be looking for a batch to steal. */
+			pthread_mutex_lock( &pool->lock );
+			pool->nthreads = i;
+			for (; i < nthreads; i++)
+				free( pool->deques[i].batches );
+			pthread_mutex_unlock( &pool->lock );
+			break;
+		}
+	}
+	return pool;
+}
+
+/* The producer is done with the first n jobs; with last set there will
+ * be no more. Returns nonzero once the pool was cancelled. */
+int
+render_pool_publish( render_pool_t *pool, int n, int last )
+{
+	int quit;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->published = n;
+	if (last)
+		pool->njobs = n;
+	pthread_cond_broadcast( &pool->room );
+	pthread_cond_broadcast( &pool->ready );
+	quit = pool->quit;
+	pthread_mutex_unlock( &pool->lock );
+	return quit;
+}
+
+/* Wait for message i, which must be the one after the previous take, and
+ * hand over its buffer. Returns -1 if the caller has to render it, and 1
+ * if there is no message i or the pool was cancelled. */
+int
+render_pool_take( render_pool_t *pool, int i, msg_buf_t *out )
+{
+	pool_slot_t *slot;
+	int b = i / pool->batch, ret = -1;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->next = i;
+	pthread_cond_broadcast( &pool->room );
+	while (!pool->quit && i >= pool->published && i < pool->njobs)
+		pool_wait( &pool->ready, pool, &pool->stats.wait_produce );
+	if (pool->quit || i >= pool->njobs) {
+		pthread_mutex_unlock( &pool->lock );
+		return 1;
+	}
+	slot = &pool->slots[i];
+	if (pool->claimed[b] != BATCH_WORKER)
+		pool->claimed[b] = BATCH_SENDER;
+	while (slot->state == SLOT_TODO && pool->claimed[b] == BATCH_WORKER)
+		pool_wait( &pool->ready, pool, &pool->stats.wait_render );
+	if (slot->state == SLOT_READY) {
+		out->data = slot->data;
+		out->len = out->size = slot->len;
+		slot->data = 0;
+		pool->pending -= slot->len;
+		ret = 0;
+	}
+	pool->next = i + 1;
+	pthread_cond_broadcast( &pool->room );
+	pthread_mutex_unlock( &pool->lock );
+	return ret;
+}
+
+/* Stop the workers; the producer learns at its next
+ * render_pool_publish(), the sender at its next render_pool_take(). */
+void
+render_pool_cancel( render_pool_t *pool )
+{
+	pthread_mutex_lock( &pool->lock );
+	pool->quit = 1;
+	pthread_cond_broadcast( &pool->room );
+	pthread_cond_broadcast( &pool->ready );
+	pthread_mutex_unlock( &pool->lock );
+}
+
+void
+render_pool_stop( render_pool_t *pool, render_pool_stats_t *stats )
+{
+	int i;
+
+	render_pool_cancel( pool );
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join( pool->workers[i].thread, 0 );
+	if (stats) {
+		*stats = pool->stats;
+		stats->threads = pool->nthreads;
+		stats->elapsed = get_usec() - pool->started;
+	}
+	for (i = 0; i < pool->njobs; i++)
+		free( pool->slots[i].data );
+	for (i = 0; i < pool->nthreads; i++)
+		free( pool->deques[i].batches );
+	pthread_mutex_destroy( &pool->lock );
+	pthread_cond_destroy( &pool->room );
+	pthread_cond_destroy( &pool->ready );
+	free( pool->slots );
+	free( pool->claimed );
+	free( pool->deques );
+	free( pool->workers );
+	free( pool );
+}
@@ -0,0 +1,39 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "isync.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Renders messages ahead of the sender on worker threads. */
+typedef struct render_pool render_pool_t;
+
+/* Render message i into out. Called on a worker thread, so it may only
+ * touch data that nothing else writes meanwhile. Return -1 to leave the
+ * message to the sender, e.g. when it is too big to hold in memory. */
+typedef int (*render_fn_t)( void *arg, int i, msg_buf_t *out );
+
+/* where the time went, in microseconds */
+typedef struct {
+	int threads;
+	long long elapsed;
+	long long render_busy, render_idle; /* summed over the workers */
+	long long wait_produce; /* sender waiting for the producer */
+	long long wait_render; /* sender waiting for a worker */
+} render_pool_stats_t;
+
+render_pool_t *render_pool_start( int nthreads, int njobs, int batch, int budget,
+                                  render_fn_t render, void *arg );
+int render_pool_publish( render_pool_t *pool, int n, int last );
+int render_pool_take( render_pool_t *pool, int i, msg_buf_t *out );
+void render_pool_cancel( render_pool_t *pool );
+void render_pool_stop( render_pool_t *pool, render_pool_stats_t *stats );
+int render_pool_cpus( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POOL_H */
@@ -28,7 +28,10 @@ CONFIG += qdeclarative-boostable
 
 # Add dependency to Symbian components
 # CONFIG += qt-components
-PKGCONFIG += commhistory libssl
+CONFIG += qtsparql
+QT += dbus
+PKGCONFIG += commhistory libssl sqlite3
+LIBS += -lpthread -lrt
 
 # The .cpp file which was generated for your project. Feel free to hack it.
 SOURCES += main.cpp \
@@ -37,7 +40,12 @@ SOURCES += main.cpp \
     drv_imap.c \
     config.c \
     sync.c \
-    syncmessagemodel.cpp
+    pool.c \
+    synthetic.c \
+    syncmessagemodel.cpp \
+    synceventgenerator.cpp \
+    syncsqlitesource.cpp \
+    syncwatcher.cpp
 
 # Please do not modify the following two lines. Required for deployment.
 include(qmlapplicationviewer/qmlapplicationviewer.pri)
@@ -55,4 +63,10 @@ OTHER_FILES += \
 HEADERS += \
     base64.h \
     isync.h \
-    syncmessagemodel.h
+    pool.h \
+    synthetic.h \
+    syncmessagemodel.h \
+    synceventsource.h \
+    synceventgenerator.h \
+    syncsqlitesource.h \
+    syncwatcher.h
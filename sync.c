@@ -32,10 +32,56 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
-#include <glib-object.h>
 
-const char *Home;	/* for config */
-store_t *mctx;
+/* one authenticated connection of a store's pool */
+typedef struct sync_conn {
+	store_t *ctx;
+	int pending; /* APPENDs not yet answered */
+	unsigned dead:1;
+} sync_conn_t;
+
+/* an event in flight; the ledger is a ring indexed by seq % ledger_size */
+typedef struct sync_entry {
+	char stamp[25];
+	unsigned char done;
+} sync_entry_t;
+
+/* one store every rendered message is replicated to. Its events are
+ * spread over a pool of connections, so replies arrive out of order. */
+typedef struct sync_target {
+	struct sync_target *next;
+	store_conf_t *conf;
+	sync_conn_t *conns;
+	int nconns;
+	sync_state_t *state; /* watermark of the current channel on this store */
+	char since[25]; /* watermark at channel start; older events are skipped */
+	char acked[25]; /* goes into state at the next checkpoint */
+	sync_entry_t *ledger;
+	int ledger_size;
+	int head, tail; /* first unacknowledged and next free seq */
+	int fail_seq; /* first seq which will never be acknowledged, or -1 */
+	unsigned dead:1;
+} sync_target_t;
+
+typedef struct {
+	sync_target_t *tgt;
+	sync_conn_t *conn;
+	struct sync_msg *msg;
+	int seq;
+} sync_ack_t;
+
+/* a rendered message, shared by the APPENDs of all stores */
+typedef struct sync_msg {
+	char *data;
+	int refs;
+	sync_ack_t acks[1]; /* one per target */
+} sync_msg_t;
+
+struct sync_session {
+	config_t *conf;
+	sync_target_t *targets;
+	int ntargets;
+};
 
 static const char Flags[] = { 'D', 'F', 'R', 'S', 'T' };
 const char table[] = "0123456789abcdefghijklmnopqrstuvwxyz";
@@ -211,28 +257,239 @@ expunge( store_t *ctx, store_t *rctx )
 
 //if ((ret = sync_new( chan->mops, sctx, mctx, chan->master, jfp, &srecadd, 0, &smaxuid )) != SYNC_OK ||
 //   (ret = sync_new( chan->sops, mctx, sctx, chan->slave, jfp, &srecadd, 1, &mmaxuid )) != SYNC_OK)
-int
-sms_imap_sync_one(const char *message)
+static void
+grow_ledger( sync_target_t *tgt )
+{
+	sync_entry_t *ledger;
+	int seq, size;
+
+	size = tgt->ledger_size ? tgt->ledger_size * 2 : 64;
+	ledger = nfmalloc( size * sizeof(*ledger) );
+	for (seq = tgt->head; seq != tgt->tail; seq++)
+		ledger[seq % size] = tgt->ledger[seq % tgt->ledger_size];
+	free( tgt->ledger );
+	tgt->ledger = ledger;
+	tgt->ledger_size = size;
+}
+
+static void
+release_msg( sync_msg_t *msg )
+{
+	if (!--msg->refs) {
+		free( msg->data );
+		free( msg );
+	}
+}
+
+static void
+sms_imap_append_done( int sts, void *aux )
+{
+    sync_ack_t *ack = aux;
+    sync_target_t *tgt = ack->tgt;
+    sync_entry_t *ent;
+
+    ack->conn->pending--;
+    if (sts == DRV_OK) {
+        tgt->ledger[ack->seq % tgt->ledger_size].done = 1;
+        /* the watermark only moves over the contiguous acknowledged prefix */
+        while (tgt->head != tgt->tail && tgt->head != tgt->fail_seq &&
+               (ent = &tgt->ledger[tgt->head % tgt->ledger_size])->done) {
+            if (strcmp( ent->stamp, tgt->acked ) > 0)
+                strcpy( tgt->acked, ent->stamp );
+            tgt->head++;
+        }
+    } else {
+        if (tgt->fail_seq < 0 || ack->seq < tgt->fail_seq) {
+            if (tgt->fail_seq < 0)
+                fprintf( stderr, "Store %s rejected a message, stopping channel there\n",
+                         tgt->conf->name );
+            tgt->fail_seq = ack->seq;
+        }
+        if (sts == DRV_STORE_BAD)
+            ack->conn->dead = 1;
+    }
+    release_msg( ack->msg );
+}
+
+/* past this many APPENDs in flight on the least busy connection, the
+ * others are checked for replies that have arrived meanwhile */
+#define POLL_PENDING 16
+
+static sync_conn_t *
+least_pending( sync_target_t *tgt )
+{
+    sync_conn_t *conn, *best = 0;
+    int i;
+
+    for (i = 0; i < tgt->nconns; i++) {
+        conn = &tgt->conns[i];
+        if (!conn->dead && (!best || conn->pending < best->pending))
+            best = conn;
+    }
+    return best;
+}
+
+/* The least busy live connection of the pool. Replies are only read
+ * from a connection when it is written to, so without the poll the one
+ * that was waited for last would look least busy and get everything. */
+static sync_conn_t *
+pick_conn( sync_target_t *tgt )
 {
-    driver_t *tdriver = mctx->conf->driver;
-    int  uid;
+    sync_conn_t *conn, *best = least_pending( tgt );
+    int i;
+
+    if (best && best->pending >= POLL_PENDING && tgt->conf->driver->poll) {
+        for (i = 0; i < tgt->nconns; i++) {
+            conn = &tgt->conns[i];
+            if (!conn->dead && tgt->conf->driver->poll( conn->ctx ) != DRV_OK)
+                conn->dead = 1;
+        }
+        best = least_pending( tgt );
+    }
+    return best;
+}
 
+/* does this target take the next message? a target without a usable
+ * connection is given up */
+static sync_conn_t *
+wants_msg( sync_target_t *tgt, const char *stamp, int *live )
+{
+    sync_conn_t *conn;
+
+    if (tgt->dead || tgt->fail_seq >= 0)
+        return 0;
+    if (!(conn = pick_conn( tgt ))) {
+        tgt->dead = 1;
+        return 0;
+    }
+    *live = 1;
+    return strcmp( stamp, tgt->since ) > 0 ? conn : 0;
+}
+
+/* above this size a message is not held in memory for all stores; each
+ * renders its own copy as it sends it */
+#define MAX_SHARED_MSG (256 * 1024)
+
+/* The message goes to every store that has not seen it yet. If that is
+ * a single store with a driver that can do it, or the message is big, it
+ * is rendered straight into the connection's send buffer. Otherwise it is
+ * rendered once into a buffer which all stores send without further
+ * copies; the last reply frees it.
+ * A store takes the message if stamp is past its watermark. Once the
+ * store has acknowledged it, the watermark moves to commit, or to stamp
+ * if commit is null; it never moves back. */
+static int
+sync_msg( sync_session_t *session, const msg_render_t *render, char *data, int len,
+          const char *stamp, const char *commit )
+{
+    sync_target_t *tgt;
+    sync_conn_t *conn;
+    sync_ack_t *ack;
+    sync_entry_t *ent;
+    sync_msg_t *msg;
     msg_data_t msgdata;
+    int live = 0, wanted = 0, direct, sts;
+
+    for (tgt = session->targets; tgt; tgt = tgt->next)
+        if (wants_msg( tgt, stamp, &live ))
+            wanted++;
+    if (!wanted) {
+        free( data );
+        return live ? SYNC_OK : SYNC_FAIL;
+    }
 
-    char *copy = malloc(strlen(message)+1);
-    memcpy(copy,message,strlen(message));
-    *(copy+strlen(message)) = 0;
-    msgdata.data = copy;
-    msgdata.len = strlen(copy);
-    msgdata.flags =  0;
-    msgdata.crlf = 0;
-
-    switch (tdriver->store_msg( mctx, &msgdata, &uid )) {
-        case DRV_STORE_BAD: return SYNC_SLAVE_BAD ;
-        default: return SYNC_FAIL;
-        case DRV_OK: break;
+    msg = nfmalloc( sizeof(*msg) + (session->ntargets - 1) * sizeof(msg->acks[0]) );
+    ack = msg->acks;
+    msg->data = data;
+    msg->refs = 1;
+    msgdata.data = data;
+    msgdata.len = len;
+    msgdata.flags = 0;
+    msgdata.crlf = 1;
+    msgdata.borrowed = 1;
+
+    for (tgt = session->targets; tgt; tgt = tgt->next) {
+        if (!(conn = wants_msg( tgt, stamp, &live )))
+            continue;
+        direct = !data && tgt->conf->driver->append_render &&
+                 (wanted == 1 || render->len > MAX_SHARED_MSG);
+        if (!direct && !msg->data) {
+            msg->data = msgdata.data = nfmalloc( render->len );
+            msgdata.len = render->write( msg->data, 0, render->len, render->arg );
+        }
+
+        if (tgt->tail - tgt->head == tgt->ledger_size)
+            grow_ledger( tgt );
+        ent = &tgt->ledger[tgt->tail % tgt->ledger_size];
+        strncpy( ent->stamp, commit ? commit : stamp, sizeof(ent->stamp) - 1 );
+        ent->stamp[sizeof(ent->stamp) - 1] = 0;
+        ent->done = 0;
+
+        ack->tgt = tgt;
+        ack->conn = conn;
+        ack->msg = msg;
+        ack->seq = tgt->tail;
+        conn->pending++;
+        msg->refs++;
+        if (direct)
+            sts = tgt->conf->driver->append_render( conn->ctx, render, sms_imap_append_done, ack++ );
+        else
+            sts = tgt->conf->driver->append_msg( conn->ctx, &msgdata, sms_imap_append_done, ack++ );
+        if (sts != DRV_OK) {
+            /* whatever this connection had in flight is lost as well */
+            msg->refs--;
+            conn->pending--;
+            conn->dead = 1;
+            fprintf( stderr, "Store %s: network error\n", tgt->conf->name );
+            tgt->fail_seq = tgt->tail;
+        }
+        tgt->tail++;
     }
-    return SYNC_OK;
+    release_msg( msg );
+    return live ? SYNC_OK : SYNC_FAIL;
+}
+
+int
+sms_imap_sync_render(sync_session_t *session, const msg_render_t *render, const char *stamp, const char *commit)
+{
+    return sync_msg( session, render, 0, 0, stamp, commit );
+}
+
+/* Like sms_imap_sync_render() for a message that is rendered already.
+ * The session takes over data, which must come from malloc(). */
+int
+sms_imap_sync_buffer(sync_session_t *session, char *data, int len, const char *stamp, const char *commit)
+{
+    return sync_msg( session, 0, data, len, stamp, commit );
+}
+
+/* Like sms_imap_sync_render() for a message that may have been sent
+ * before under the same Message-ID, e.g. the digest of a day that was
+ * still open: the stores that take it remove their old copies first. A
+ * store that cannot be asked gets a second copy; one whose connection
+ * fails stops the channel there, as a failed APPEND does. */
+int
+sms_imap_sync_replace(sync_session_t *session, const msg_render_t *render, const char *message_id,
+                      const char *stamp, const char *commit)
+{
+    sync_target_t *tgt;
+    sync_conn_t *conn;
+    int live = 0, sts;
+
+    for (tgt = session->targets; tgt; tgt = tgt->next) {
+        if (!tgt->conf->driver->delete_msgid || !(conn = wants_msg( tgt, stamp, &live )))
+            continue;
+        if ((sts = tgt->conf->driver->delete_msgid( conn->ctx, message_id )) == DRV_OK)
+            continue;
+        if (sts != DRV_STORE_BAD) {
+            fprintf( stderr, "Store %s cannot remove the old copy of <%s>\n", tgt->conf->name, message_id );
+            continue;
+        }
+        conn->dead = 1;
+        fprintf( stderr, "Store %s: network error, stopping channel there\n", tgt->conf->name );
+        tgt->fail_seq = tgt->tail;
+    }
+    return sync_msg( session, render, 0, 0, stamp, commit );
 }
 
 static char *
@@ -247,42 +504,46 @@ clean_strdup( const char *s )
 	return cs;
 }
 
-int sms_imap_config()
+int sms_imap_config(config_t *conf)
 {
+    arc4_t rs;
     int i = 0;
-	if (!(Home = getenv("HOME"))) {
+
+    memset( conf, 0, sizeof(*conf) );
+    pthread_mutex_init( &conf->state_lock, 0 );
+	if (!(conf->home = getenv("HOME"))) {
 		fputs( "Fatal: $HOME not set\n", stderr );
 		return 1;
 	}
 
-	if (load_config( 0, 0 ))
+	if (load_config( conf, 0, 0 ))
     {
         fprintf( stderr, "config error\n");
 		return 1;
     }
 
-    if(!stores || !stores->driver)
+    if(!conf->stores || !conf->stores->driver)
     {
         fprintf(stderr,"No imap server configured");
         return 1;
     }
 
-    if(!channels)
+    if(!conf->channels)
     {
         fprintf(stderr,"No channels defined");
         return 1;
     }
 
-    if(load_state_config(0,0))
+    if(load_state_config(conf,0,0))
     {
         fprintf(stderr,"First time sync");
-        srandom(time(NULL));
+        arc4_init(&rs);
         for(i=0 ;i <24;i++)
-            stores->prefrence[i] = table[rand()%strlen(table)];
-        stores->prefrence[24] = 0;
+            conf->stores->prefrence[i] = table[arc4_getbyte(&rs)%strlen(table)];
+        conf->stores->prefrence[24] = 0;
     }
 
-    if(!*stores->prefrence)
+    if(!*conf->stores->prefrence)
     {
         fprintf(stderr,"state file format error,please rm ~/.mbsync.state first!");
         return 1;
@@ -291,56 +552,164 @@ int sms_imap_config()
     return 0;
 }
 
-int sms_imap_init()
+/* Open a pool of connections to every configured store. Stores which
+ * cannot be reached are skipped; it is an error only if none can.
+ * Sessions share nothing but the config, so each thread can run its own.
+ * A store's connections are split between the share sessions that run
+ * at once; each gets at least one. */
+sync_session_t *sms_imap_init(config_t *conf, int share)
 {
+    sync_session_t *session;
     store_conf_t *mconf;
     driver_t *mdriver;
-    int ret = 0;
-
-    arc4_init();
-
-    mconf = stores;
-    mdriver = mconf->driver;
-    if (!(mctx = mdriver->open_store( mconf, mctx ))) {
-        ret = 1;
-        goto next;
+    store_t *mctx;
+    sync_target_t *tgt, **tgtapp;
+    int i, size;
+
+    session = nfcalloc( sizeof(*session) );
+    session->conf = conf;
+    tgtapp = &session->targets;
+
+    for (mconf = conf->stores; mconf; mconf = mconf->next) {
+        mdriver = mconf->driver;
+        size = mconf->connections / (share > 0 ? share : 1);
+        if (size < 1)
+            size = 1;
+        tgt = nfcalloc( sizeof(*tgt) );
+        tgt->conf = mconf;
+        tgt->conns = nfcalloc( size * sizeof(*tgt->conns) );
+        for (i = 0; i < size; i++) {
+            if (!(mctx = mdriver->open_store( mconf, 0 )))
+                break;
+            mdriver->prepare( mctx, OPEN_SIZE | OPEN_CREATE | OPEN_FLAGS );
+            tgt->conns[tgt->nconns++].ctx = mctx;
+        }
+        if (!tgt->nconns) {
+            fprintf( stderr, "Cannot open store %s, skipping it\n", mconf->name );
+            free( tgt->conns );
+            free( tgt );
+            continue;
+        }
+        if (tgt->nconns < size)
+            warn( "Store %s: only %d of %d connections could be opened\n",
+                  mconf->name, tgt->nconns, size );
+        *tgtapp = tgt;
+        tgtapp = &tgt->next;
+        session->ntargets++;
     }
-	mdriver->prepare( mctx, OPEN_SIZE | OPEN_CREATE | OPEN_FLAGS );
 
-    /*
-    switch (mdriver->select( mctx, 1, INT_MAX, 0, 0 )) {
-        case DRV_STORE_BAD: ret = SYNC_SLAVE_BAD; goto next;
-        case DRV_BOX_BAD: ret = SYNC_FAIL; goto next;
+    if (!session->targets) {
+        free( session );
+        return 0;
     }
-	info( "%d messages, %d recent\n", mctx->count, mctx->recent );
-	dump_box( mctx );
-    */
-
-    return ret;
-next:
-    if (mctx)
-        mdriver->close_store( mctx );
-
-    return ret;
+    return session;
 }
 
-int sms_imap_select_mailbox(const char* mailBox)
+/* Point every store at the channel's mailbox and return the oldest
+ * watermark among them, which is where the event query has to start. */
+const char *sms_imap_begin_channel(sync_session_t *session, channel_conf_t *channel)
 {
-    info( "Select MailBox %s\n", mailBox);
-
-    mctx->uidvalidity = 0;
-
-    if(mailBox && *mailBox)
-        mctx->name = mailBox;
-    else
-        mctx->name = "INBOX";
-    return 0;
+    sync_target_t *tgt;
+    store_t *ctx;
+    const char *since = 0;
+    int i;
+
+    info( "Select MailBox %s\n", channel->mail_box );
+
+    for (tgt = session->targets; tgt; tgt = tgt->next) {
+        for (i = 0; i < tgt->nconns; i++) {
+            ctx = tgt->conns[i].ctx;
+            ctx->uidvalidity = 0;
+            if(channel->mail_box && *channel->mail_box)
+                ctx->name = channel->mail_box;
+            else
+                ctx->name = "INBOX";
+        }
+
+        tgt->head = tgt->tail = 0;
+        tgt->fail_seq = -1;
+        pthread_mutex_lock( &session->conf->state_lock );
+        tgt->state = channel_state( channel, tgt->conf );
+        strcpy( tgt->since, tgt->state->sync_time );
+        pthread_mutex_unlock( &session->conf->state_lock );
+        strcpy( tgt->acked, tgt->since );
+        if (!tgt->dead && (!since || strcmp( tgt->since, since ) < 0))
+            since = tgt->since;
+    }
+    return since ? since : "";
 }
 
-void sms_imap_close()
+/* Save the acknowledged watermarks. The final checkpoint of a channel
+ * waits for all outstanding APPENDs first. */
+int sms_imap_checkpoint(sync_session_t *session, int final)
 {
-    if (mctx)
-        stores->driver->close_store( mctx );
+    sync_target_t *tgt;
+    sync_conn_t *conn;
+    int i;
+
+    if (final)
+        for (tgt = session->targets; tgt; tgt = tgt->next)
+            for (i = 0; i < tgt->nconns; i++) {
+                conn = &tgt->conns[i];
+                if (!conn->dead && tgt->conf->driver->check( conn->ctx ) != DRV_OK)
+                    conn->dead = 1;
+            }
+    pthread_mutex_lock( &session->conf->state_lock );
+    for (tgt = session->targets; tgt; tgt = tgt->next)
+        strcpy( tgt->state->sync_time, tgt->acked );
+    pthread_mutex_unlock( &session->conf->state_lock );
+    return save_state_config( session->conf, 0, !final );
 }
 
+/* Between channels, when nothing is in flight: reopen the connections
+ * that died, and with ping send the others a NOOP, so the server does
+ * not log them out while the session waits for events. Returns nonzero
+ * if no store is reachable. */
+int sms_imap_refresh(sync_session_t *session, int ping)
+{
+    sync_target_t *tgt;
+    sync_conn_t *conn;
+    driver_t *driver;
+    store_t *ctx;
+    int i, live = 0;
+
+    for (tgt = session->targets; tgt; tgt = tgt->next) {
+        driver = tgt->conf->driver;
+        tgt->dead = 1;
+        for (i = 0; i < tgt->nconns; i++) {
+            conn = &tgt->conns[i];
+            if (!conn->dead && ping && driver->noop && driver->noop( conn->ctx ) != DRV_OK)
+                conn->dead = 1;
+            if (conn->dead) {
+                /* a fresh login; until one succeeds the old store stays */
+                if (!(ctx = driver->open_store( tgt->conf, 0 )))
+                    continue;
+                driver->prepare( ctx, OPEN_SIZE | OPEN_CREATE | OPEN_FLAGS );
+                driver->close_store( conn->ctx );
+                conn->ctx = ctx;
+                conn->dead = 0;
+                conn->pending = 0;
+            }
+            tgt->dead = 0;
+        }
+        if (!tgt->dead)
+            live = 1;
+    }
+    return live ? SYNC_OK : SYNC_FAIL;
+}
 
+void sms_imap_close(sync_session_t *session)
+{
+    sync_target_t *tgt;
+    int i;
+
+    while ((tgt = session->targets)) {
+        session->targets = tgt->next;
+        for (i = 0; i < tgt->nconns; i++)
+            tgt->conf->driver->close_store( tgt->conns[i].ctx );
+        free( tgt->conns );
+        free( tgt->ledger );
+        free( tgt );
+    }
+    free( session );
+}
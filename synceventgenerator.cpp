@@ -0,0 +1,67 @@
+#include "synceventgenerator.h"
+
+/* by synthetic.c's kind */
+static const Event::EventType kindTypes[] = { Event::SMSEvent, Event::MMSEvent, Event::IMEvent, Event::CallEvent };
+
+SyncEventGenerator::SyncEventGenerator(quint32 seed, int count)
+    : seed(seed)
+    , pageSize(0)
+{
+    synth_init(&synth, seed, count);
+}
+
+void SyncEventGenerator::addSyncType(Event::EventType type, const QDateTime &time)
+{
+    for (int k = 0; k < SYNTH_KINDS; k++)
+        if (kindTypes[k] == type)
+            synth_add_kind(&synth, k, time.isNull() ? 0 : time.toMSecsSinceEpoch());
+}
+
+void SyncEventGenerator::setPageSize(int size)
+{
+    pageSize = size;
+}
+
+bool SyncEventGenerator::start()
+{
+    synth_start(&synth);
+    return true;
+}
+
+bool SyncEventGenerator::takePage(const QHash<int, SyncEventBatch *> &batches)
+{
+    QHash<SyncEventBatch *, QHash<int, int> > interned;
+    char remote[64];
+    int n = 0;
+
+    foreach (SyncEventBatch *batch, batches)
+        batch->clear();
+    while ((pageSize <= 0 || n < pageSize) && synth_next(&synth, &event)) {
+        n++;
+        Event::EventType type = kindTypes[event.kind];
+        SyncEventBatch *batch = batches.value(type);
+        if (!batch)
+            continue;
+
+        QHash<int, int> &uids = interned[batch];
+        QHash<int, int>::const_iterator uid = uids.constFind(event.rank);
+        if (uid == uids.constEnd()) {
+            uid = uids.insert(event.rank, batch->remoteUids.size());
+            batch->remoteUids.append(QString::fromLatin1(remote, synth_remote(&event, remote, sizeof(remote))));
+        }
+
+        batch->ids.append(event.id);
+        batch->startTimes.append(event.start);
+        batch->endTimes.append(event.end);
+        batch->directions.append(event.inbound ? Event::Inbound : Event::Outbound);
+        batch->flags.append(event.missed ? SyncEventBatch::MissedCall : 0);
+        batch->groupIds.append(event.rank + 1);
+        batch->remotes.append(*uid);
+        batch->freeTexts.append(batch->addText(event.body, event.body_len));
+        if (type == Event::SMSEvent || type == Event::MMSEvent)
+            batch->tokens.append(batch->addText(QString("synthetic-%1-%2").arg(seed).arg(event.id)));
+        if (type == Event::MMSEvent)
+            batch->parts.append(QList<MessagePart>());
+    }
+    return n > 0;
+}
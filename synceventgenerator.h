@@ -0,0 +1,37 @@
+#ifndef SYNCEVENTGENERATOR_H
+#define SYNCEVENTGENERATOR_H
+
+#include "synceventsource.h"
+#include "synthetic.h"
+
+/*!
+ * \class SyncEventGenerator
+ *  Made-up SMS, MMS, IM and call events for measuring the sync without a
+ *  phone, from the generator in synthetic.c: contacts are Zipf
+ *  distributed, bodies log-normal in length and partly in other scripts.
+ *  Everything follows from the seed, and each event only from the seed,
+ *  its type and its number, so the same seed gives the same events
+ *  whatever the types asked for and the times they start after.
+ */
+class SyncEventGenerator : public SyncEventSource
+{
+public:
+    /*!
+     * \param count Events over all four types, spread over three years.
+     */
+    SyncEventGenerator(quint32 seed, int count);
+
+    void addSyncType(Event::EventType type, const QDateTime &time);
+    void setPageSize(int size);
+    bool start();
+    bool takePage(const QHash<int, SyncEventBatch *> &batches);
+    bool hasFailed() const { return false; }
+
+private:
+    quint32 seed;
+    int pageSize;
+    synth_t synth;
+    synth_event_t event;
+};
+
+#endif // SYNCEVENTGENERATOR_H
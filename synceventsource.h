@@ -0,0 +1,119 @@
+#ifndef SYNCEVENTSOURCE_H
+#define SYNCEVENTSOURCE_H
+
+#include <string.h>
+#include <QDateTime>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QVector>
+#include <CommHistory/Event>
+#include <CommHistory/MessagePart>
+using namespace CommHistory;
+
+/*!
+ * \struct SyncEventBatch
+ *  Fetched events as typed columns, one entry per event. Texts live in one
+ *  UTF-16 arena and remote uids are interned, so a batch takes a fraction
+ *  of what the model's Event objects do.
+ */
+struct SyncEventBatch
+{
+    enum Flag { MissedCall = 1 };
+
+    struct Text {
+        int offset;     /* into text, in UTF-16 units */
+        int length;
+    };
+
+    QVector<int> ids;
+    QVector<qint64> startTimes;     /* msecs since the epoch */
+    QVector<qint64> endTimes;
+    QVector<uchar> directions;      /* Event::EventDirection */
+    QVector<uchar> flags;
+    QVector<int> groupIds;
+    QVector<int> remotes;           /* into remoteUids */
+    QVector<Text> freeTexts;
+    QVector<Text> tokens;           /* SMS and MMS */
+    QVector<QList<MessagePart> > parts;     /* MMS, empty otherwise */
+
+    QVector<QString> remoteUids;
+    QVector<ushort> text;
+
+    int size() const { return ids.size(); }
+    const ushort *utf16(const Text &t) const { return text.constData() + t.offset; }
+    QString string(const Text &t) const { return QString::fromUtf16(utf16(t),t.length); }
+    Text addText(const ushort *string, int length) {
+        Text t;
+        t.offset = text.size();
+        t.length = length;
+        text.resize(t.offset + length);
+        if (length)
+            memcpy(text.data() + t.offset, string, length * sizeof(ushort));
+        return t;
+    }
+    Text addText(const QString &string) { return addText(string.utf16(), string.size()); }
+    void clear();
+};
+
+inline void SyncEventBatch::clear()
+{
+    ids.clear();
+    startTimes.clear();
+    endTimes.clear();
+    directions.clear();
+    flags.clear();
+    groupIds.clear();
+    remotes.clear();
+    freeTexts.clear();
+    tokens.clear();
+    parts.clear();
+    remoteUids.clear();
+    text.clear();
+}
+
+/*!
+ * \class SyncEventSource
+ *  Where a sync gets its events from: the events of some types, each type
+ *  newer than its own time, in end time order, a page at a time.
+ */
+class SyncEventSource
+{
+public:
+    virtual ~SyncEventSource() {}
+
+    /*!
+     * Deliver events of type whose end time is after time.
+     */
+    virtual void addSyncType(Event::EventType type, const QDateTime &time) = 0;
+
+    /*!
+     * At most size events per page, 0 for all of them in one.
+     */
+    virtual void setPageSize(int size) = 0;
+
+    /*!
+     * Start fetching, once the types are set.
+     * \return true if successful, otherwise false
+     */
+    virtual bool start() = 0;
+
+    /*!
+     * Wait for the next page and move it into the batches for the events'
+     * types; events of types without a batch are dropped.
+     * \return false once all pages were taken, or fetching failed
+     */
+    virtual bool takePage(const QHash<int, SyncEventBatch *> &batches) = 0;
+
+    /*!
+     * \return how many queries run side by side
+     */
+    virtual int sliceCount() const { return 1; }
+
+    /*!
+     * \return true if pages were left out because fetching failed
+     */
+    virtual bool hasFailed() const = 0;
+};
+
+#endif // SYNCEVENTSOURCE_H
@@ -21,6 +21,12 @@
 ******************************************************************************/
 
 #include <QDebug>
+#include <QHash>
+#include <QCoreApplication>
+#include <QtSparql/QSparqlConnection>
+#include <QtSparql/QSparqlQuery>
+#include <QtSparql/QSparqlResult>
+#include <QtSparql/QSparqlError>
 #include <CommHistory/eventmodel_p.h>
 #include <CommHistory/TrackerIO>
 #include <CommHistory/eventsquery.h>
@@ -41,20 +47,40 @@ public:
         , type(_type)
         , account(_account)
         , lastModified(_lastModified)
+        , pageSize(0)
+        , more(false)
     {
+        propertyMask = syncProperties(_type);
+    }
+
+    /* every type is ordered and checkpointed on EndTime; the rest is only
+       what that type's messages are made of */
+    static Event::PropertySet syncProperties(Event::EventType type) {
         Event::PropertySet properties;
         properties += Event::Id;
+        properties += Event::Type;
         properties += Event::StartTime;
         properties += Event::EndTime;
         properties += Event::Direction;
-        properties += Event::IsMissedCall;
-        properties += Event::LocalUid;
         properties += Event::RemoteUid;
-        properties += Event::FreeText;
         properties += Event::GroupId;
-        properties += Event::MessageToken;
 
-        propertyMask = properties;
+        switch (type) {
+        case Event::MMSEvent:
+            properties += Event::MessageParts;
+            // fall through
+        case Event::SMSEvent:
+            properties += Event::MessageToken;
+            properties += Event::FreeText;
+            break;
+        case Event::CallEvent:
+            properties += Event::IsMissedCall;
+            break;
+        default:
+            properties += Event::FreeText;
+            break;
+        }
+        return properties;
     }
 
     bool acceptsEvent(const Event &event) const {
@@ -83,8 +109,117 @@ public:
     bool lastModified;
     Event::EventType  type;
     QString account;
+
+    /* types fetched alongside type, each newer than its time */
+    QList<QPair<Event::EventType, QDateTime> > syncTypes;
+
+    /* pages continue after the last event taken, in query order */
+    int pageSize;
+    bool more;
+    QDateTime lastTime;
+    QString lastUri;
+
+    /* a time slice of the events, for fetching slices side by side */
+    QDateTime after;
+    QDateTime until;
+
+    QStringList patterns() const;
 };
 
+/* a type's messages, newer than time unless it is null; %1 is the message */
+static QString typePattern(Event::EventType type, const QDateTime &time)
+{
+    QString pattern(QLatin1String("{%1 rdf:type "));
+
+    switch (type) {
+    case Event::SMSEvent:
+        pattern += QLatin1String("nmo:SMSMessage");
+        break;
+    case Event::MMSEvent:
+        pattern += QLatin1String("nmo:MMSMessage");
+        break;
+    case Event::IMEvent:
+        pattern += QLatin1String("nmo:IMMessage");
+        break;
+    case Event::CallEvent:
+        pattern += QLatin1String("nmo:Call");
+        break;
+    default:
+        pattern += QLatin1String("nmo:Message");
+        break;
+    }
+    if (!time.isNull())
+        pattern += QLatin1String(" . FILTER(nmo:receivedDate(%1) > \"")
+                + time.toUTC().toString(Qt::ISODate)
+                + QLatin1String("\"^^xsd:dateTime)");
+    return pattern + QLatin1String(" }");
+}
+
+/* The query's graph patterns. Each has one placeholder left for the
+   message variable, the lowest numbered one, so it can go to
+   EventsQuery::variable() or be filled in by hand. */
+QStringList SyncMessageModelPrivate::patterns() const
+{
+    QStringList patterns;
+
+    if (parentId != ALL) {
+        patterns << QString(QLatin1String("%2 nmo:phoneMessageId \"%1\" . "))
+                .arg(parentId);
+    }
+
+    if (lastModified) {
+        if (!dtTime.isNull()) { //get all last modified messages after time t1
+            patterns << QString(QLatin1String("FILTER(nmo:receivedDate(%2) <= \"%1\"^^xsd:dateTime)"))
+                    .arg(dtTime.toUTC().toString(Qt::ISODate));
+            patterns << QString(QLatin1String("FILTER(nie:contentLastModified(%2) > \"%1\"^^xsd:dateTime)"))
+                    .arg(dtTime.toUTC().toString(Qt::ISODate));
+        } else {
+            patterns << QString(QLatin1String("FILTER(nie:contentLastModified(%2) > \"%1\"^^xsd:dateTime)"))
+                    .arg(QDateTime::fromTime_t(0).toUTC().toString(Qt::ISODate));
+        }
+    } else if (syncTypes.isEmpty()) {
+        if (!dtTime.isNull()) { //get all messages after time t1(including modified)
+            patterns << QString(QLatin1String("FILTER(nmo:receivedDate(%2) > \"%1\"^^xsd:dateTime)"))
+                    .arg(dtTime.toUTC().toString(Qt::ISODate));
+        }
+    }
+
+    if (pageSize > 0 && !lastUri.isEmpty()) {
+        patterns << QString(QLatin1String("FILTER(nmo:receivedDate(%3) > \"%1\"^^xsd:dateTime || "
+                                          "(nmo:receivedDate(%3) = \"%1\"^^xsd:dateTime && str(%3) > \"%2\"))"))
+                .arg(lastTime.toUTC().toString(Qt::ISODate))
+                .arg(lastUri);
+    }
+
+    if (!after.isNull()) {
+        patterns << QString(QLatin1String("FILTER(nmo:receivedDate(%2) > \"%1\"^^xsd:dateTime)"))
+                .arg(after.toUTC().toString(Qt::ISODate));
+    }
+    if (!until.isNull()) {
+        patterns << QString(QLatin1String("FILTER(nmo:receivedDate(%2) <= \"%1\"^^xsd:dateTime)"))
+                .arg(until.toUTC().toString(Qt::ISODate));
+    }
+
+    if(!account.isEmpty())
+    {
+        const char managerFormat[] =
+                "{%2 nmo:to [nco:hasContactMedium <telepathy:/org/freedesktop/Telepathy/Account/%1>]} UNION {%2 nmo:from [nco:hasContactMedium <telepathy:/org/freedesktop/Telepathy/Account/%1>]}";
+
+        patterns << QString(QLatin1String(managerFormat)).arg(account);
+    }
+
+    if (!syncTypes.isEmpty()) {
+        /* each type with its own time; the account is matched once for all */
+        QString types = typePattern(type, lastModified ? QDateTime() : dtTime);
+        for (int i = 0; i < syncTypes.size(); i++)
+            types += QLatin1String(" UNION ") + typePattern(syncTypes.at(i).first, syncTypes.at(i).second);
+        patterns << types;
+    } else if (type) {
+        patterns << typePattern(type, QDateTime());
+    }
+    return patterns;
+}
+
 SyncMessageModel::SyncMessageModel(int parentId , Event::EventType type, QString account,QDateTime time, bool lastModified ,QObject *parent)
     : EventModel(*(new SyncMessageModelPrivate(this, parentId, type,account,time, lastModified)), parent)
 {
@@ -103,65 +238,85 @@ bool SyncMessageModel::getEvents()
     d->clearEvents();
 
     EventsQuery query(d->propertyMask);
+    foreach (const QString &pattern, d->patterns())
+        query.addPattern(pattern).variable(Event::Id);
 
-    if (d->parentId != ALL) {
-        query.addPattern(QString(QLatin1String("%2 nmo:phoneMessageId \"%1\" . "))
-                         .arg(d->parentId))
-                .variable(Event::Id);
-    }
+    /* the keyset above needs a total order it can compare against */
+    QString modifier(QLatin1String("ORDER BY ASC(%1) ASC(str(%2))"));
+    if (d->pageSize > 0)
+        modifier += QString(QLatin1String(" LIMIT %1")).arg(d->pageSize);
+    query.addModifier(modifier)
+                     .variable(Event::EndTime)
+                     .variable(Event::Id);
 
-    if (d->lastModified) {
-        if (!d->dtTime.isNull()) { //get all last modified messages after time t1
-            query.addPattern(QString(QLatin1String("FILTER(nmo:receivedDate(%2) <= \"%1\"^^xsd:dateTime)"))
-                             .arg(d->dtTime.toUTC().toString(Qt::ISODate)))
-                    .variable(Event::Id);
-            query.addPattern(QString(QLatin1String("FILTER(nie:contentLastModified(%2) > \"%1\"^^xsd:dateTime)"))
-                             .arg(d->dtTime.toUTC().toString(Qt::ISODate)))
-                    .variable(Event::Id);
-        } else {
-            query.addPattern(QString(QLatin1String("FILTER(nie:contentLastModified(%2) > \"%1\"^^xsd:dateTime)"))
-                             .arg(QDateTime::fromTime_t(0).toUTC().toString(Qt::ISODate)))
-                    .variable(Event::Id);
-        }
-    } else {
-        if (!d->dtTime.isNull()) { //get all messages after time t1(including modified)
-            query.addPattern(QString(QLatin1String("FILTER(nmo:receivedDate(%2) > \"%1\"^^xsd:dateTime)"))
-                             .arg(d->dtTime.toUTC().toString(Qt::ISODate)))
-                    .variable(Event::Id);
-        }
-    }
 
-    if(!d->account.isEmpty())
-    {
-        const char managerFormat[] =
-                "{%2 nmo:to [nco:hasContactMedium <telepathy:/org/freedesktop/Telepathy/Account/%1>]} UNION {%2 nmo:from [nco:hasContactMedium <telepathy:/org/freedesktop/Telepathy/Account/%1>]}";
+    d->more = false;
+    return d->executeQuery(query);
+}
 
-        query.addPattern( QString(QLatin1String(managerFormat)).arg(d->account))
-                .variable(Event::Id);
-    }
+void SyncMessageModel::setPageSize(int size)
+{
+    Q_D(SyncMessageModel);
+    d->pageSize = size;
+}
 
-    if(d->type)
-    {
-        switch(d->type)
-        {
-        case Event::SMSEvent:
-            query.addPattern(QLatin1String("{%1 rdf:type nmo:SMSMessage }")).variable(Event::Id);
-                    break;
-        case Event::IMEvent:
-            query.addPattern(QLatin1String("{%1 rdf:type nmo:IMMessage }")).variable(Event::Id);
-            break;
-        case Event::CallEvent:
-            query.addPattern(QLatin1String("{%1 rdf:type nmo:Call }")).variable(Event::Id);
-                    break;
-        }
+void SyncMessageModel::setTimeRange(const QDateTime &after, const QDateTime &until)
+{
+    Q_D(SyncMessageModel);
+    d->after = after;
+    d->until = until;
+}
+
+/* tracker hands out aggregated dates as strings or seconds */
+static QDateTime boundTime(const QVariant &value)
+{
+    if (value.type() == QVariant::DateTime)
+        return value.toDateTime();
+    QDateTime time = QDateTime::fromString(value.toString(), Qt::ISODate);
+    if (!time.isValid()) {
+        bool ok;
+        uint seconds = value.toUInt(&ok);
+        if (ok)
+            time = QDateTime::fromTime_t(seconds);
     }
+    return time;
+}
 
-    query.addModifier("ORDER BY ASC(%1) ASC(tracker:id(%2))")
-                     .variable(Event::EndTime)
-                     .variable(Event::Id);
+bool SyncMessageModel::getBounds(QDateTime &first, QDateTime &last, int &count)
+{
+    Q_D(SyncMessageModel);
+    QString where;
 
+    foreach (const QString &pattern, d->patterns())
+        where += pattern.arg(QLatin1String("?m")) + QLatin1String(" ");
+    QSparqlQuery query(QLatin1String("SELECT MIN(nmo:receivedDate(?m)) MAX(nmo:receivedDate(?m)) COUNT(?m) "
+                                     "WHERE { ?m a nmo:Message . ") + where + QLatin1String("}"));
+    QSparqlConnection connection(QLatin1String("QTRACKER_DIRECT"));
+    QSparqlResult *result = connection.exec(query);
+    result->waitForFinished();
+    bool ok = !result->hasError() && result->next();
+    if (ok) {
+        first = boundTime(result->value(0));
+        last = boundTime(result->value(1));
+        count = result->value(2).toInt();
+    } else {
+        qWarning() << "Bounds query failed:" << result->lastError().message();
+    }
+    delete result;
+    return ok;
+}
 
-    return d->executeQuery(query);
+void SyncMessageModel::addSyncType(Event::EventType type, const QDateTime &time)
+{
+    Q_D(SyncMessageModel);
+    d->syncTypes.append(qMakePair(type, time));
+    d->propertyMask += SyncMessageModelPrivate::syncProperties(type);
+}
+
+bool SyncMessageModel::morePages() const
+{
+    Q_D(const SyncMessageModel);
+    return d->more;
 }
 
 void SyncMessageModel::setSyncMessageFilter(const SyncMessageFilter& filter)
@@ -172,4 +327,212 @@ void SyncMessageModel::setSyncMessageFilter(const SyncMessageFilter& filter)
     d->lastModified = filter.lastModified;
     d->type = filter.type;
     d->account = filter.account;
+    d->propertyMask = SyncMessageModelPrivate::syncProperties(filter.type);
+    d->syncTypes.clear();
+    d->lastTime = QDateTime();
+    d->lastUri.clear();
+    d->more = false;
+}
+
+/* events of one type, whatever the batch, fill the same columns */
+static void appendEvent(SyncEventBatch &batch, QHash<QString, int> &interned, const Event &e)
+{
+    QHash<QString, int>::const_iterator remote = interned.constFind(e.remoteUid());
+    if (remote == interned.constEnd()) {
+        remote = interned.insert(e.remoteUid(), batch.remoteUids.size());
+        batch.remoteUids.append(e.remoteUid());
+    }
+
+    batch.ids.append(e.id());
+    batch.startTimes.append(e.startTime().toMSecsSinceEpoch());
+    batch.endTimes.append(e.endTime().toMSecsSinceEpoch());
+    batch.directions.append(e.direction());
+    batch.flags.append(e.isMissedCall() ? SyncEventBatch::MissedCall : 0);
+    batch.groupIds.append(e.groupId());
+    batch.remotes.append(*remote);
+    batch.freeTexts.append(batch.addText(e.freeText()));
+    if (e.type() == Event::SMSEvent || e.type() == Event::MMSEvent)
+        batch.tokens.append(batch.addText(e.messageToken()));
+    if (e.type() == Event::MMSEvent)
+        batch.parts.append(e.messageParts());
+}
+
+void SyncMessageModel::takeEvents(SyncEventBatch &batch)
+{
+    QHash<QString, int> interned;
+    int n = rowCount();
+
+    batch.clear();
+    batch.ids.reserve(n);
+    batch.startTimes.reserve(n);
+    batch.endTimes.reserve(n);
+    batch.directions.reserve(n);
+    batch.flags.reserve(n);
+    batch.groupIds.reserve(n);
+    batch.remotes.reserve(n);
+    batch.freeTexts.reserve(n);
+
+    for (int row = 0; row < n; row++)
+        appendEvent(batch, interned, event(index(row, 0)));
+    batch.text.squeeze();
+
+    releaseEvents();
+}
+
+void SyncMessageModel::takeEvents(const QHash<int, SyncEventBatch *> &batches)
+{
+    QHash<int, QHash<QString, int> > interned;
+    int n = rowCount();
+
+    foreach (SyncEventBatch *batch, batches)
+        batch->clear();
+
+    for (int row = 0; row < n; row++) {
+        Event e = event(index(row, 0));
+        SyncEventBatch *batch = batches.value(e.type());
+        if (batch)
+            appendEvent(*batch, interned[e.type()], e);
+    }
+    foreach (SyncEventBatch *batch, batches)
+        batch->text.squeeze();
+
+    releaseEvents();
+}
+
+/* remember where the next page starts and drop the events */
+void SyncMessageModel::releaseEvents()
+{
+    Q_D(SyncMessageModel);
+    int n = rowCount();
+
+    if (n) {
+        Event last = event(index(n - 1, 0));
+        d->lastTime = last.endTime();
+        d->lastUri = last.url().toString();
+    }
+    d->more = d->pageSize > 0 && n >= d->pageSize;
+
+    reset();
+    d->clearEvents();
+}
+
+SyncMessageStream::SyncMessageStream(const QString &account, QObject *parent)
+    : QObject(parent)
+    , account(account)
+    , filtered(false)
+    , pageSize(0)
+    , maxSlices(1)
+    , sliceEvents(0)
+    , current(0)
+    , failed(false)
+{
+}
+
+SyncMessageStream::~SyncMessageStream()
+{
+    qDeleteAll(slices);
+}
+
+void SyncMessageStream::setSyncMessageFilter(const SyncMessageFilter &filter)
+{
+    this->filter = filter;
+    filtered = true;
+    types.clear();
+}
+
+void SyncMessageStream::setSlicing(int maxSlices, int sliceEvents)
+{
+    this->maxSlices = maxSlices;
+    this->sliceEvents = sliceEvents;
+}
+
+void SyncMessageStream::addSyncType(Event::EventType type, const QDateTime &time)
+{
+    if (!filtered)
+        setSyncMessageFilter(SyncMessageFilter(ALL, type, account, time));
+    else
+        types.append(qMakePair(type, time));
+}
+
+void SyncMessageStream::setPageSize(int size)
+{
+    pageSize = size;
+}
+
+SyncMessageModel *SyncMessageStream::createSlice()
+{
+    SyncMessageModel *slice = new SyncMessageModel(filter.parentId, filter.type, account,
+                                                   filter.time, filter.lastModified);
+    for (int i = 0; i < types.size(); i++)
+        slice->addSyncType(types.at(i).first, types.at(i).second);
+    slice->setPageSize(pageSize);
+    return slice;
+}
+
+bool SyncMessageStream::start()
+{
+    QDateTime first, last;
+    int count = 0, n = 1;
+
+    qDeleteAll(slices);
+    slices.clear();
+    ready.clear();
+    current = 0;
+    failed = false;
+
+    /* one slice per sliceEvents events, evenly spread over the time span */
+    SyncMessageModel *slice = createSlice();
+    if (maxSlices > 1 && slice->getBounds(first, last, count) && first.isValid() && last.isValid()) {
+        n = qBound(1, count / qMax(sliceEvents, 1), maxSlices);
+        if (first.secsTo(last) < n)
+            n = 1;
+    }
+    qint64 span = n > 1 ? first.secsTo(last) : 0;
+    for (int i = 0; i < n; i++) {
+        if (i)
+            slice = createSlice();
+        slice->setTimeRange(i ? first.addSecs(span * i / n) : QDateTime(),
+                            i + 1 < n ? first.addSecs(span * (i + 1) / n) : QDateTime());
+        slice->setQueryMode(EventModel::AsyncQuery);
+        connect(slice, SIGNAL(modelReady(bool)), this, SLOT(sliceReady(bool)));
+        slices.append(slice);
+        ready.append(Waiting);
+    }
+    /* all of them at once, tracker works on them side by side */
+    for (int i = 0; i < n; i++)
+        if (!slices.at(i)->getEvents())
+            ready[i] = Failed;
+    return ready.first() != Failed;
+}
+
+bool SyncMessageStream::takePage(const QHash<int, SyncEventBatch *> &batches)
+{
+    if (current >= slices.size())
+        return false;
+
+    SyncMessageModel *slice = slices.at(current);
+    while (ready.at(current) == Waiting)
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    if (ready.at(current) == Failed) {
+        /* the slices after it must not move the watermark past it */
+        current = slices.size();
+        failed = true;
+        return false;
+    }
+    ready[current] = Waiting;
+    slice->takeEvents(batches);
+    if (slice->morePages())
+        slice->getEvents();     /* ahead of the caller, like the slices after it */
+    else
+        current++;
+    return true;
+}
+
+void SyncMessageStream::sliceReady(bool successful)
+{
+    int i = slices.indexOf(static_cast<SyncMessageModel *>(sender()));
+    if (!successful)
+        qWarning() << "Slice" << i << "query failed";
+    if (i >= 0)
+        ready[i] = successful ? Ready : Failed;
 }
@@ -24,8 +24,15 @@
 #define COMMHISTORY_SYNCMESSAGEMODEL_H
 
 #include <QDateTime>
+#include <QVector>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QObject>
 #include <CommHistory/EventModel>
 #include <CommHistory/Event>
+#include <CommHistory/MessagePart>
+#include "synceventsource.h"
 #include <CommHistory/libcommhistoryexport.h>
 using namespace CommHistory;
 
@@ -74,10 +81,35 @@ public:
     /*!
      * Reset model and fetch sms events. Messages are fetched based on SyncSMSFilter
      * This method is used to retrieve the sms present in device during sync session
+     * With a page size set, only the next page is fetched, starting after the
+     * last event taken with takeEvents().
      * \return true if successful, otherwise false
      */
     bool getEvents();
 
+    /*!
+     * Fetch at most size events per getEvents(), 0 for all of them.
+     */
+    void setPageSize(int size);
+
+    /*!
+     * \return true if the last page was full, so there may be more
+     */
+    bool morePages() const;
+
+    /*!
+     * Only fetch events received after after and up to until; null times
+     * leave that end open.
+     */
+    void setTimeRange(const QDateTime &after, const QDateTime &until);
+
+    /*!
+     * Find the first and last time and the number of the events the
+     * filter matches, without fetching them.
+     * \return true if successful, otherwise false
+     */
+    bool getBounds(QDateTime &first, QDateTime &last, int &count);
+
     /*!
       * if filter.parentId is set, then all messages whose parentId matches that of the filter would be fetched. If parentId is 'ALL', then all messages would be fetched, no constraint would be set in this case
       * If filter.time is set and lastModified and deleted are not set, then all messages whose sent/received time is greater or equal to filter.time would be fetched
@@ -85,8 +117,87 @@ public:
       */
     void setSyncMessageFilter(const SyncMessageFilter& filter);
 
+    /*!
+     * Also fetch events of type whose time is after time, in the same query
+     * as the filter's type, so the account is only matched once. Each type
+     * keeps its own time. Meant for sync queries without lastModified.
+     */
+    void addSyncType(Event::EventType type, const QDateTime &time);
+
+    /*!
+     * Move the fetched events into batch, in model order, and release them
+     * from the model. Only the properties of the filter's type are filled in.
+     */
+    void takeEvents(SyncEventBatch &batch);
+
+    /*!
+     * Like takeEvents(), but events go to the batch for their type; events
+     * of types without a batch are dropped.
+     */
+    void takeEvents(const QHash<int, SyncEventBatch *> &batches);
+
 private:
+    void releaseEvents();
+
     Q_DECLARE_PRIVATE(SyncMessageModel);
 };
 
+/*!
+ * \class SyncMessageStream
+ *  The events of a SyncMessageModel filter, in order, a page at a time. A
+ *  big backlog is split into time slices that are queried side by side,
+ *  each a page ahead of the reader, and read back one after the other.
+ */
+class SyncMessageStream : public QObject, public SyncEventSource
+{
+    Q_OBJECT
+
+public:
+    SyncMessageStream(const QString &account, QObject *parent = 0);
+    ~SyncMessageStream();
+
+    /*!
+     * Fetch the filter's events; addSyncType() adds more types to it.
+     */
+    void setSyncMessageFilter(const SyncMessageFilter &filter);
+
+    /*!
+     * One slice per sliceEvents events, at most maxSlices; by default
+     * there is just one.
+     */
+    void setSlicing(int maxSlices, int sliceEvents);
+
+    void addSyncType(Event::EventType type, const QDateTime &time);
+    void setPageSize(int size);
+
+    /*!
+     * Split the events into slices and start fetching the first page of
+     * every slice.
+     */
+    bool start();
+
+    bool takePage(const QHash<int, SyncEventBatch *> &batches);
+    int sliceCount() const { return slices.size(); }
+    bool hasFailed() const { return failed; }
+
+private slots:
+    void sliceReady(bool successful);
+
+private:
+    enum { Waiting, Ready, Failed };
+
+    SyncMessageModel *createSlice();
+
+    QString account;
+    SyncMessageFilter filter;
+    bool filtered;
+    QList<QPair<Event::EventType, QDateTime> > types;
+    int pageSize;
+    int maxSlices, sliceEvents;
+    QList<SyncMessageModel *> slices;
+    QVector<int> ready;
+    int current;
+    bool failed;
+};
+
 #endif // SYNCSMSMODEL_H
@@ -0,0 +1,244 @@
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include "syncsqlitesource.h"
+
+/* The tracker database versions whose tables the query below was written
+   against; any other version goes through SPARQL. Trackers before 0.15
+   leave user_version at 0 and write the version to db-version.txt next to
+   the database instead. */
+static const int knownVersions[] = { 25 };
+
+/* Tracker keeps a class's single valued properties in a table named after
+   the class, multi valued ones in a table per property, and dates as
+   seconds. The remote party's contact medium is "telepathy:<account>!<uid>"
+   and the message and channel URIs end in commhistory's ids. */
+static const char branchFormat[] =
+    "SELECT %1 AS kind, m.ID AS id, mr.Uri, m.\"nmo:sentDate\", m.\"nmo:receivedDate\" AS received, "
+    "m.\"nmo:isSent\", "
+    "(SELECT r.Uri FROM \"nco:Role_nco:hasContactMedium\" AS rm JOIN Resource AS r ON r.ID = rm.\"nco:hasContactMedium\" "
+    "WHERE rm.ID = CASE WHEN m.\"nmo:isSent\" "
+    "THEN (SELECT \"nmo:to\" FROM \"nmo:Message_nmo:to\" WHERE ID = m.ID LIMIT 1) "
+    "ELSE m.\"nmo:from\" END LIMIT 1), "
+    "cr.Uri, ie.\"nie:plainTextContent\", m.\"nmo:messageId\", m.\"nmo:isAnswered\" "
+    "FROM \"nmo:Message\" AS m "
+    "JOIN \"rdfs:Resource_rdf:type\" AS t ON t.ID = m.ID AND t.\"rdf:type\" = %2 "
+    "JOIN Resource AS mr ON mr.ID = m.ID "
+    "LEFT JOIN \"nie:InformationElement\" AS ie ON ie.ID = m.ID "
+    "LEFT JOIN Resource AS cr ON cr.ID = m.\"nmo:communicationChannel\" "
+    "WHERE m.\"nmo:receivedDate\" > %3 "
+    "AND (m.\"nmo:receivedDate\" > ?1 OR (m.\"nmo:receivedDate\" = ?1 AND m.ID > ?2)) "
+    "AND EXISTS (SELECT 1 FROM \"nco:Role_nco:hasContactMedium\" AS a "
+    "WHERE a.\"nco:hasContactMedium\" = %4 "
+    "AND (a.ID = m.\"nmo:from\" OR a.ID IN (SELECT \"nmo:to\" FROM \"nmo:Message_nmo:to\" WHERE ID = m.ID)))";
+
+enum { ColKind, ColId, ColUri, ColSent, ColReceived, ColIsSent, ColRemote, ColChannel,
+       ColText, ColToken, ColAnswered };
+
+static const char *typeClass(Event::EventType type)
+{
+    switch (type) {
+    case Event::SMSEvent:
+        return "http://www.semanticdesktop.org/ontologies/2007/03/22/nmo#SMSMessage";
+    case Event::IMEvent:
+        return "http://www.semanticdesktop.org/ontologies/2007/03/22/nmo#IMMessage";
+    case Event::CallEvent:
+        return "http://www.semanticdesktop.org/ontologies/2007/03/22/nmo#Call";
+    default:
+        return 0;   /* MMS parts are out of reach of a flat query */
+    }
+}
+
+static QString columnString(sqlite3_stmt *stmt, int col)
+{
+    const void *text = sqlite3_column_text16(stmt, col);
+    return text ? QString::fromUtf16((const ushort *)text, sqlite3_column_bytes16(stmt, col) / 2) : QString();
+}
+
+/* what follows the last separator, "message:12" gives 12 */
+static int uriId(const QString &uri)
+{
+    return uri.mid(uri.lastIndexOf(':') + 1).toInt();
+}
+
+SyncSqliteSource::SyncSqliteSource(const QString &path, const QString &account)
+    : path(path)
+    , account(account)
+    , pageSize(0)
+    , db(0)
+    , page(0)
+    , lastTime(-1)
+    , lastId(-1)
+    , done(false)
+    , failed(false)
+{
+}
+
+SyncSqliteSource::~SyncSqliteSource()
+{
+    sqlite3_finalize(page);
+    sqlite3_close(db);
+}
+
+void SyncSqliteSource::addSyncType(Event::EventType type, const QDateTime &time)
+{
+    types.append(qMakePair(type, time));
+}
+
+void SyncSqliteSource::setPageSize(int size)
+{
+    pageSize = size;
+}
+
+int SyncSqliteSource::schemaVersion()
+{
+    sqlite3_stmt *stmt;
+    int version = 0;
+
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, 0) != SQLITE_OK)
+        return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (!version) {
+        QFile file(QFileInfo(path).dir().filePath(QLatin1String("db-version.txt")));
+        if (file.open(QIODevice::ReadOnly))
+            version = file.readAll().trimmed().toInt();
+    }
+    return version;
+}
+
+qint64 SyncSqliteSource::resourceId(const char *uri)
+{
+    sqlite3_stmt *stmt;
+    qint64 id = -1;
+
+    if (sqlite3_prepare_v2(db, "SELECT ID FROM Resource WHERE Uri = ?", -1, &stmt, 0) != SQLITE_OK)
+        return -1;
+    sqlite3_bind_text(stmt, 1, uri, -1, SQLITE_TRANSIENT);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        id = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return id;
+}
+
+/* Read-only, so tracker keeps writing; in WAL mode every page is read
+   from one snapshot and the keyset picks up after it. The query is
+   prepared here, which also fails on tables or columns a known version
+   turns out not to have. */
+bool SyncSqliteSource::start()
+{
+    QString sql;
+
+    if (sqlite3_open_v2(path.toUtf8().constData(), &db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK) {
+        qWarning() << "Cannot open" << path << ":" << sqlite3_errmsg(db);
+        return false;
+    }
+    sqlite3_busy_timeout(db, 5000);
+
+    int version = schemaVersion();
+    unsigned v;
+    for (v = 0; v < sizeof(knownVersions) / sizeof(*knownVersions); v++)
+        if (knownVersions[v] == version)
+            break;
+    if (v == sizeof(knownVersions) / sizeof(*knownVersions)) {
+        qWarning() << "Unknown tracker database version" << version;
+        return false;
+    }
+
+    /* without it the query would not fail but silently match nothing */
+    QByteArray medium = "telepathy:/org/freedesktop/Telepathy/Account/" + account.toUtf8();
+    qint64 accountId = resourceId(medium.constData());
+    if (accountId < 0) {
+        qWarning() << "Tracker database has no account" << account;
+        return false;
+    }
+    for (int k = 0; k < types.size(); k++) {
+        const char *cls = typeClass(types.at(k).first);
+        qint64 classId = cls ? resourceId(cls) : -1;
+        if (classId < 0) {
+            qWarning() << "Tracker database has no class for event type" << types.at(k).first;
+            return false;
+        }
+        const QDateTime &since = types.at(k).second;
+        if (k)
+            sql += QLatin1String(" UNION ALL ");
+        sql += QString(QLatin1String(branchFormat))
+                .arg(k)
+                .arg(classId)
+                .arg(since.isNull() ? -1 : (qint64)since.toTime_t())
+                .arg(accountId);
+    }
+    sql += QLatin1String(" ORDER BY received, id LIMIT ?3");
+
+    if (sqlite3_prepare_v2(db, sql.toUtf8().constData(), -1, &page, 0) != SQLITE_OK) {
+        qWarning() << "Unknown tracker database schema:" << sqlite3_errmsg(db);
+        return false;
+    }
+    return true;
+}
+
+bool SyncSqliteSource::takePage(const QHash<int, SyncEventBatch *> &batches)
+{
+    QHash<SyncEventBatch *, QHash<QString, int> > interned;
+    int n = 0, ret;
+
+    if (done)
+        return false;
+    foreach (SyncEventBatch *batch, batches)
+        batch->clear();
+
+    sqlite3_reset(page);
+    sqlite3_bind_int64(page, 1, lastTime);
+    sqlite3_bind_int64(page, 2, lastId);
+    sqlite3_bind_int(page, 3, pageSize > 0 ? pageSize : -1);
+    while ((ret = sqlite3_step(page)) == SQLITE_ROW) {
+        n++;
+        lastTime = sqlite3_column_int64(page, ColReceived);
+        lastId = sqlite3_column_int64(page, ColId);
+
+        Event::EventType type = types.at(sqlite3_column_int(page, ColKind)).first;
+        SyncEventBatch *batch = batches.value(type);
+        if (!batch)
+            continue;
+
+        QString remoteUid = columnString(page, ColRemote);
+        int sep = remoteUid.indexOf('!');
+        remoteUid = remoteUid.mid(sep >= 0 ? sep + 1 : remoteUid.indexOf(':') + 1);
+        QHash<QString, int> &uids = interned[batch];
+        QHash<QString, int>::const_iterator remote = uids.constFind(remoteUid);
+        if (remote == uids.constEnd()) {
+            remote = uids.insert(remoteUid, batch->remoteUids.size());
+            batch->remoteUids.append(remoteUid);
+        }
+
+        bool sent = sqlite3_column_int(page, ColIsSent);
+        qint64 endTime = lastTime * 1000;
+        qint64 startTime = sqlite3_column_type(page, ColSent) == SQLITE_NULL ?
+                    endTime : sqlite3_column_int64(page, ColSent) * 1000;
+        uchar flags = 0;
+        if (type == Event::CallEvent && !sent && !sqlite3_column_int(page, ColAnswered))
+            flags |= SyncEventBatch::MissedCall;
+
+        batch->ids.append(uriId(columnString(page, ColUri)));
+        batch->startTimes.append(startTime);
+        batch->endTimes.append(endTime);
+        batch->directions.append(sent ? Event::Outbound : Event::Inbound);
+        batch->flags.append(flags);
+        batch->groupIds.append(uriId(columnString(page, ColChannel)));
+        batch->remotes.append(*remote);
+        batch->freeTexts.append(batch->addText((const ushort *)sqlite3_column_text16(page, ColText),
+                                               sqlite3_column_bytes16(page, ColText) / 2));
+        if (type == Event::SMSEvent)
+            batch->tokens.append(batch->addText(columnString(page, ColToken)));
+    }
+    if (ret != SQLITE_DONE) {
+        qWarning() << "Reading the tracker database failed:" << sqlite3_errmsg(db);
+        failed = done = true;
+        return false;
+    }
+    if (pageSize <= 0 || n < pageSize)
+        done = true;
+    return n > 0;
+}
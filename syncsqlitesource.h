@@ -0,0 +1,42 @@
+#ifndef SYNCSQLITESOURCE_H
+#define SYNCSQLITESOURCE_H
+
+#include <sqlite3.h>
+#include "synceventsource.h"
+
+/*!
+ * \class SyncSqliteSource
+ *  Reads events straight from tracker's SQLite database, read-only, with
+ *  one hand-written query per page instead of SPARQL translated by
+ *  tracker. It only knows the tables of the tracker it was written for:
+ *  start() fails if the database has another schema version or does not
+ *  look like that, if it has no such account, or for MMS, whose parts it
+ *  cannot read, and the caller falls back to the SPARQL path.
+ */
+class SyncSqliteSource : public SyncEventSource
+{
+public:
+    SyncSqliteSource(const QString &path, const QString &account);
+    ~SyncSqliteSource();
+
+    void addSyncType(Event::EventType type, const QDateTime &time);
+    void setPageSize(int size);
+    bool start();
+    bool takePage(const QHash<int, SyncEventBatch *> &batches);
+    bool hasFailed() const { return failed; }
+
+private:
+    int schemaVersion();
+    qint64 resourceId(const char *uri);
+
+    QString path;
+    QString account;
+    int pageSize;
+    QList<QPair<Event::EventType, QDateTime> > types;
+    sqlite3 *db;
+    sqlite3_stmt *page;
+    qint64 lastTime, lastId;   /* keyset: the last row taken */
+    bool done, failed;
+};
+
+#endif // SYNCSQLITESOURCE_H
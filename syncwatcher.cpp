@@ -0,0 +1,77 @@
+#include <QCoreApplication>
+#include <QDBusConnection>
+#include "syncwatcher.h"
+
+#define COMMHISTORY_INTERFACE "com.nokia.commhistory"
+
+SyncWatcher::SyncWatcher(QObject *parent)
+    : QObject(parent)
+    , delay(0)
+    , changed(false)
+    , expired(false)
+    , contacts(false)
+{
+    timer.setSingleShot(true);
+    connect(&timer, SIGNAL(timeout()), this, SLOT(timeout()));
+}
+
+/* any sender and path; the slot takes no arguments, so the events
+   themselves are never demarshalled */
+bool SyncWatcher::subscribe()
+{
+    QDBusConnection bus = QDBusConnection::sessionBus();
+
+    return bus.connect(QString(), QString(), COMMHISTORY_INTERFACE, "eventsAdded",
+                       this, SLOT(eventsChanged()))
+        && bus.connect(QString(), QString(), COMMHISTORY_INTERFACE, "eventsUpdated",
+                       this, SLOT(eventsChanged()));
+}
+
+/* by name, so that this does not need QtMobility's headers */
+void SyncWatcher::watchContacts(QObject *manager)
+{
+    connect(manager, SIGNAL(contactsAdded(QList<QContactLocalId>)), this, SLOT(contactsChanged()));
+    connect(manager, SIGNAL(contactsChanged(QList<QContactLocalId>)), this, SLOT(contactsChanged()));
+    connect(manager, SIGNAL(contactsRemoved(QList<QContactLocalId>)), this, SLOT(contactsChanged()));
+    connect(manager, SIGNAL(dataChanged()), this, SLOT(contactsChanged()));
+}
+
+bool SyncWatcher::takeContactsChanged()
+{
+    bool ret = contacts;
+    contacts = false;
+    return ret;
+}
+
+SyncWatcher::Wake SyncWatcher::wait(int delay, int idle)
+{
+    this->delay = delay;
+    expired = false;
+    timer.start(changed ? delay : idle);
+    while (!expired)
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    if (!changed)
+        return Idle;
+    changed = false;
+    return Changed;
+}
+
+/* the delay runs from the first change, later ones do not put it off */
+void SyncWatcher::eventsChanged()
+{
+    if (changed)
+        return;
+    changed = true;
+    if (timer.isActive())
+        timer.start(delay);
+}
+
+void SyncWatcher::contactsChanged()
+{
+    contacts = true;
+}
+
+void SyncWatcher::timeout()
+{
+    expired = true;
+}
@@ -0,0 +1,57 @@
+#ifndef SYNCWATCHER_H
+#define SYNCWATCHER_H
+
+#include <QObject>
+#include <QTimer>
+
+/*!
+ * \class SyncWatcher
+ *  Hears from commhistoryd when events are added or changed, over the
+ *  same D-Bus signals its event models listen to, without keeping any
+ *  events itself. It only records that something changed; the next sync
+ *  pass finds out what from the watermarks. It also notes when contacts
+ *  change, which does not call for a pass.
+ */
+class SyncWatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Wake { Changed, Idle };
+
+    SyncWatcher(QObject *parent = 0);
+
+    bool subscribe();
+
+    /*!
+     * Note when contacts are added, changed or removed in manager, a
+     * QContactManager.
+     */
+    void watchContacts(QObject *manager);
+
+    /*!
+     * \return true if contacts changed since the last call
+     */
+    bool takeContactsChanged();
+
+    /*!
+     * Wait for a change and then delay more milliseconds, so that a burst
+     * goes out in one pass, or return Idle after idle milliseconds
+     * without one. A change seen during the last pass counts.
+     */
+    Wake wait(int delay, int idle);
+
+private slots:
+    void eventsChanged();
+    void contactsChanged();
+    void timeout();
+
+private:
+    QTimer timer;
+    int delay;
+    bool changed;
+    bool expired;
+    bool contacts;
+};
+
+#endif // SYNCWATCHER_H
@@ -0,0 +1,210 @@
+/*
+ * Synthetic events. Each kind has a timeline of exponentially spaced end
+ * times with its own random state, so skipping events costs no more than
+ * stepping it; an event's fields come from a random state seeded by the
+ * seed, its kind and its number.
+ */
+
+#include "synthetic.h"
+
+#include <math.h>
+#include <stdio.h>
+
+/* per kind: SMS, MMS, IM, call */
+static const int kind_shares[] = { 60, 3, 25, 12 }; /* percent of all events */
+static const double body_median[] = { 40, 20, 30, 0 }; /* characters */
+static const double body_sigma[] = { 0.8, 0.8, 1.0, 0 };
+static const int body_max[] = { 1000, 500, 4000, 0 };
+
+#define CONTACTS 2000
+#define SPAN_START 1230768000000LL /* 2009-01-01 UTC */
+#define SPAN_LENGTH 94608000000LL /* three years */
+#define CALL_MEAN 150.0 /* seconds */
+
+static unsigned long long
+splitmix( unsigned long long *state )
+{
+	unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* in (0, 1], so it can go to log() */
+static double
+uniform( unsigned long long *state )
+{
+	return ((splitmix( state ) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static double
+gaussian( unsigned long long *state )
+{
+	double r = sqrt( -2 * log( uniform( state ) ) );
+	return r * cos( 2 * M_PI * uniform( state ) );
+}
+
+void
+synth_init( synth_t *synth, unsigned seed, int count )
+{
+	synth->seed = seed;
+	synth->count = count;
+	synth->nstreams = 0;
+}
+
+void
+synth_add_kind( synth_t *synth, int kind, long long since )
+{
+	int i = synth->nstreams;
+
+	if (kind < 0 || kind >= SYNTH_KINDS || i == SYNTH_KINDS)
+		return;
+	synth->nstreams++;
+	synth->stream[i].kind = kind;
+	synth->stream[i].since = since;
+	synth->stream[i].count = (long long)synth->count * kind_shares[kind] / 100;
+	synth->stream[i].mean = synth->stream[i].count ? SPAN_LENGTH / synth->stream[i].count : SPAN_LENGTH;
+}
+
+/* to the next event's end time */
+static void
+advance( synth_t *synth, int i )
+{
+	synth->stream[i].serial++;
+	synth->stream[i].next -= (long long)(synth->stream[i].mean * log( uniform( &synth->stream[i].clock ) ));
+}
+
+void
+synth_start( synth_t *synth )
+{
+	int i;
+
+	for (i = 0; i < synth->nstreams; i++) {
+		synth->stream[i].clock = ((unsigned long long)synth->seed << 32) ^ (synth->stream[i].kind + 1);
+		synth->stream[i].serial = -1;
+		synth->stream[i].next = SPAN_START;
+		do
+			advance( synth, i );
+		while (synth->stream[i].serial < synth->stream[i].count &&
+		       synth->stream[i].next <= synth->stream[i].since);
+	}
+}
+
+/* the script a contact writes in: mostly ASCII, some accented Latin,
+ * Cyrillic, CJK, and ASCII with emoji */
+static int
+contact_script( int rank )
+{
+	unsigned long long state = rank;
+	int p = splitmix( &state ) % 100;
+
+	return p < 75 ? 0 : p < 85 ? 1 : p < 92 ? 2 : p < 97 ? 3 : 4;
+}
+
+static int
+write_char( unsigned short *out, int script, unsigned long long *state )
+{
+	static const unsigned short accents[] = {
+		0xe0, 0xe1, 0xe2, 0xe4, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xed,
+		0xee, 0xef, 0xf1, 0xf3, 0xf4, 0xf6, 0xf9, 0xfa, 0xfc, 0xdf
+	};
+	double u = uniform( state );
+	unsigned c;
+
+	switch (script) {
+	case 1:
+		if (u < 0.15) {
+			out[0] = accents[(int)(u / 0.15 * 20) % 20];
+			return 1;
+		}
+		break;
+	case 2:
+		out[0] = 0x430 + (int)(u * 32) % 32;
+		return 1;
+	case 3:
+		out[0] = 0x4e00 + (int)(u * 2000) % 2000;
+		return 1;
+	case 4:
+		if (u < 0.1) {
+			c = 0x1f600 + (int)(u * 800) % 80;
+			out[0] = 0xd800 + ((c - 0x10000) >> 10);
+			out[1] = 0xdc00 + (c & 0x3ff);
+			return 2;
+		}
+		break;
+	}
+	out[0] = 'a' + (int)(uniform( state ) * 26) % 26;
+	return 1;
+}
+
+static void
+generate( const synth_t *synth, int i, synth_event_t *ev )
+{
+	int kind = synth->stream[i].kind;
+	unsigned long long state = ((unsigned long long)synth->seed << 32) ^
+	                           ((unsigned long long)(kind + 1) << 28) ^
+	                           (unsigned long long)synth->stream[i].serial;
+	int chars, script, c;
+	double u;
+
+	splitmix( &state );
+
+	/* Zipf with s = 1: rank k is picked with probability about 1/k */
+	ev->rank = (int)exp( uniform( &state ) * log( CONTACTS + 1.0 ) ) - 1;
+	if (ev->rank >= CONTACTS)
+		ev->rank = CONTACTS - 1;
+	ev->inbound = uniform( &state ) < 0.5;
+	ev->kind = kind;
+	ev->id = synth->stream[i].serial * SYNTH_KINDS + kind + 1;
+	ev->end = ev->start = synth->stream[i].next;
+	ev->missed = 0;
+	if (kind == SYNTH_CALL) {
+		if (ev->inbound && uniform( &state ) < 0.25)
+			ev->missed = 1;
+		else
+			ev->start -= (long long)(-CALL_MEAN * log( uniform( &state ) ) * 1000);
+	}
+
+	ev->body_len = 0;
+	if (body_max[kind]) {
+		chars = (int)(body_median[kind] * exp( body_sigma[kind] * gaussian( &state ) ));
+		if (chars < 1)
+			chars = 1;
+		else if (chars > body_max[kind])
+			chars = body_max[kind];
+		script = contact_script( ev->rank );
+		for (c = 0; c < chars; c++) {
+			u = uniform( &state );
+			if (script != 3 && u < 0.17)
+				ev->body[ev->body_len++] = ' ';
+			else if (u < 0.18)
+				ev->body[ev->body_len++] = '\n';
+			else
+				ev->body_len += write_char( ev->body + ev->body_len, script, &state );
+		}
+	}
+}
+
+int
+synth_next( synth_t *synth, synth_event_t *ev )
+{
+	int i, first = -1;
+
+	for (i = 0; i < synth->nstreams; i++)
+		if (synth->stream[i].serial < synth->stream[i].count &&
+		    (first < 0 || synth->stream[i].next < synth->stream[first].next))
+			first = i;
+	if (first < 0)
+		return 0;
+	generate( synth, first, ev );
+	advance( synth, first );
+	return 1;
+}
+
+int
+synth_remote( const synth_event_t *ev, char *out, int size )
+{
+	if (ev->kind == SYNTH_IM)
+		return snprintf( out, size, "contact%d@example.com", ev->rank );
+	return snprintf( out, size, "+35840%07d", ev->rank );
+}
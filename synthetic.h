@@ -0,0 +1,61 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Made-up SMS, MMS, IM and call events, for measuring the sync without a
+ * phone: contacts are Zipf distributed, bodies log-normal in length and
+ * partly in other scripts. Everything follows from the seed, and each
+ * event only from the seed, its kind and its number, so the same seed
+ * gives the same events whatever the kinds asked for and the times they
+ * start after. Plain C, so the harnesses in tests/ can run it too. */
+
+enum { SYNTH_SMS, SYNTH_MMS, SYNTH_IM, SYNTH_CALL, SYNTH_KINDS };
+
+#define SYNTH_BODY_MAX (2 * 4000) /* UTF-16 units */
+
+typedef struct {
+	int kind;
+	int id; /* unique over all kinds */
+	int rank; /* of the contact, 0 for the most frequent */
+	int inbound;
+	int missed; /* calls only */
+	long long start, end; /* msecs since the epoch */
+	int body_len;
+	unsigned short body[SYNTH_BODY_MAX];
+} synth_event_t;
+
+typedef struct {
+	unsigned seed;
+	int count;
+	int nstreams;
+	/* one kind's events, in end time order */
+	struct {
+		int kind;
+		long long since; /* msecs */
+		unsigned long long clock; /* random state of the timeline */
+		long long mean; /* msecs between events */
+		long long next; /* end time of event serial */
+		int serial;
+		int count;
+	} stream[SYNTH_KINDS];
+} synth_t;
+
+/* count events over all four kinds, spread over three years from 2009 */
+void synth_init( synth_t *synth, unsigned seed, int count );
+/* deliver events of kind whose end time is after since */
+void synth_add_kind( synth_t *synth, int kind, long long since );
+void synth_start( synth_t *synth );
+/* the next event of all the kinds added, in end time order; 0 once
+ * there are no more */
+int synth_next( synth_t *synth, synth_event_t *ev );
+/* the contact's phone number, or IM address; returns its length */
+int synth_remote( const synth_event_t *ev, char *out, int size );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SYNTHETIC_H */
@@ -0,0 +1,50 @@
+/*
+ * Throughput of base64_encode_lines() against the scalar reference, in GB/s
+ * of input, for attachment-sized buffers and for SMS-sized ones.
+ */
+
+#include "isync.h"
+#include "base64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static double
+rate( size_t (*encode)( const char *, size_t, char * ), const char *in, size_t len, char *out )
+{
+	long long start, elapsed;
+	size_t total = 0;
+	int rounds = 0;
+
+	start = get_usec();
+	do {
+		size_t off;
+		for (off = 0; off + len <= (1 << 22); off += len)
+			encode( in + off, len, out );
+		total += (1 << 22) / len * len;
+		rounds++;
+	} while ((elapsed = get_usec() - start) < 500000 || rounds < 3);
+	return total / (elapsed * 1e3);
+}
+
+int
+main( void )
+{
+	static const size_t lens[] = { 160, 1024, 65536, 1 << 22 };
+	char *in = nfmalloc( 1 << 22 ), *out = nfmalloc( BASE64_LINES_LENGTH(1 << 22) );
+	double vec, sca;
+	int i;
+
+	srand( 1 );
+	for (i = 0; i < 1 << 22; i++)
+		in[i] = rand();
+	printf( "%10s %12s %12s %8s\n", "bytes", "vector GB/s", "scalar GB/s", "speedup" );
+	for (i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); i++) {
+		vec = rate( base64_encode_lines, in, lens[i], out );
+		sca = rate( base64_encode_lines_scalar, in, lens[i], out );
+		printf( "%10zu %12.2f %12.2f %7.2fx\n", lens[i], vec, sca, vec / sca );
+	}
+	free( in );
+	free( out );
+	return 0;
+}
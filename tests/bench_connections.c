@@ -0,0 +1,71 @@
+/*
+ * How one channel's upload scales with the size of the connection pool.
+ * The stub server takes a fixed time per APPEND and serializes them per
+ * connection, which is what bounds a single session; the messages and
+ * the client side are the real ones.
+ */
+
+#include "stub_driver.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGES 4000
+#define APPEND_USEC 250
+#define MESSAGE_LEN 1024
+
+static long long
+run( int connections )
+{
+	config_t *conf = stub_config( 1, connections, APPEND_USEC );
+	channel_conf_t *channel = stub_channel( conf, "bench", "SMS" );
+	sync_session_t *session;
+	char stamp[25], id[32], *data;
+	long long start;
+	int i, len;
+
+	if (!(session = sms_imap_init( conf, 1 )))
+		exit( 1 );
+	sms_imap_begin_channel( session, channel );
+	start = get_usec();
+	for (i = 0; i < MESSAGES; i++) {
+		sprintf( stamp, "2014-01-01-%012d", i );
+		sprintf( id, "bench-%d", i );
+		data = stub_message( id, MESSAGE_LEN, &len );
+		if (sms_imap_sync_buffer( session, data, len, stamp, 0 )) {
+			fprintf( stderr, "upload failed at %d\n", i );
+			exit( 1 );
+		}
+	}
+	sms_imap_checkpoint( session, 1 );
+	start = get_usec() - start;
+	/* the watermark has to cover everything once all is acknowledged */
+	if (strcmp( channel->states->sync_time, stamp ) ||
+	    stub_count( (stub_store_conf_t *)conf->stores, "SMS", 0 ) != MESSAGES) {
+		fprintf( stderr, "%d connections: watermark %s, expected %s\n",
+		         connections, channel->states->sync_time, stamp );
+		exit( 1 );
+	}
+	sms_imap_close( session );
+	stub_config_free( conf );
+	return start;
+}
+
+int
+main( void )
+{
+	long long one = 0, t;
+	int k;
+
+	Quiet = 2;
+	printf( "%d messages of %d bytes, %d us per APPEND on the server\n",
+	        MESSAGES, MESSAGE_LEN, APPEND_USEC );
+	for (k = 1; k <= 8; k *= 2) {
+		t = run( k );
+		if (k == 1)
+			one = t;
+		printf( "%d connection%s: %6.0f messages/s, %.2fx\n", k, k > 1 ? "s" : " ",
+		        MESSAGES * 1e6 / t, (double)one / t );
+	}
+	return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Formatting a backlog's Date headers and state stamps: the formatter
+ * against localtime_r() and strftime(), per event. Qt cannot be built
+ * here; QDateTime::toString() did the same work plus a QString each.
+ */
+
+#define _GNU_SOURCE /* %-d */
+
+#include "isync.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define EVENTS 200000
+
+int
+main( void )
+{
+	time_t *times = nfmalloc( EVENTS * sizeof(*times) );
+	char date[64], stamp[64];
+	date_fmt_t fmt;
+	struct tm tm;
+	long long start, libc_ns, fmt_ns;
+	size_t sum = 0;
+	int i, n;
+
+	setenv( "TZ", "Europe/Helsinki", 1 );
+	tzset();
+	/* three years of events, in order */
+	srand( 1 );
+	for (times[0] = 1293840000, i = 1; i < EVENTS; i++)
+		times[i] = times[i - 1] + rand() % 950;
+
+	start = get_usec();
+	for (i = 0; i < EVENTS; i++) {
+		localtime_r( &times[i], &tm );
+		sum += strftime( date, sizeof(date), "%a, %-d %b %Y %H:%M:%S %z", &tm );
+		n = strftime( stamp, sizeof(stamp), "%Y-%m-%d-%H:%M:%S:", &tm );
+		sum += n + sprintf( stamp + n, "%03d", i % 1000 );
+	}
+	libc_ns = (get_usec() - start) * 1000 / EVENTS;
+
+	date_fmt_init( &fmt );
+	start = get_usec();
+	for (i = 0; i < EVENTS; i++) {
+		sum += date_fmt_rfc5322( &fmt, times[i], date );
+		sum += date_fmt_stamp( &fmt, times[i], i % 1000, stamp );
+	}
+	fmt_ns = (get_usec() - start) * 1000 / EVENTS;
+
+	printf( "%d events over three years, Europe/Helsinki (%zu bytes)\n", EVENTS, sum );
+	printf( "localtime_r + strftime: %4lld ns/event\n", libc_ns );
+	printf( "date_fmt              : %4lld ns/event, %.1fx\n", fmt_ns, (double)libc_ns / fmt_ns );
+	free( times );
+	return 0;
+}
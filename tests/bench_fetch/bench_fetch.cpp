@@ -0,0 +1,201 @@
+/*
+ * Times a full fetch of an account's SMS through SyncMessageStream, once
+ * with the events in one query and then cut into two and four time
+ * slices, and checks that every run delivers the same events in the same
+ * order. Given tracker's database, it then times SyncSqliteSource against
+ * the one query as well.
+ *
+ *   bench_fetch [account [meta.db]]    time the fetch, ring/tel/ring by default
+ *   bench_fetch fill <count> [seed]    first add synthetic events to commhistory
+ *
+ * fill writes into the phone's real message store, so it is for test
+ * devices only.
+ */
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QtAlgorithms>
+#include <CommHistory/EventModel>
+#include <CommHistory/GroupModel>
+#include <CommHistory/Group>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "syncmessagemodel.h"
+#include "synceventgenerator.h"
+#include "syncsqlitesource.h"
+
+using namespace CommHistory;
+
+static const int pageSize = 1000;
+
+static const char accountPath[] = "/org/freedesktop/Telepathy/Account/";
+
+/* the generator's SMS, with a group per contact as the messaging UI keeps them */
+static int fill(const QString &account, int count, quint32 seed)
+{
+    SyncEventGenerator generator(seed, count);
+    SyncEventBatch batch;
+    QHash<int, SyncEventBatch *> batches;
+    QHash<QString, int> groups;
+    GroupModel groupModel;
+    EventModel eventModel;
+    const QString localUid = QLatin1String(accountPath) + account;
+    int added = 0;
+
+    batches.insert(Event::SMSEvent, &batch);
+    generator.addSyncType(Event::SMSEvent, QDateTime());
+    generator.setPageSize(pageSize);
+    if (!generator.start())
+        return 1;
+    while (generator.takePage(batches)) {
+        QList<Event> events;
+        for (int i = 0; i < batch.size(); i++) {
+            const QString &remote = batch.remoteUids.at(batch.remotes.at(i));
+            QHash<QString, int>::const_iterator group = groups.constFind(remote);
+            if (group == groups.constEnd()) {
+                Group g;
+                g.setLocalUid(localUid);
+                g.setRemoteUids(QStringList() << remote);
+                g.setChatType(Group::ChatTypeP2P);
+                if (!groupModel.addGroup(g)) {
+                    fprintf(stderr, "cannot add the group of %s\n", qPrintable(remote));
+                    return 1;
+                }
+                group = groups.insert(remote, g.id());
+            }
+            Event e;
+            e.setType(Event::SMSEvent);
+            e.setStartTime(QDateTime::fromMSecsSinceEpoch(batch.startTimes.at(i)));
+            e.setEndTime(QDateTime::fromMSecsSinceEpoch(batch.endTimes.at(i)));
+            e.setDirection((Event::EventDirection)batch.directions.at(i));
+            e.setGroupId(*group);
+            e.setLocalUid(localUid);
+            e.setRemoteUid(remote);
+            e.setFreeText(batch.string(batch.freeTexts.at(i)));
+            e.setMessageToken(batch.string(batch.tokens.at(i)));
+            e.setIsRead(true);
+            events << e;
+        }
+        if (!eventModel.addEvents(events, false)) {
+            fprintf(stderr, "cannot add events\n");
+            return 1;
+        }
+        added += events.size();
+        batch.clear();
+    }
+    printf("added %d SMS in %d threads\n", added, groups.size());
+    return 0;
+}
+
+/* all of the account's SMS in up to slices queries; unlike main.cpp's
+   sliceEvents this cuts however few events there are */
+static bool fetch(const QString &account, int slices, QVector<int> &ids, qint64 &msecs)
+{
+    SyncMessageStream stream(account);
+    SyncEventBatch batch;
+    QHash<int, SyncEventBatch *> batches;
+    QElapsedTimer timer;
+
+    batches.insert(Event::SMSEvent, &batch);
+    timer.start();
+    stream.setSlicing(slices, 1);
+    stream.setPageSize(pageSize);
+    stream.addSyncType(Event::SMSEvent, QDateTime());
+    if (!stream.start())
+        return false;
+    while (stream.takePage(batches)) {
+        ids += batch.ids;
+        batch.clear();
+    }
+    msecs = timer.elapsed();
+    printf("%d slices asked, %d run: %d events in %lld ms, %.0f events/s\n",
+           slices, stream.sliceCount(), ids.size(), msecs,
+           msecs ? ids.size() * 1000.0 / msecs : 0.0);
+    return !stream.hasFailed();
+}
+
+/* the same through tracker's database */
+static bool fetchSqlite(const QString &path, const QString &account, QVector<int> &ids, qint64 &msecs)
+{
+    SyncSqliteSource source(path, account);
+    SyncEventBatch batch;
+    QHash<int, SyncEventBatch *> batches;
+    QElapsedTimer timer;
+
+    batches.insert(Event::SMSEvent, &batch);
+    timer.start();
+    source.setPageSize(pageSize);
+    source.addSyncType(Event::SMSEvent, QDateTime());
+    if (!source.start())
+        return false;
+    while (source.takePage(batches))
+        ids += batch.ids;
+    msecs = timer.elapsed();
+    printf("SQLite: %d events in %lld ms, %.0f events/s\n",
+           ids.size(), msecs, msecs ? ids.size() * 1000.0 / msecs : 0.0);
+    return !source.hasFailed();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments().mid(1);
+    QString account = QLatin1String("ring/tel/ring");
+
+    if (!args.isEmpty() && args.first() == QLatin1String("fill")) {
+        if (args.size() < 2) {
+            fprintf(stderr, "usage: bench_fetch fill <count> [seed]\n");
+            return 2;
+        }
+        fprintf(stderr, "adding synthetic SMS to this phone's message store\n");
+        return fill(account, args.at(1).toInt(), args.size() > 2 ? args.at(2).toUInt() : 1);
+    }
+    if (!args.isEmpty())
+        account = args.first();
+    QString db = args.size() > 1 ? args.at(1) : QString();
+
+    static const int slicings[] = { 1, 2, 4 };
+    QVector<int> first;
+    qint64 base = 0;
+    for (unsigned i = 0; i < sizeof(slicings) / sizeof(*slicings); i++) {
+        QVector<int> ids;
+        qint64 msecs;
+        if (!fetch(account, slicings[i], ids, msecs)) {
+            fprintf(stderr, "fetching in %d slices failed\n", slicings[i]);
+            return 1;
+        }
+        if (!i) {
+            first = ids;
+            base = msecs;
+        } else {
+            if (ids != first) {
+                fprintf(stderr, "%d slices delivered other events than one query\n", slicings[i]);
+                return 1;
+            }
+            printf("  %.2fx of one query\n", msecs ? (double)base / msecs : 0.0);
+        }
+    }
+
+    if (!db.isEmpty()) {
+        QVector<int> ids;
+        qint64 msecs;
+        if (!fetchSqlite(db, account, ids, msecs)) {
+            fprintf(stderr, "reading %s failed\n", qPrintable(db));
+            return 1;
+        }
+        if (ids != first) {
+            /* events of the same second may come in another order */
+            qSort(ids);
+            qSort(first);
+            if (ids != first) {
+                fprintf(stderr, "SQLite delivered other events than SPARQL\n");
+                return 1;
+            }
+            printf("  same events, some of the same second in another order\n");
+        }
+        printf("  %.2fx of one query\n", msecs ? (double)base / msecs : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+# Times fetching the events through SyncMessageStream with one, two and
+# four time slices, and through SyncSqliteSource. Built with qmake on the
+# device, against the same libraries as smssync.pro; see bench_fetch.cpp
+# for how to run it.
+
+TEMPLATE = app
+TARGET = bench_fetch
+QT -= gui
+CONFIG += console qtsparql
+PKGCONFIG += commhistory sqlite3
+
+INCLUDEPATH += ../..
+
+SOURCES += bench_fetch.cpp \
+    ../../syncmessagemodel.cpp \
+    ../../synceventgenerator.cpp \
+    ../../synthetic.c \
+    ../../syncsqlitesource.cpp
+
+HEADERS += \
+    ../../syncmessagemodel.h \
+    ../../synceventsource.h \
+    ../../synceventgenerator.h \
+    ../../synthetic.h \
+    ../../syncsqlitesource.h
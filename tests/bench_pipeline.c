@@ -0,0 +1,267 @@
+/*
+ * The upload pipeline end to end on synthetic events: a producer thread
+ * turns the generator's events into fields as main.cpp does its pages
+ * (UTF-16 bodies, dates, the contact's address rendered once), the render
+ * pool turns them into messages, and the sender appends them to a stub
+ * store and checkpoints. Once with no workers, where the sender renders
+ * everything, and once with the workers main.cpp would start. The config
+ * is a synthetic one, so the watermarks stay out of the real state file.
+ */
+
+#include "stub_driver.h"
+#include "base64.h"
+#include "pool.h"
+#include "synthetic.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COUNT 200000 /* over all four kinds; MMS are left out */
+#define BATCH 64
+#define BUDGET (8 << 20)
+
+typedef struct {
+	char id[16], message_id[48], stamp[32];
+	char date[RFC5322_DATE_LENGTH];
+	char address[48];
+	const char *peer, *subject; /* of the contact */
+	int peer_len, subject_len;
+	int inbound;
+	char *body;
+	size_t body_len;
+	body_class_t body_class;
+} event_t;
+
+typedef struct {
+	msg_buf_t peer, subject;
+} contact_t;
+
+typedef struct {
+	int kind;
+	synth_t synth;
+	msg_tmpl_t tmpl;
+	event_t *events;
+	int nevents;
+	contact_t *contacts; /* by rank */
+	int ncontacts;
+	render_pool_t *pool;
+} run_t;
+
+/* on a pool thread */
+static int
+render( void *arg, int i, msg_buf_t *out )
+{
+	run_t *run = arg;
+	event_t *ev = &run->events[i];
+	msg_fields_t fields;
+	msg_render_t r;
+
+	memset( &fields, 0, sizeof(fields) );
+	fields.peer = ev->peer;
+	fields.peer_len = ev->peer_len;
+	fields.subject = ev->subject;
+	fields.subject_len = ev->subject_len;
+	fields.inbound = ev->inbound;
+	fields.date = ev->date;
+	fields.message_id = ev->message_id;
+	fields.references = "stubstubstubstubstubstub.17@n9-sms-backup.local";
+	fields.id = ev->id;
+	fields.address = ev->address;
+	fields.body = ev->body;
+	fields.body_len = ev->body_len;
+	fields.body_class = &ev->body_class;
+	msg_tmpl_prepare( &run->tmpl, &fields, &r );
+	out->len = r.write( msg_buf_reserve( out, r.len ), 0, r.len, r.arg );
+	msg_tmpl_release( &fields );
+	return 0;
+}
+
+static contact_t *
+contact( run_t *run, int rank, const char *address )
+{
+	char name[32], email[64];
+	contact_t *c;
+	int n = run->ncontacts;
+
+	if (rank >= n) {
+		run->ncontacts = rank + 256;
+		run->contacts = nfrealloc( run->contacts, run->ncontacts * sizeof(*run->contacts) );
+		memset( run->contacts + n, 0, (run->ncontacts - n) * sizeof(*run->contacts) );
+	}
+	c = &run->contacts[rank];
+	if (!c->peer.len) {
+		sprintf( name, "Contact %d", rank );
+		if (run->kind == SYNTH_IM)
+			strcpy( email, address );
+		else
+			snprintf( email, sizeof(email), "%s@unknown.email", address );
+		msg_render_address( &c->peer, name, email );
+		msg_render_subject( &run->tmpl, &c->subject, name );
+	}
+	return c;
+}
+
+/* a call's body, as main.cpp's readEvent<CallEvent> writes it */
+static int
+call_body( const synth_event_t *sev, const char *number, unsigned short *out )
+{
+	char text[80];
+	int seconds = (int)(sev->end / 1000 - sev->start / 1000), len = 0, i;
+
+	if (!sev->missed)
+		len = sprintf( text, "%ds(%02d:%02d:%02d)\n", seconds, seconds / 3600, seconds / 60 % 60, seconds % 60 );
+	sprintf( text + len, "%s(%s Call)", number, !sev->inbound ? "Outgoing" : sev->missed ? "Missed" : "Incoming" );
+	for (i = 0; text[i]; i++)
+		out[i] = (unsigned char)text[i];
+	return i;
+}
+
+/* reads the generator and publishes the events a few at a time */
+static void *
+produce( void *arg )
+{
+	run_t *run = arg;
+	static synth_event_t sev;
+	date_fmt_t dates;
+	contact_t *c;
+	event_t *ev;
+	char *utf8 = nfmalloc( 3 * SYNTH_BODY_MAX );
+	int i;
+
+	date_fmt_init( &dates );
+	for (i = 0; i < run->nevents && synth_next( &run->synth, &sev ); i++) {
+		ev = &run->events[i];
+		sprintf( ev->id, "%d", sev.id );
+		sprintf( ev->message_id, "%08x%08x@n9-sms-backup.local", sev.id * 2654435761u, sev.id );
+		date_fmt_rfc5322( &dates, sev.start / 1000, ev->date );
+		date_fmt_stamp( &dates, sev.end / 1000, sev.end % 1000, ev->stamp );
+		synth_remote( &sev, ev->address, sizeof(ev->address) );
+		c = contact( run, sev.rank, ev->address );
+		ev->peer = c->peer.data;
+		ev->peer_len = c->peer.len;
+		ev->subject = c->subject.data;
+		ev->subject_len = c->subject.len;
+		ev->inbound = sev.inbound;
+		if (sev.kind == SYNTH_CALL)
+			sev.body_len = call_body( &sev, ev->address, sev.body );
+		ev->body_len = body_from_utf16( sev.body, sev.body_len, utf8, &ev->body_class );
+		ev->body = nfmalloc( ev->body_len + 1 );
+		memcpy( ev->body, utf8, ev->body_len );
+		if (i % 16 == 15 && render_pool_publish( run->pool, i + 1, 0 ))
+			break;
+	}
+	render_pool_publish( run->pool, i, 1 );
+	free( utf8 );
+	return 0;
+}
+
+/* one kind through the pipeline with nthreads workers; 0 if all arrived */
+static int
+run_kind( const char *label, int kind, int nthreads )
+{
+	config_t *conf = stub_config( 1, 2, 0 );
+	channel_conf_t *channel = stub_channel( conf, label, label );
+	sync_session_t *session;
+	render_pool_stats_t stats;
+	pthread_t producer;
+	msg_buf_t buf;
+	char path[_POSIX_PATH_MAX];
+	run_t run;
+	long long start, bytes = 0;
+	double secs;
+	int i, ret, failed = 0;
+
+	conf->synthetic_events = COUNT;
+	memset( &run, 0, sizeof(run) );
+	run.kind = kind;
+	synth_init( &run.synth, 1, COUNT );
+	synth_add_kind( &run.synth, kind, 0 );
+	synth_start( &run.synth );
+	run.nevents = run.synth.stream[0].count;
+	run.events = nfcalloc( run.nevents * sizeof(*run.events) );
+	msg_tmpl_compile( &run.tmpl, label, "Matti Meik\xc3\xa4l\xc3\xa4inen", "matti@example.com",
+	                  "Mon, 03 Feb 2014 10:00:00 +0200", 0 );
+	if (!(session = sms_imap_init( conf, 1 )))
+		return 1;
+	sms_imap_refresh( session, 1 );
+	sms_imap_begin_channel( session, channel );
+
+	start = get_usec();
+	run.pool = render_pool_start( nthreads, run.nevents, BATCH, BUDGET, render, &run );
+	pthread_create( &producer, 0, produce, &run );
+	for (i = 0; (ret = render_pool_take( run.pool, i, &buf )) <= 0; i++) {
+		if (ret < 0) {
+			msg_buf_init( &buf );
+			render( &run, i, &buf );
+		}
+		bytes += buf.len;
+		if (sms_imap_sync_buffer( session, buf.data, buf.len, run.events[i].stamp, 0 )) {
+			failed = 1;
+			render_pool_cancel( run.pool );
+			break;
+		}
+		if (i % 10 == 9)
+			sms_imap_checkpoint( session, 0 );
+	}
+	sms_imap_checkpoint( session, 1 );
+	pthread_join( producer, 0 );
+	render_pool_stop( run.pool, &stats );
+	secs = (get_usec() - start) / 1e6;
+	sms_imap_close( session );
+
+	printf( "%-4s %d worker%s: %6.0f events/s, %5.1f MB/s", label, nthreads, nthreads == 1 ? " " : "s",
+	        i / secs, bytes / secs / 1e6 );
+	if (nthreads)
+		printf( ", workers busy %3.0f%%", 100.0 * stats.render_busy / (stats.elapsed * stats.threads) );
+	printf( ", sender waited %lld ms on the producer, %lld ms on the workers\n",
+	        stats.wait_produce / 1000, stats.wait_render / 1000 );
+
+	if (!failed && stub_count( (stub_store_conf_t *)conf->stores, label, 0 ) != run.nevents) {
+		fprintf( stderr, "%s: %d of %d messages\n", label,
+		         stub_count( (stub_store_conf_t *)conf->stores, label, 0 ), run.nevents );
+		failed = 1;
+	}
+	if (!failed && strcmp( channel->states->sync_time, run.events[run.nevents - 1].stamp )) {
+		fprintf( stderr, "%s: watermark %s, expected %s\n", label,
+		         channel->states->sync_time, run.events[run.nevents - 1].stamp );
+		failed = 1;
+	}
+	nfsnprintf( path, sizeof(path), "%s/." EXE ".state", conf->home );
+	if (!access( path, F_OK )) {
+		fprintf( stderr, "a synthetic run wrote %s\n", path );
+		failed = 1;
+	}
+
+	for (i = 0; i < run.nevents; i++)
+		free( run.events[i].body );
+	for (i = 0; i < run.ncontacts; i++) {
+		free( run.contacts[i].peer.data );
+		free( run.contacts[i].subject.data );
+	}
+	free( run.contacts );
+	free( run.events );
+	msg_tmpl_free( &run.tmpl );
+	stub_config_free( conf );
+	return failed;
+}
+
+int
+main( void )
+{
+	static const struct {
+		const char *label;
+		int kind;
+	} kinds[] = { { "SMS", SYNTH_SMS }, { "IM", SYNTH_IM }, { "Call", SYNTH_CALL } };
+	int cpus = render_pool_cpus(), workers = cpus > 1 ? cpus - 1 : 1;
+	int k, failed = 0;
+
+	Quiet = 2;
+	printf( "%d synthetic events, seed 1, %d CPUs\n", COUNT, cpus );
+	for (k = 0; k < (int)(sizeof(kinds) / sizeof(kinds[0])); k++) {
+		failed |= run_kind( kinds[k].label, kinds[k].kind, 0 );
+		failed |= run_kind( kinds[k].label, kinds[k].kind, workers );
+	}
+	return failed;
+}
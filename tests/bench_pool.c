@@ -0,0 +1,112 @@
+/*
+ * Render throughput of the pool against the number of workers: a backlog
+ * of SMS is published in one go and the sender takes the messages in
+ * order and drops them, so nothing but rendering limits the rate. With
+ * no workers the sender renders every message itself, as on one CPU.
+ */
+
+#include "isync.h"
+#include "base64.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EVENTS 100000
+
+typedef struct {
+	char id[16], message_id[48];
+	char body[400];
+} event_t;
+
+static msg_tmpl_t tmpl;
+static msg_buf_t peer, subj;
+
+static int
+render( void *arg, int i, msg_buf_t *out )
+{
+	event_t *ev = (event_t *)arg + i;
+	msg_fields_t fields;
+	msg_render_t r;
+
+	memset( &fields, 0, sizeof(fields) );
+	fields.peer = peer.data;
+	fields.peer_len = peer.len;
+	fields.subject = subj.data;
+	fields.subject_len = subj.len;
+	fields.inbound = i & 1;
+	fields.date = "Mon, 03 Feb 2014 10:00:00 +0200";
+	fields.message_id = ev->message_id;
+	fields.references = "stubstubstubstubstubstub.17@n9-sms-backup.local";
+	fields.id = ev->id;
+	fields.address = "+358401234567";
+	fields.body = ev->body;
+	fields.body_len = strlen( ev->body );
+	msg_tmpl_prepare( &tmpl, &fields, &r );
+	out->len = r.write( msg_buf_reserve( out, r.len ), 0, r.len, r.arg );
+	msg_tmpl_release( &fields );
+	return 0;
+}
+
+static double
+run( event_t *events, int nthreads, render_pool_stats_t *stats )
+{
+	render_pool_t *pool;
+	msg_buf_t buf;
+	long long start = get_usec();
+	int i, ret;
+
+	pool = render_pool_start( nthreads, EVENTS, 64, 8 << 20, render, events );
+	render_pool_publish( pool, EVENTS, 1 );
+	for (i = 0; (ret = render_pool_take( pool, i, &buf )) <= 0; i++) {
+		if (ret < 0) {
+			msg_buf_init( &buf );
+			render( events, i, &buf );
+		}
+		free( buf.data );
+	}
+	render_pool_stop( pool, stats );
+	return EVENTS / ((get_usec() - start) / 1e6);
+}
+
+int
+main( void )
+{
+	static const int threads[] = { 0, 1, 2, 4, 8 };
+	event_t *events = nfcalloc( EVENTS * sizeof(*events) );
+	render_pool_stats_t stats;
+	double rate, base = 0;
+	int i, j, n;
+
+	msg_tmpl_compile( &tmpl, "SMS", "Matti Meik\xc3\xa4l\xc3\xa4inen", "matti@example.com",
+	                  "Mon, 03 Feb 2014 10:00:00 +0200", 0 );
+	msg_buf_init( &peer );
+	msg_render_address( &peer, "Teppo Testaaja", "teppo@example.com" );
+	msg_buf_init( &subj );
+	msg_render_subject( &tmpl, &subj, "Teppo Testaaja" );
+	for (i = 0; i < EVENTS; i++) {
+		sprintf( events[i].id, "%d", i );
+		sprintf( events[i].message_id, "%08x%08x@n9-sms-backup.local", i * 2654435761u, i );
+		/* some plain, some that need quoted-printable or base64 */
+		for (j = n = 0; n + 16 < (int)sizeof(events[i].body) && j < 10 + i % 40; j++)
+			n += sprintf( events[i].body + n, "%s ", i % 3 ? "sana" : "p\xc3\xa4iv\xc3\xa4\xc3\xa4" );
+	}
+
+	printf( "%d SMS, %d CPUs\n", EVENTS, render_pool_cpus() );
+	for (i = 0; i < (int)(sizeof(threads) / sizeof(threads[0])); i++) {
+		rate = run( events, threads[i], &stats );
+		if (!threads[i]) {
+			base = rate;
+			printf( "no workers : %7.0f messages/s\n", rate );
+		} else
+			printf( "%d worker%s  : %7.0f messages/s, %.2fx, workers busy %3.0f%%\n",
+			        threads[i], threads[i] > 1 ? "s" : " ", rate, rate / base,
+			        100.0 * stats.render_busy / (stats.elapsed * stats.threads) );
+	}
+	msg_tmpl_free( &tmpl );
+	free( peer.data );
+	free( subj.data );
+	free( events );
+	return 0;
+}
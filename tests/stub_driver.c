@@ -0,0 +1,324 @@
+#define _GNU_SOURCE /* memmem */
+
+#include "stub_driver.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+	long long due;
+	void (*done)( int sts, void *aux );
+	void *aux;
+} stub_reply_t;
+
+typedef struct {
+	store_t gen;
+	stub_reply_t *replies;
+	int head, tail, size; /* ring of replies not delivered yet */
+	long long busy_until;
+} stub_store_t;
+
+/* the stores' entry in config.c's driver table */
+driver_t imap_driver;
+
+enum { REPLIES_DUE, REPLIES_ROOM, REPLIES_ALL };
+
+/* the replies that are due; with REPLIES_ROOM also wait until the
+ * window has room, with REPLIES_ALL for all of them */
+static void
+deliver( stub_store_t *ctx, int wait )
+{
+	stub_reply_t *r;
+	long long now;
+
+	while (ctx->head != ctx->tail) {
+		r = &ctx->replies[ctx->head % ctx->size];
+		if ((now = get_usec()) < r->due) {
+			if (wait == REPLIES_DUE ||
+			    (wait == REPLIES_ROOM && ctx->tail - ctx->head < ((stub_store_conf_t *)ctx->gen.conf)->window))
+				return;
+			usleep( r->due - now );
+		}
+		ctx->head++;
+		r->done( DRV_OK, r->aux );
+	}
+}
+
+static store_t *
+stub_open_store( store_conf_t *conf, store_t *oldctx )
+{
+	stub_store_t *ctx;
+
+	(void)oldctx;
+	ctx = nfcalloc( sizeof(*ctx) );
+	ctx->gen.conf = conf;
+	ctx->size = 16;
+	ctx->replies = nfmalloc( ctx->size * sizeof(*ctx->replies) );
+	return &ctx->gen;
+}
+
+static void
+stub_close_store( store_t *gctx )
+{
+	stub_store_t *ctx = (stub_store_t *)gctx;
+
+	/* like a connection that goes away: the rest is never answered */
+	while (ctx->head != ctx->tail) {
+		stub_reply_t *r = &ctx->replies[ctx->head++ % ctx->size];
+		r->done( DRV_STORE_BAD, r->aux );
+	}
+	free( ctx->replies );
+	free( ctx );
+}
+
+static void
+stub_prepare( store_t *ctx, int opts )
+{
+	ctx->opts = opts;
+}
+
+static void
+record( stub_store_t *ctx, const char *data, int len )
+{
+	stub_store_conf_t *conf = (stub_store_conf_t *)ctx->gen.conf;
+	const char *id, *end;
+	stub_msg_t *msg;
+
+	pthread_mutex_lock( &conf->lock );
+	if (conf->nmsgs == conf->size) {
+		conf->size = conf->size ? 2 * conf->size : 64;
+		conf->msgs = nfrealloc( conf->msgs, conf->size * sizeof(*conf->msgs) );
+	}
+	msg = &conf->msgs[conf->nmsgs++];
+	msg->box = nfstrdup( ctx->gen.name );
+	msg->len = len;
+	if ((id = memmem( data, len, "\r\nMessage-ID: <", 15 )) &&
+	    (end = memchr( id + 15, '>', data + len - id - 15 )))
+		msg->message_id = strndup( id + 15, end - id - 15 );
+	else
+		msg->message_id = nfstrdup( "" );
+	conf->appended += len;
+	pthread_mutex_unlock( &conf->lock );
+}
+
+static int
+queue( stub_store_t *ctx, void (*done)( int sts, void *aux ), void *aux )
+{
+	stub_store_conf_t *conf = (stub_store_conf_t *)ctx->gen.conf;
+	stub_reply_t *r;
+	long long now;
+	int i;
+
+	/* replies to earlier commands only, as a connection reads them while it sends */
+	deliver( ctx, REPLIES_ROOM );
+	now = get_usec();
+	if (ctx->tail - ctx->head == ctx->size) {
+		r = nfmalloc( 2 * ctx->size * sizeof(*r) );
+		for (i = ctx->head; i != ctx->tail; i++)
+			r[i % (2 * ctx->size)] = ctx->replies[i % ctx->size];
+		free( ctx->replies );
+		ctx->replies = r;
+		ctx->size *= 2;
+	}
+	if (ctx->busy_until < now)
+		ctx->busy_until = now;
+	ctx->busy_until += conf->append_usec;
+	r = &ctx->replies[ctx->tail++ % ctx->size];
+	r->due = ctx->busy_until;
+	r->done = done;
+	r->aux = aux;
+	return DRV_OK;
+}
+
+static int
+stub_append_msg( store_t *gctx, msg_data_t *data, void (*done)( int sts, void *aux ), void *aux )
+{
+	stub_store_t *ctx = (stub_store_t *)gctx;
+
+	record( ctx, data->data, data->len );
+	if (!data->borrowed)
+		free( data->data );
+	return queue( ctx, done, aux );
+}
+
+static int
+stub_append_render( store_t *gctx, const msg_render_t *render, void (*done)( int sts, void *aux ), void *aux )
+{
+	stub_store_t *ctx = (stub_store_t *)gctx;
+	char *data = nfmalloc( render->len + 1 );
+	int n, off;
+
+	/* in pieces, as the IMAP driver does into its send buffer */
+	for (off = 0; off < render->len; off += n)
+		if (!(n = render->write( data + off, off, render->len - off < 4096 ? render->len - off : 4096, render->arg )))
+			break;
+	record( ctx, data, off );
+	free( data );
+	return queue( ctx, done, aux );
+}
+
+static int
+stub_delete_msgid( store_t *gctx, const char *message_id )
+{
+	stub_store_conf_t *conf = (stub_store_conf_t *)gctx->conf;
+	int i, j;
+
+	pthread_mutex_lock( &conf->lock );
+	for (i = j = 0; i < conf->nmsgs; i++)
+		if (!strcmp( conf->msgs[i].box, gctx->name ) && !strcmp( conf->msgs[i].message_id, message_id )) {
+			free( conf->msgs[i].box );
+			free( conf->msgs[i].message_id );
+		} else
+			conf->msgs[j++] = conf->msgs[i];
+	conf->nmsgs = j;
+	pthread_mutex_unlock( &conf->lock );
+	return DRV_OK;
+}
+
+static int
+stub_check( store_t *gctx )
+{
+	deliver( (stub_store_t *)gctx, REPLIES_ALL );
+	return DRV_OK;
+}
+
+static int
+stub_poll( store_t *gctx )
+{
+	deliver( (stub_store_t *)gctx, REPLIES_DUE );
+	return DRV_OK;
+}
+
+driver_t stub_driver = {
+	0, /* parse_store */
+	stub_open_store,
+	stub_close_store,
+	0, /* list */
+	stub_prepare,
+	0, /* select */
+	0, /* fetch_msg */
+	0, /* store_msg */
+	stub_append_msg,
+	stub_append_render,
+	0, /* set_flags */
+	0, /* trash_msg */
+	stub_delete_msgid,
+	stub_check,
+	stub_poll,
+	stub_check, /* noop */
+	0 /* close */
+};
+
+config_t *
+stub_config( int nstores, int connections, int append_usec )
+{
+	config_t *conf = nfcalloc( sizeof(*conf) );
+	stub_store_conf_t *store;
+	store_conf_t **storeapp = &conf->stores;
+	char dir[] = "/tmp/smssync-test-XXXXXX";
+	int i;
+
+	pthread_mutex_init( &conf->state_lock, 0 );
+	if (!mkdtemp( dir )) {
+		perror( "mkdtemp" );
+		exit( 1 );
+	}
+	conf->home = nfstrdup( dir );
+	for (i = 0; i < nstores; i++) {
+		store = nfcalloc( sizeof(*store) );
+		nfasprintf( &store->gen.name, "stub%d", i );
+		store->gen.driver = &stub_driver;
+		store->gen.connections = connections;
+		store->append_usec = append_usec;
+		store->window = 64;
+		pthread_mutex_init( &store->lock, 0 );
+		*storeapp = &store->gen;
+		storeapp = &store->gen.next;
+	}
+	strcpy( conf->stores->prefrence, "stubstubstubstubstubstub" );
+	return conf;
+}
+
+channel_conf_t *
+stub_channel( config_t *conf, const char *name, const char *box )
+{
+	channel_conf_t *channel = nfcalloc( sizeof(*channel) ), **channelapp;
+
+	channel->name = nfstrdup( name );
+	channel->mail_box = nfstrdup( box );
+	for (channelapp = &conf->channels; *channelapp; channelapp = &(*channelapp)->next);
+	*channelapp = channel;
+	return channel;
+}
+
+void
+stub_config_free( config_t *conf )
+{
+	stub_store_conf_t *store;
+	channel_conf_t *channel;
+	sync_state_t *state;
+	char path[_POSIX_PATH_MAX];
+	int i;
+
+	while ((store = (stub_store_conf_t *)conf->stores)) {
+		conf->stores = store->gen.next;
+		for (i = 0; i < store->nmsgs; i++) {
+			free( store->msgs[i].box );
+			free( store->msgs[i].message_id );
+		}
+		free( store->msgs );
+		free( store->gen.name );
+		pthread_mutex_destroy( &store->lock );
+		free( store );
+	}
+	while ((channel = conf->channels)) {
+		conf->channels = channel->next;
+		while ((state = channel->states)) {
+			channel->states = state->next;
+			free( state );
+		}
+		free( channel->name );
+		free( channel->mail_box );
+		free( channel );
+	}
+	nfsnprintf( path, sizeof(path), "%s/." EXE ".state", conf->home );
+	unlink( path );
+	nfsnprintf( path, sizeof(path), "%s/." EXE ".synthetic.state", conf->home );
+	unlink( path );
+	rmdir( conf->home );
+	free( (char *)conf->home );
+	pthread_mutex_destroy( &conf->state_lock );
+	free( conf );
+}
+
+int
+stub_count( stub_store_conf_t *store, const char *box, const char *message_id )
+{
+	int i, n = 0;
+
+	pthread_mutex_lock( &store->lock );
+	for (i = 0; i < store->nmsgs; i++)
+		if (!strcmp( store->msgs[i].box, box ) &&
+		    (!message_id || !strcmp( store->msgs[i].message_id, message_id )))
+			n++;
+	pthread_mutex_unlock( &store->lock );
+	return n;
+}
+
+char *
+stub_message( const char *id, int len, int *outlen )
+{
+	char *data;
+	int n;
+
+	n = nfasprintf( &data, "Subject: test\r\nMessage-ID: <%s>\r\n\r\n", id );
+	if (len > n) {
+		data = nfrealloc( data, len );
+		memset( data + n, 'x', len - n );
+		n = len;
+	}
+	*outlen = n;
+	return data;
+}
@@ -0,0 +1,43 @@
+#ifndef STUB_DRIVER_H
+#define STUB_DRIVER_H
+
+#include "isync.h"
+
+/* A store that lives in memory, for running sync.c without a server.
+ * Each connection answers its APPENDs in order, append_usec apart, as a
+ * server that serializes them per session would; at most window of them
+ * are in flight before the client has to wait for a reply. The mailbox is
+ * shared by all connections of the store; delete_msgid removes from it
+ * at once. */
+
+typedef struct {
+	char *box;
+	char *message_id; /* between the angle brackets, or empty */
+	int len;
+} stub_msg_t;
+
+typedef struct {
+	store_conf_t gen;
+	int append_usec;
+	int window;
+	pthread_mutex_t lock; /* guards what follows */
+	stub_msg_t *msgs;
+	int nmsgs, size;
+	long long appended;
+} stub_store_conf_t;
+
+extern driver_t stub_driver;
+
+/* a config with nstores stub stores of connections each and no channels;
+ * the state file goes to a fresh directory under /tmp */
+config_t *stub_config( int nstores, int connections, int append_usec );
+channel_conf_t *stub_channel( config_t *conf, const char *name, const char *box );
+void stub_config_free( config_t *conf );
+
+/* messages in box, and how many of them carry message_id */
+int stub_count( stub_store_conf_t *store, const char *box, const char *message_id );
+
+/* a message of about len bytes whose Message-ID is <id> */
+char *stub_message( const char *id, int len, int *outlen );
+
+#endif /* STUB_DRIVER_H */
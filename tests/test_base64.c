@@ -0,0 +1,57 @@
+/*
+ * The vector base64_encode_lines() against base64_encode_lines_scalar(),
+ * on random data of random lengths at every alignment of input and output.
+ * Covers whichever kernel the CPU picks at run time.
+ */
+
+#include "base64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 20000
+#define MAXLEN 4096
+#define ALIGN 32
+#define GUARD 16
+
+int
+main( void )
+{
+	static char in[MAXLEN + ALIGN], want[BASE64_LINES_LENGTH(MAXLEN) + 2 * GUARD + ALIGN];
+	static char got[BASE64_LINES_LENGTH(MAXLEN) + 2 * GUARD + ALIGN];
+	size_t len, n, m;
+	int r, i, ia, oa;
+
+	srand( 1 );
+	for (r = 0; r < ROUNDS; r++) {
+		/* mostly short, as SMS bodies are, but across many lines too */
+		len = r % 4 ? rand() % 400 : rand() % (MAXLEN + 1);
+		ia = rand() % ALIGN;
+		oa = rand() % ALIGN;
+		for (i = 0; i < (int)len; i++)
+			in[ia + i] = rand();
+		memset( want, '#', sizeof(want) );
+		memset( got, '#', sizeof(got) );
+		n = base64_encode_lines_scalar( in + ia, len, want + GUARD );
+		m = base64_encode_lines( in + ia, len, got + GUARD + oa );
+		if (n != BASE64_LINES_LENGTH(len) || m != n) {
+			fprintf( stderr, "length %zu: wrote %zu, scalar %zu, expected %zu\n",
+			         len, m, n, (size_t)BASE64_LINES_LENGTH(len) );
+			return 1;
+		}
+		if (memcmp( got + GUARD + oa, want + GUARD, n )) {
+			fprintf( stderr, "length %zu, input offset %d, output offset %d: output differs\n", len, ia, oa );
+			return 1;
+		}
+		for (i = 0; i < GUARD + oa; i++)
+			if (got[i] != '#')
+				break;
+		if (i < GUARD + oa || memcmp( got + GUARD + oa + n, want + GUARD + n, GUARD )) {
+			fprintf( stderr, "length %zu: wrote outside of its output\n", len );
+			return 1;
+		}
+	}
+	printf( "%d random buffers up to %d bytes: ok\n", ROUNDS, MAXLEN );
+	return 0;
+}
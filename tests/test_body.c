@@ -0,0 +1,258 @@
+/*
+ * Differential fuzz test of the body path. Random UTF-16, with surrogate
+ * pairs, lone surrogates, control characters and long lines, goes through
+ * body_from_utf16() and the renderer. The same text also takes the old
+ * route: a plain conversion to UTF-8, as QString::toUtf8() made it, that
+ * the renderer classifies itself. Both have to agree byte for byte, and
+ * the body has to decode back to the UTF-8.
+ */
+
+#define _GNU_SOURCE /* memmem */
+
+#include "isync.h"
+#include "base64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 20000
+#define MAXLEN 3000
+
+/* one code unit at a time; lone surrogates become U+FFFD */
+static size_t
+ref_utf8( const unsigned short *in, size_t len, unsigned char *out )
+{
+	unsigned char *o = out;
+	unsigned c;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		c = in[i];
+		if (c >= 0xd800 && c < 0xdc00 && i + 1 < len && in[i + 1] >= 0xdc00 && in[i + 1] < 0xe000)
+			c = 0x10000 + ((c - 0xd800) << 10) + (in[++i] - 0xdc00);
+		else if (c >= 0xd800 && c < 0xe000)
+			c = 0xfffd;
+		if (c < 0x80) {
+			*o++ = c;
+		} else if (c < 0x800) {
+			*o++ = 0xc0 | c >> 6;
+			*o++ = 0x80 | (c & 0x3f);
+		} else if (c < 0x10000) {
+			*o++ = 0xe0 | c >> 12;
+			*o++ = 0x80 | ((c >> 6) & 0x3f);
+			*o++ = 0x80 | (c & 0x3f);
+		} else {
+			*o++ = 0xf0 | c >> 18;
+			*o++ = 0x80 | ((c >> 12) & 0x3f);
+			*o++ = 0x80 | ((c >> 6) & 0x3f);
+			*o++ = 0x80 | (c & 0x3f);
+		}
+	}
+	return o - out;
+}
+
+/* what base64.h says body_class_t counts */
+static void
+ref_class( const unsigned char *p, size_t len, body_class_t *bc )
+{
+	size_t i, col = 0;
+
+	memset( bc, 0, sizeof(*bc) );
+	for (i = 0; i < len; i++) {
+		if (p[i] == '\n') {
+			if (col > bc->longest)
+				bc->longest = col;
+			col = 0;
+			bc->newlines++;
+			continue;
+		}
+		col++;
+		if (p[i] >= 0x7f)
+			bc->eightbit++, bc->escapes++;
+		else if (p[i] < 0x20 && p[i] != '\t')
+			bc->ctrl = 1, bc->escapes++;
+		else if (p[i] == '=')
+			bc->escapes++;
+	}
+	if (col > bc->longest)
+		bc->longest = col;
+}
+
+static int
+unhex( int c )
+{
+	return c <= '9' ? c - '0' : c - 'A' + 10;
+}
+
+static int
+unbase64( int c )
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' : c >= 'a' && c <= 'z' ? c - 'a' + 26 :
+	       c >= '0' && c <= '9' ? c - '0' + 52 : c == '+' ? 62 : 63;
+}
+
+/* the body of a rendered message, decoded, with CRLF back to LF */
+static int
+decode_body( const char *msg, int len, char *out, const char **cte )
+{
+	static const char hdr[] = "Content-Transfer-Encoding: ";
+	const char *p, *end = msg + len;
+	char *o = out;
+	unsigned acc = 0;
+	int bits = 0;
+
+	if (!(p = memmem( msg, len, hdr, sizeof(hdr) - 1 )))
+		return -1;
+	*cte = p += sizeof(hdr) - 1;
+	if (!(p = memmem( p, end - p, "\r\n\r\n", 4 )))
+		return -1;
+	p += 4;
+	if (!strncmp( *cte, "base64", 6 )) {
+		for (; p < end; p++)
+			if (*p != '\r' && *p != '\n' && *p != '=') {
+				acc = acc << 6 | unbase64( *p );
+				if ((bits += 6) >= 8)
+					*o++ = acc >> (bits -= 8);
+			}
+		return o - out;
+	}
+	for (; p < end; p++) {
+		if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+			*o++ = '\n';
+			p++;
+		} else if (**cte == 'q' && *p == '=') {
+			if (p[1] == '\r')
+				p += 2; /* soft line break */
+			else {
+				*o++ = unhex( p[1] ) << 4 | unhex( p[2] );
+				p += 2;
+			}
+		} else
+			*o++ = *p;
+	}
+	return o - out;
+}
+
+static size_t
+gen( unsigned short *in )
+{
+	size_t n = 0, len = rand() % (rand() % 8 ? 400 : MAXLEN);
+	int k, lines = rand() % 4; /* none makes one long line */
+
+	while (n < len) {
+		switch ((k = rand() % 100) < 40 ? 0 : k < 50 ? 1 : k / 10 - 3) {
+		case 0: /* a run of ASCII, long enough for the vector path */
+			for (k = rand() % 40; k-- && n < len; )
+				in[n++] = 0x20 + rand() % 95;
+			break;
+		case 1:
+			in[n++] = lines ? '\n' : 'x';
+			break;
+		case 2:
+			in[n++] = "=\t\r\x01\x7f"[rand() % 5];
+			break;
+		case 3:
+			in[n++] = 0x80 + rand() % 0x780;
+			break;
+		case 4:
+			in[n++] = 0x800 + rand() % 0xd000; /* below the surrogates */
+			break;
+		case 5:
+			in[n++] = 0xe000 + rand() % 0x2000;
+			break;
+		default:
+			k = rand() % 4;
+			if (k < 2) { /* a pair */
+				in[n++] = 0xd800 + rand() % 0x400;
+				if (n < len)
+					in[n++] = 0xdc00 + rand() % 0x400;
+			} else /* a lone half */
+				in[n++] = (k == 2 ? 0xd800 : 0xdc00) + rand() % 0x400;
+			break;
+		}
+	}
+	return len;
+}
+
+static int
+render( const msg_tmpl_t *tmpl, const char *body, size_t len, const body_class_t *bc, char *out )
+{
+	msg_fields_t fields;
+	msg_render_t r;
+	int n;
+
+	memset( &fields, 0, sizeof(fields) );
+	fields.peer = "Someone <someone@unknown.email>";
+	fields.peer_len = strlen( fields.peer );
+	fields.subject = "Someone";
+	fields.subject_len = 7;
+	fields.date = "Mon, 3 Feb 2014 10:00:00 +0200";
+	fields.message_id = "1@test";
+	fields.references = "thread@test";
+	fields.id = "1";
+	fields.address = "+358401234567";
+	fields.body = body;
+	fields.body_len = len;
+	fields.body_class = bc;
+	msg_tmpl_prepare( tmpl, &fields, &r );
+	n = r.write( out, 0, r.len, r.arg );
+	msg_tmpl_release( &fields );
+	return n == r.len ? n : -1;
+}
+
+int
+main( void )
+{
+	static unsigned short in[MAXLEN];
+	static unsigned char want[3 * MAXLEN];
+	static char got[3 * MAXLEN + 16], dec[3 * MAXLEN + 16];
+	static char msg_new[16 * MAXLEN], msg_old[16 * MAXLEN];
+	int counts[3] = { 0, 0, 0 };
+	body_class_t bc, ref;
+	const char *cte = "?";
+	size_t len, n, m;
+	msg_tmpl_t tmpl;
+	int r, a, b, d;
+
+	msg_tmpl_compile( &tmpl, "SMS", "me", "me@example.com", "Mon, 3 Feb 2014 10:00:00 +0200", 0 );
+	srand( 1 );
+	for (r = 0; r < ROUNDS; r++) {
+		len = gen( in );
+		n = ref_utf8( in, len, want );
+		m = body_from_utf16( in, len, got, &bc );
+		if (m != n || memcmp( got, want, n )) {
+			fprintf( stderr, "round %d: %zu code units convert to %zu bytes, expected %zu\n", r, len, m, n );
+			return 1;
+		}
+		ref_class( want, n, &ref );
+		if (bc.eightbit != ref.eightbit || bc.escapes != ref.escapes || bc.newlines != ref.newlines ||
+		    bc.longest != ref.longest || bc.ctrl != ref.ctrl) {
+			fprintf( stderr, "round %d: classified as %zu/%zu/%zu/%zu/%d, expected %zu/%zu/%zu/%zu/%d\n", r,
+			         bc.eightbit, bc.escapes, bc.newlines, bc.longest, bc.ctrl,
+			         ref.eightbit, ref.escapes, ref.newlines, ref.longest, ref.ctrl );
+			return 1;
+		}
+		a = render( &tmpl, got, m, &bc, msg_new );
+		b = render( &tmpl, (const char *)want, n, 0, msg_old );
+		if (a < 0 || a != b || memcmp( msg_new, msg_old, a )) {
+			fprintf( stderr, "round %d: the messages differ\n", r );
+			return 1;
+		}
+		d = decode_body( msg_new, a, dec, &cte );
+		/* 7bit and quoted-printable end the last line */
+		if (d == (int)n + 1 && n && want[n - 1] != '\n' && dec[n] == '\n')
+			d--;
+		else if (d == 1 && !n && *cte != 'b')
+			d--;
+		if (d != (int)n || memcmp( dec, want, n )) {
+			fprintf( stderr, "round %d: the %.4s body decodes to %d bytes, expected %zu\n", r, cte, d, n );
+			return 1;
+		}
+		counts[*cte == '7' ? 0 : *cte == 'q' ? 1 : 2]++;
+	}
+	msg_tmpl_free( &tmpl );
+	printf( "%d bodies, %d 7bit, %d quoted-printable, %d base64: ok\n",
+	        ROUNDS, counts[0], counts[1], counts[2] );
+	return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * date_fmt_rfc5322() and date_fmt_stamp() against localtime_r() and
+ * strftime(), in zones with DST, half-hour and 45-minute offsets, over
+ * a backlog in order and over random times from 1902 to 2038.
+ */
+
+#define _GNU_SOURCE /* %-d */
+
+#include "isync.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *const zones[] = {
+	"UTC", "Europe/Helsinki", "America/New_York", "America/St_Johns",
+	"Australia/Lord_Howe", "Pacific/Chatham", "Asia/Kathmandu",
+};
+
+static int
+check( date_fmt_t *fmt, time_t t, int msec, const char *zone )
+{
+	char want[64], got[RFC5322_DATE_LENGTH];
+	struct tm tm;
+	int n;
+
+	localtime_r( &t, &tm );
+	strftime( want, sizeof(want), "%a, %-d %b %Y %H:%M:%S %z", &tm );
+	n = date_fmt_rfc5322( fmt, t, got );
+	if (n != (int)strlen( want ) || memcmp( got, want, n )) {
+		fprintf( stderr, "%s, %lld: \"%.*s\", expected \"%s\"\n", zone, (long long)t, n, got, want );
+		return 0;
+	}
+	n = strftime( want, sizeof(want), "%Y-%m-%d-%H:%M:%S:", &tm );
+	sprintf( want + n, "%03d", msec );
+	n = date_fmt_stamp( fmt, t, msec, got );
+	if (n != (int)strlen( want ) || memcmp( got, want, n )) {
+		fprintf( stderr, "%s, %lld: stamp \"%.*s\", expected \"%s\"\n", zone, (long long)t, n, got, want );
+		return 0;
+	}
+	return 1;
+}
+
+int
+main( void )
+{
+	date_fmt_t fmt;
+	time_t t;
+	int z, i, n = 0, ok = 1;
+
+	srand( 1 );
+	for (z = 0; z < (int)(sizeof(zones) / sizeof(zones[0])) && ok; z++) {
+		setenv( "TZ", zones[z], 1 );
+		tzset();
+		date_fmt_init( &fmt );
+		/* a backlog, in order: a few minutes to a few hours apart */
+		for (t = 1104537600 /* 2005 */; t < 1577836800 /* 2020 */ && ok; t += rand() % 21600, n++)
+			ok = check( &fmt, t, rand() % 1000, zones[z] );
+		/* and anywhere, so the caches get no help */
+		for (i = 0; i < 20000 && ok; i++, n++)
+			ok = check( &fmt, -2145916800LL /* 1902 */ + ((long long)rand() << 1 | (rand() & 1)),
+			            rand() % 1000, zones[z] );
+	}
+	if (ok)
+		printf( "%d times in %d zones: ok\n", n, (int)(sizeof(zones) / sizeof(zones[0])) );
+	return !ok;
+}
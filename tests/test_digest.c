@@ -0,0 +1,112 @@
+/*
+ * A day's digest is sent again, under the same Message-ID, as long as the
+ * day is open and once more when it closes. Each time it has to replace
+ * the copy the store has, and leave everything else in the mailbox be.
+ */
+
+#include "stub_driver.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int
+write_buf( char *out, int off, int room, void *arg )
+{
+	msg_buf_t *buf = arg;
+
+	if (room > buf->len - off)
+		room = buf->len - off;
+	memcpy( out, buf->data + off, room );
+	return room;
+}
+
+/* one pass over the channel, as main.cpp makes it for a digest of len
+ * bytes whose last event is stamped stamp; commit is where the watermark
+ * may go, which is the old one while the day is open */
+static int
+pass( config_t *conf, channel_conf_t *channel, const char *id, int len,
+      const char *stamp, const char *commit )
+{
+	sync_session_t *session = sms_imap_init( conf, 1 );
+	msg_render_t render;
+	msg_buf_t buf;
+	int failed;
+
+	sms_imap_begin_channel( session, channel );
+	buf.data = stub_message( id, len, &buf.len );
+	render.len = buf.len;
+	render.write = write_buf;
+	render.arg = &buf;
+	failed = sms_imap_sync_replace( session, &render, id, stamp, commit ? commit : "" );
+	sms_imap_checkpoint( session, 1 );
+	sms_imap_close( session );
+	free( buf.data );
+	return failed;
+}
+
+static int
+expect( config_t *conf, const char *box, const char *id, int copies, int len, const char *what )
+{
+	stub_store_conf_t *store;
+	int i, n, ok = 1;
+
+	for (store = (stub_store_conf_t *)conf->stores; store; store = (stub_store_conf_t *)store->gen.next) {
+		if ((n = stub_count( store, box, id )) != copies) {
+			fprintf( stderr, "%s: %s has %d copies of <%s>, expected %d\n", what, store->gen.name, n, id, copies );
+			ok = 0;
+			continue;
+		}
+		for (i = 0; i < store->nmsgs; i++)
+			if (!strcmp( store->msgs[i].message_id, id ) && store->msgs[i].len != len) {
+				fprintf( stderr, "%s: %s has the %d byte version of <%s>, expected %d\n",
+				         what, store->gen.name, store->msgs[i].len, id, len );
+				ok = 0;
+			}
+	}
+	return ok;
+}
+
+int
+main( void )
+{
+	static const char day1[] = "digest-2014-02-03-+358401234567-3@n9-sms-backup.local";
+	static const char other[] = "digest-2014-02-03-+358401234567-1@n9-sms-backup.local";
+	config_t *conf = stub_config( 2, 2, 0 );
+	channel_conf_t *sms = stub_channel( conf, "sms", "SMS" );
+	channel_conf_t *calls = stub_channel( conf, "calls", "SMS" );
+	sync_state_t *state;
+	int ok = 1;
+
+	Quiet = 2;
+	/* another channel's digest of the same contact and day, in the same mailbox */
+	ok &= !pass( conf, calls, other, 300, "2014-02-03-09:00:00:000", 0 );
+
+	/* the day is open: twice the same digest, the second time longer */
+	ok &= !pass( conf, sms, day1, 500, "2014-02-03-10:00:00:000", 0 );
+	ok &= expect( conf, "SMS", day1, 1, 500, "first pass" );
+	ok &= !pass( conf, sms, day1, 700, "2014-02-03-11:00:00:000", 0 );
+	ok &= expect( conf, "SMS", day1, 1, 700, "second pass, same day" );
+	for (state = sms->states; state; state = state->next)
+		if (*state->sync_time) {
+			fprintf( stderr, "the watermark passed the open day: %s\n", state->sync_time );
+			ok = 0;
+		}
+
+	/* the day is over: the digest goes once more and the watermark moves past it */
+	ok &= !pass( conf, sms, day1, 900, "2014-02-03-23:00:00:000", "2014-02-03-23:00:00:000" );
+	ok &= expect( conf, "SMS", day1, 1, 900, "day closed" );
+	for (state = sms->states; state; state = state->next)
+		if (strcmp( state->sync_time, "2014-02-03-23:00:00:000" )) {
+			fprintf( stderr, "watermark %s after the day closed\n", state->sync_time );
+			ok = 0;
+		}
+	/* and is not sent again after that */
+	ok &= !pass( conf, sms, day1, 1100, "2014-02-03-23:00:00:000", "2014-02-03-23:00:00:000" );
+	ok &= expect( conf, "SMS", day1, 1, 900, "after the day" );
+
+	ok &= expect( conf, "SMS", other, 1, 300, "other channel" );
+	stub_config_free( conf );
+	if (ok)
+		printf( "digests replaced: ok\n" );
+	return !ok;
+}
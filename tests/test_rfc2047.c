@@ -0,0 +1,125 @@
+#define _GNU_SOURCE /* memmem */
+
+/*
+ * rfc2047_encode() at every starting column: no line may pass 76
+ * characters, and the value has to decode back to what went in.
+ */
+
+#include "base64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const values[] = {
+	"a@b",
+	"Smith, John",
+	"Matti Meik\xc3\xa4l\xc3\xa4inen",
+	"\xf0\x9f\x98\x80",
+	"\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe5\x90\x8d\xe5\x89\x8d\xe3\x81\xa7\xe3\x81\x99",
+	"Plain ASCII that goes on for a while, long enough that it has to be folded more than once or twice",
+	"Someone with an \xc3\xa4 in a name that is long enough to need several encoded words, "
+		"\xf0\x9f\x98\x80\xf0\x9f\x98\x80\xf0\x9f\x98\x80 and some more text after the emoji",
+	"\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac"
+		"\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac"
+		"\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac",
+};
+
+static int
+unhex( int c )
+{
+	return c <= '9' ? c - '0' : c - 'A' + 10;
+}
+
+static int
+unbase64( int c )
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' : c >= 'a' && c <= 'z' ? c - 'a' + 26 :
+	       c >= '0' && c <= '9' ? c - '0' + 52 : c == '+' ? 62 : 63;
+}
+
+/* undo the folding and the encoding; returns the length, or -1 if the
+ * encoded words are malformed */
+static int
+decode( const char *in, int len, char *out )
+{
+	const char *end = in + len, *text, *stop;
+	char *start = out;
+	unsigned acc;
+	int bits;
+
+	if (len < 8 || !memmem( in, len, "=?UTF-8?", 8 )) {
+		/* raw: a fold that starts the value on a line of its own added a space */
+		if (len >= 3 && !memcmp( in, "\r\n ", 3 ))
+			in += 3;
+		for (; in < end; in++)
+			if (*in != '\r' && *in != '\n')
+				*out++ = *in;
+		return out - start;
+	}
+	while (in < end) {
+		/* white space between encoded words goes away */
+		if (*in == '\r' || *in == '\n' || *in == ' ') {
+			in++;
+			continue;
+		}
+		if (end - in < 12 || memcmp( in, "=?UTF-8?", 8 ) || in[9] != '?')
+			return -1;
+		text = in + 10;
+		if (!(stop = memmem( text, end - text, "?=", 2 )))
+			return -1;
+		if (in[8] == 'Q') {
+			for (; text < stop; text++)
+				if (*text == '=') {
+					*out++ = unhex( text[1] ) << 4 | unhex( text[2] );
+					text += 2;
+				} else
+					*out++ = *text == '_' ? ' ' : *text;
+		} else {
+			for (acc = 0, bits = 0; text < stop && *text != '='; text++) {
+				acc = acc << 6 | unbase64( *text );
+				if ((bits += 6) >= 8)
+					*out++ = acc >> (bits -= 8);
+			}
+		}
+		in = stop + 2;
+	}
+	return out - start;
+}
+
+int
+main( void )
+{
+	char out[4096], dec[4096];
+	const char *line, *nl, *end;
+	int v, col, flags, len, n, width, failed = 0;
+
+	for (v = 0; v < (int)(sizeof(values) / sizeof(values[0])); v++)
+		for (flags = 0; flags <= RFC2047_PHRASE; flags += RFC2047_PHRASE)
+			for (col = 0; col < 76; col++) {
+				len = strlen( values[v] );
+				n = rfc2047_encode( values[v], len, col, flags, out );
+				if (n > (int)RFC2047_LENGTH(len)) {
+					fprintf( stderr, "value %d at column %d: %d bytes, more than RFC2047_LENGTH\n", v, col, n );
+					failed = 1;
+				}
+				for (line = out, end = out + n, width = col; line < end; line = nl + 2, width = 0) {
+					if (!(nl = memmem( line, end - line, "\r\n", 2 )))
+						nl = end;
+					if (width + nl - line > 76) {
+						fprintf( stderr, "value %d, flags %d at column %d: a line of %d characters: %.*s\n",
+						         v, flags, col, (int)(width + nl - line), n, out );
+						failed = 1;
+						break;
+					}
+				}
+				if ((n = decode( out, n, dec )) != len || memcmp( dec, values[v], len )) {
+					fprintf( stderr, "value %d, flags %d at column %d: decodes to %.*s\n",
+					         v, flags, col, n < 0 ? 0 : n, dec );
+					failed = 1;
+				}
+			}
+	if (!failed)
+		printf( "%d values at columns 0 to 75: ok\n", (int)(sizeof(values) / sizeof(values[0])) );
+	return failed;
+}
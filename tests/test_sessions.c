@@ -0,0 +1,210 @@
+/*
+ * Stress test of the concurrent upload path, meant to run under
+ * ThreadSanitizer. Sessions upload their channels side by side over one
+ * config, each rendering on its own pool fed by a producer thread, and
+ * each checkpointing into the shared state file as it goes. Afterwards
+ * every store has to have every message, and every watermark has to be
+ * at the last one.
+ */
+
+#include "stub_driver.h"
+#include "base64.h"
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SESSIONS 4
+#define CHANNELS 3      /* per session */
+#define EVENTS 600      /* per channel */
+#define STORES 2
+#define CONNECTIONS 6   /* per store, shared out between the sessions */
+
+typedef struct {
+	char id[16], message_id[48], stamp[25];
+	char body[200];
+} event_t;
+
+typedef struct {
+	msg_tmpl_t *tmpl;
+	event_t *events;
+	render_pool_t *pool;
+} channel_run_t;
+
+static const char peer[] = "Someone <someone@unknown.email>";
+
+static void
+fill_fields( const event_t *ev, msg_fields_t *fields )
+{
+	memset( fields, 0, sizeof(*fields) );
+	fields->peer = peer;
+	fields->peer_len = sizeof(peer) - 1;
+	fields->subject = "Someone";
+	fields->subject_len = 7;
+	fields->inbound = ev->id[0] & 1;
+	fields->date = "Mon, 3 Feb 2014 10:00:00 +0200";
+	fields->message_id = ev->message_id;
+	fields->references = "thread@n9-sms-backup-local";
+	fields->id = ev->id;
+	fields->address = "+358401234567";
+	fields->body = ev->body;
+	fields->body_len = strlen( ev->body );
+}
+
+/* on a pool thread */
+static int
+render( void *arg, int i, msg_buf_t *out )
+{
+	channel_run_t *run = arg;
+	msg_fields_t fields;
+	msg_render_t r;
+
+	fill_fields( &run->events[i], &fields );
+	msg_tmpl_prepare( run->tmpl, &fields, &r );
+	out->len = r.write( msg_buf_reserve( out, r.len ), 0, r.len, r.arg );
+	msg_tmpl_release( &fields );
+	return 0;
+}
+
+/* collects the events and publishes them a few at a time */
+static void *
+produce( void *arg )
+{
+	channel_run_t *run = arg;
+	static const char *words[] = { "abc", "xyz", "\xc3\xa4t\xc3\xa4", "\n", "\xe2\x82\xac" };
+	event_t *ev;
+	int i, j, n;
+
+	for (i = 0; i < EVENTS; i++) {
+		ev = &run->events[i];
+		sprintf( ev->id, "%d", i );
+		sprintf( ev->stamp, "2014-01-01-%012d", i );
+		sprintf( ev->message_id, "%p-%d@test", (void *)run, i );
+		for (j = n = 0; n + 8 < (int)sizeof(ev->body); j++)
+			n += sprintf( ev->body + n, "%s ", words[(i + j) % 5] );
+		if (i % 16 == 15 && render_pool_publish( run->pool, i + 1, 0 ))
+			return 0;
+	}
+	render_pool_publish( run->pool, EVENTS, 1 );
+	return 0;
+}
+
+typedef struct {
+	config_t *conf;
+	channel_conf_t *channels[CHANNELS];
+	pthread_t thread;
+	int failed;
+} session_run_t;
+
+static void *
+upload( void *arg )
+{
+	session_run_t *srun = arg;
+	sync_session_t *session;
+	channel_run_t run;
+	pthread_t producer;
+	msg_tmpl_t tmpl;
+	msg_buf_t buf;
+	int c, i, ret;
+
+	if (!(session = sms_imap_init( srun->conf, SESSIONS ))) {
+		srun->failed = 1;
+		return 0;
+	}
+	msg_tmpl_compile( &tmpl, "SMS", "me", "me@example.com", "Mon, 3 Feb 2014 10:00:00 +0200", 0 );
+	for (c = 0; c < CHANNELS; c++) {
+		sms_imap_refresh( session, 1 );
+		sms_imap_begin_channel( session, srun->channels[c] );
+		run.tmpl = &tmpl;
+		run.events = nfcalloc( EVENTS * sizeof(*run.events) );
+		/* from no workers, where the sender renders it all, to two */
+		run.pool = render_pool_start( c % 3, EVENTS, 8, 64 << 10, render, &run );
+		pthread_create( &producer, 0, produce, &run );
+		for (i = 0; (ret = render_pool_take( run.pool, i, &buf )) <= 0; i++) {
+			if (ret < 0) {
+				msg_buf_init( &buf );
+				render( &run, i, &buf );
+			}
+			if (sms_imap_sync_buffer( session, buf.data, buf.len, run.events[i].stamp, 0 )) {
+				srun->failed = 1;
+				render_pool_cancel( run.pool );
+				break;
+			}
+			if (i % 10 == 9)
+				sms_imap_checkpoint( session, 0 );
+		}
+		sms_imap_checkpoint( session, 1 );
+		pthread_join( producer, 0 );
+		render_pool_stop( run.pool, 0 );
+		free( run.events );
+	}
+	msg_tmpl_free( &tmpl );
+	sms_imap_close( session );
+	return 0;
+}
+
+int
+main( void )
+{
+	config_t *conf = stub_config( STORES, CONNECTIONS, 20 );
+	session_run_t sessions[SESSIONS];
+	store_conf_t *store;
+	sync_state_t *state;
+	char name[16], last[25];
+	int s, c, failed = 0;
+
+	Quiet = 2;
+	for (s = 0; s < SESSIONS; s++) {
+		sessions[s].conf = conf;
+		sessions[s].failed = 0;
+		for (c = 0; c < CHANNELS; c++) {
+			sprintf( name, "s%dc%d", s, c );
+			sessions[s].channels[c] = stub_channel( conf, name, name );
+		}
+	}
+	for (s = 0; s < SESSIONS; s++)
+		pthread_create( &sessions[s].thread, 0, upload, &sessions[s] );
+	for (s = 0; s < SESSIONS; s++)
+		pthread_join( sessions[s].thread, 0 );
+
+	sprintf( last, "2014-01-01-%012d", EVENTS - 1 );
+	for (s = 0; s < SESSIONS; s++) {
+		if (sessions[s].failed) {
+			fprintf( stderr, "session %d failed\n", s );
+			failed = 1;
+		}
+		for (c = 0; c < CHANNELS; c++) {
+			channel_conf_t *channel = sessions[s].channels[c];
+			for (store = conf->stores; store; store = store->next)
+				if (stub_count( (stub_store_conf_t *)store, channel->mail_box, 0 ) != EVENTS) {
+					fprintf( stderr, "%s on %s: %d of %d messages\n", channel->name, store->name,
+					         stub_count( (stub_store_conf_t *)store, channel->mail_box, 0 ), EVENTS );
+					failed = 1;
+				}
+			for (state = channel->states; state; state = state->next)
+				if (strcmp( state->sync_time, last )) {
+					fprintf( stderr, "%s on %s: watermark %s, expected %s\n",
+					         channel->name, state->store->name, state->sync_time, last );
+					failed = 1;
+				}
+		}
+	}
+	/* and the state file has to read back the same */
+	for (s = 0; s < SESSIONS; s++)
+		for (c = 0; c < CHANNELS; c++)
+			for (state = sessions[s].channels[c]->states; state; state = state->next)
+				*state->sync_time = 0;
+	if (load_state_config( conf, 0, 1 ))
+		failed = 1;
+	for (s = 0; s < SESSIONS; s++)
+		for (c = 0; c < CHANNELS; c++)
+			for (state = sessions[s].channels[c]->states; state; state = state->next)
+				if (strcmp( state->sync_time, last )) {
+					fprintf( stderr, "%s: saved watermark %s\n", sessions[s].channels[c]->name, state->sync_time );
+					failed = 1;
+				}
+	stub_config_free( conf );
+	if (!failed)
+		printf( "%d sessions, %d channels, %d events each: ok\n", SESSIONS, SESSIONS * CHANNELS, EVENTS );
+	return failed;
+}
@@ -0,0 +1,231 @@
+/*
+ * SyncSqliteSource against tests/tracker_fixture.sql: the events of one
+ * account in end time order across pages, the sync times, and falling
+ * back on an unknown account, schema version or event type.
+ *
+ *   test_sqlite [fixture.sql]
+ */
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+#include <stdio.h>
+#include <sqlite3.h>
+
+#include "syncsqlitesource.h"
+
+static QString dbPath;
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/* a fresh database from the fixture, then sql on top of it */
+static bool makeDatabase(const QByteArray &fixture, const char *sql = 0)
+{
+    sqlite3 *db;
+    char *err = 0;
+    bool ok;
+
+    QFile::remove(dbPath);
+    QFile::remove(QFileInfo(dbPath).dir().filePath(QLatin1String("db-version.txt")));
+    if (sqlite3_open(dbPath.toUtf8().constData(), &db) != SQLITE_OK)
+        return false;
+    ok = sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, &err) == SQLITE_OK &&
+         sqlite3_exec(db, fixture.constData(), 0, 0, &err) == SQLITE_OK &&
+         (!sql || sqlite3_exec(db, sql, 0, 0, &err) == SQLITE_OK);
+    if (!ok)
+        fprintf(stderr, "fixture: %s\n", err);
+    sqlite3_free(err);
+    sqlite3_close(db);
+    return ok;
+}
+
+static QVector<int> fetchAll(SyncSqliteSource &source, SyncEventBatch &sms, SyncEventBatch &calls, int *pages)
+{
+    QHash<int, SyncEventBatch *> batches;
+    SyncEventBatch allSms, allCalls;
+    QVector<int> ids;
+
+    batches.insert(Event::SMSEvent, &sms);
+    batches.insert(Event::CallEvent, &calls);
+    *pages = 0;
+    while (source.takePage(batches)) {
+        ++*pages;
+        for (int i = 0; i < sms.size(); i++) {
+            ids << sms.ids.at(i);
+            allSms.ids << sms.ids.at(i);
+            allSms.startTimes << sms.startTimes.at(i);
+            allSms.endTimes << sms.endTimes.at(i);
+            allSms.directions << sms.directions.at(i);
+            allSms.flags << sms.flags.at(i);
+            allSms.groupIds << sms.groupIds.at(i);
+            allSms.remoteUids << sms.remoteUids.at(sms.remotes.at(i));
+            allSms.remotes << allSms.remotes.size();
+            allSms.freeTexts << allSms.addText(sms.string(sms.freeTexts.at(i)));
+            allSms.tokens << allSms.addText(sms.string(sms.tokens.at(i)));
+        }
+        for (int i = 0; i < calls.size(); i++) {
+            ids << calls.ids.at(i);
+            allCalls.ids << calls.ids.at(i);
+            allCalls.flags << calls.flags.at(i);
+            allCalls.remoteUids << calls.remoteUids.at(calls.remotes.at(i));
+            allCalls.remotes << allCalls.remotes.size();
+        }
+    }
+    sms = allSms;
+    calls = allCalls;
+    return ids;
+}
+
+static void testEvents(const QByteArray &fixture)
+{
+    SyncSqliteSource source(dbPath, QLatin1String("ring/tel/ring"));
+    SyncEventBatch sms, calls;
+    int pages;
+
+    CHECK(makeDatabase(fixture));
+    source.addSyncType(Event::SMSEvent, QDateTime());
+    source.addSyncType(Event::CallEvent, QDateTime());
+    source.setPageSize(2);
+    CHECK(source.start());
+    QVector<int> ids = fetchAll(source, sms, calls, &pages);
+
+    /* 2 and 3 end in the same second, in id order; they fill the second
+       page and the keyset has to carry on after both */
+    CHECK(ids == (QVector<int>() << 7 << 1 << 2 << 3 << 4 << 5));
+    CHECK(pages == 3);
+    CHECK(!source.hasFailed());
+
+    CHECK(sms.size() == 4);
+    if (sms.size() == 4) {
+        CHECK(sms.startTimes.at(1) == 1391421600000LL);
+        CHECK(sms.endTimes.at(1) == 1391421601000LL);
+        CHECK(sms.directions.at(1) == Event::Inbound);
+        CHECK(sms.directions.at(2) == Event::Outbound);
+        CHECK(sms.remoteUids.at(sms.remotes.at(1)) == QLatin1String("+358401111111"));
+        CHECK(sms.remoteUids.at(sms.remotes.at(2)) == QLatin1String("+358401111111"));
+        CHECK(sms.remoteUids.at(sms.remotes.at(3)) == QLatin1String("+358402222222"));
+        CHECK(sms.groupIds.at(1) == 1);
+        CHECK(sms.groupIds.at(3) == 2);
+        CHECK(sms.string(sms.freeTexts.at(1)) == QLatin1String("Hei, tuletko huomenna?"));
+        CHECK(sms.string(sms.freeTexts.at(2)) ==
+              QString::fromUtf8("Joo, kello 10 \xe2\x82\xac \xf0\x9f\x98\x80"));
+        CHECK(sms.string(sms.tokens.at(3)) == QLatin1String("token-3"));
+    }
+    CHECK(calls.size() == 2);
+    if (calls.size() == 2) {
+        CHECK(calls.flags.at(0) == SyncEventBatch::MissedCall);
+        CHECK(calls.flags.at(1) == 0);
+    }
+}
+
+static void testSince(const QByteArray &fixture)
+{
+    SyncSqliteSource source(dbPath, QLatin1String("ring/tel/ring"));
+    SyncEventBatch sms, calls;
+    int pages;
+
+    CHECK(makeDatabase(fixture));
+    source.addSyncType(Event::SMSEvent, QDateTime::fromTime_t(1391421601));
+    source.addSyncType(Event::CallEvent, QDateTime::fromTime_t(1391425230));
+    CHECK(source.start());
+    CHECK(fetchAll(source, sms, calls, &pages) == (QVector<int>() << 2 << 3 << 5));
+    CHECK(pages == 1);
+}
+
+static void testOtherAccount(const QByteArray &fixture)
+{
+    SyncSqliteSource source(dbPath, QLatin1String("gabble/jabber/me"));
+    QHash<int, SyncEventBatch *> batches;
+    SyncEventBatch im;
+
+    CHECK(makeDatabase(fixture));
+    batches.insert(Event::IMEvent, &im);
+    source.addSyncType(Event::IMEvent, QDateTime());
+    CHECK(source.start());
+    CHECK(source.takePage(batches));
+    CHECK(im.ids == QVector<int>() << 6);
+    CHECK(im.size() == 1 && im.remoteUids.at(im.remotes.at(0)) == QLatin1String("friend@example.com"));
+    CHECK(!source.takePage(batches));
+}
+
+/* each of these has to leave it to the SPARQL path */
+static void testFallback(const QByteArray &fixture)
+{
+    {
+        SyncSqliteSource source(dbPath, QLatin1String("ring/tel/rong"));
+        CHECK(makeDatabase(fixture));
+        source.addSyncType(Event::SMSEvent, QDateTime());
+        CHECK(!source.start());
+    }
+    {
+        SyncSqliteSource source(dbPath, QLatin1String("ring/tel/ring"));
+        CHECK(makeDatabase(fixture, "PRAGMA user_version = 24"));
+        source.addSyncType(Event::SMSEvent, QDateTime());
+        CHECK(!source.start());
+    }
+    {
+        SyncSqliteSource source(dbPath, QLatin1String("ring/tel/ring"));
+        CHECK(makeDatabase(fixture, "ALTER TABLE \"nmo:Message\" RENAME TO \"nmo:Message2\""));
+        source.addSyncType(Event::SMSEvent, QDateTime());
+        CHECK(!source.start());
+    }
+    {
+        SyncSqliteSource source(dbPath, QLatin1String("ring/tel/ring"));
+        CHECK(makeDatabase(fixture));
+        source.addSyncType(Event::SMSEvent, QDateTime());
+        source.addSyncType(Event::MMSEvent, QDateTime());
+        CHECK(!source.start());
+    }
+    /* an older tracker, with the version in a file beside the database */
+    {
+        SyncSqliteSource source(dbPath, QLatin1String("ring/tel/ring"));
+        CHECK(makeDatabase(fixture, "PRAGMA user_version = 0"));
+        source.addSyncType(Event::SMSEvent, QDateTime());
+        CHECK(!source.start());
+    }
+    {
+        SyncSqliteSource source(dbPath, QLatin1String("ring/tel/ring"));
+        CHECK(makeDatabase(fixture, "PRAGMA user_version = 0"));
+        QFile version(QFileInfo(dbPath).dir().filePath(QLatin1String("db-version.txt")));
+        CHECK(version.open(QIODevice::WriteOnly) && version.write("25\n") == 3);
+        version.close();
+        source.addSyncType(Event::SMSEvent, QDateTime());
+        CHECK(source.start());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments();
+    QFile file(args.size() > 1 ? args.at(1) : QString::fromLatin1("../tracker_fixture.sql"));
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        fprintf(stderr, "cannot read %s\n", qPrintable(file.fileName()));
+        return 2;
+    }
+    QByteArray fixture = file.readAll();
+    QDir dir = QDir::temp();
+    QString name = QString::fromLatin1("smssync-test-%1").arg(QCoreApplication::applicationPid());
+    if (!dir.mkpath(name) || !dir.cd(name)) {
+        fprintf(stderr, "cannot make a directory in %s\n", qPrintable(QDir::tempPath()));
+        return 2;
+    }
+    dbPath = dir.filePath(QLatin1String("meta.db"));
+
+    testEvents(fixture);
+    testSince(fixture);
+    testOtherAccount(fixture);
+    testFallback(fixture);
+
+    foreach (const QString &entry, dir.entryList(QDir::Files))
+        dir.remove(entry);
+    QDir::temp().rmdir(name);
+    if (!failures)
+        printf("tracker fixture: ok\n");
+    return failures != 0;
+}
@@ -0,0 +1,18 @@
+# SyncSqliteSource against ../tracker_fixture.sql. Built with qmake like
+# the application; needs only Qt, commhistory's headers and sqlite3, no
+# running tracker. Run it from this directory, or give it the fixture.
+
+TEMPLATE = app
+TARGET = test_sqlite
+QT -= gui
+CONFIG += console
+PKGCONFIG += commhistory sqlite3
+
+INCLUDEPATH += ../..
+
+SOURCES += test_sqlite.cpp \
+    ../../syncsqlitesource.cpp
+
+HEADERS += \
+    ../../syncsqlitesource.h \
+    ../../synceventsource.h
@@ -0,0 +1,163 @@
+/*
+ * The synthetic event generator: the same seed gives the same events,
+ * in end time order, whatever kinds are asked for and whatever time they
+ * start after. And a synthetic run keeps its watermarks out of the real
+ * state file.
+ */
+
+#include "stub_driver.h"
+#include "synthetic.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COUNT 100000
+
+typedef struct {
+	int kind, id, rank, inbound, missed;
+	long long start, end;
+	unsigned hash; /* of the body */
+} summary_t;
+
+static unsigned
+hash( const unsigned short *s, int len )
+{
+	unsigned h = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ s[i]) * 16777619u;
+	return h;
+}
+
+/* all events of the kinds in mask after since */
+static summary_t *
+run( unsigned seed, int mask, long long since, int *n )
+{
+	static synth_event_t ev;
+	summary_t *out = nfcalloc( COUNT * sizeof(*out) ); /* padding too, for memcmp() */
+	synth_t synth;
+	int k;
+
+	synth_init( &synth, seed, COUNT );
+	for (k = 0; k < SYNTH_KINDS; k++)
+		if (mask & (1 << k))
+			synth_add_kind( &synth, k, since );
+	synth_start( &synth );
+	for (*n = 0; synth_next( &synth, &ev ); ++*n) {
+		out[*n].kind = ev.kind;
+		out[*n].id = ev.id;
+		out[*n].rank = ev.rank;
+		out[*n].inbound = ev.inbound;
+		out[*n].missed = ev.missed;
+		out[*n].start = ev.start;
+		out[*n].end = ev.end;
+		out[*n].hash = hash( ev.body, ev.body_len );
+	}
+	return out;
+}
+
+static int
+check_events( void )
+{
+	summary_t *all, *again, *part;
+	int n, m, i, j, k, counts[SYNTH_KINDS] = { 0 }, failed = 0;
+	long long since;
+
+	all = run( 7, 15, 0, &n );
+	again = run( 7, 15, 0, &m );
+	if (m != n || memcmp( all, again, n * sizeof(*all) )) {
+		fprintf( stderr, "the same seed gave other events\n" );
+		failed = 1;
+	}
+	for (i = 0; i < n; i++) {
+		counts[all[i].kind]++;
+		if (i && all[i].end < all[i - 1].end) {
+			fprintf( stderr, "event %d ends before the one before it\n", i );
+			failed = 1;
+			break;
+		}
+		if (all[i].start > all[i].end || (all[i].kind != SYNTH_CALL && all[i].start != all[i].end)) {
+			fprintf( stderr, "event %d starts at %lld, ends at %lld\n", i, all[i].start, all[i].end );
+			failed = 1;
+			break;
+		}
+	}
+	if (n != COUNT * 60 / 100 + COUNT * 3 / 100 + COUNT * 25 / 100 + COUNT * 12 / 100 ||
+	    counts[SYNTH_SMS] != COUNT * 60 / 100 || counts[SYNTH_CALL] != COUNT * 12 / 100) {
+		fprintf( stderr, "%d events, %d SMS, %d calls\n", n, counts[SYNTH_SMS], counts[SYNTH_CALL] );
+		failed = 1;
+	}
+
+	/* SMS and calls alone, after the middle event: the same as those of all */
+	since = all[n / 2].end;
+	part = run( 7, 1 << SYNTH_SMS | 1 << SYNTH_CALL, since, &m );
+	for (i = j = 0; i < n && !failed; i++) {
+		if (all[i].end <= since || (all[i].kind != SYNTH_SMS && all[i].kind != SYNTH_CALL))
+			continue;
+		if (j == m || memcmp( &all[i], &part[j], sizeof(*all) )) {
+			fprintf( stderr, "event %d differs with fewer kinds or a later start\n", all[i].id );
+			failed = 1;
+		}
+		j++;
+	}
+	if (!failed && j != m) {
+		fprintf( stderr, "%d events with fewer kinds, expected %d\n", m, j );
+		failed = 1;
+	}
+	free( part );
+
+	/* another seed, other events */
+	free( again );
+	again = run( 8, 15, 0, &m );
+	for (i = k = 0; i < n && i < m; i++)
+		k += all[i].end == again[i].end && all[i].hash == again[i].hash;
+	if (k > n / 100) {
+		fprintf( stderr, "seeds 7 and 8 share %d events\n", k );
+		failed = 1;
+	}
+	free( again );
+	free( all );
+	return failed;
+}
+
+static int
+check_state( void )
+{
+	config_t *conf = stub_config( 1, 1, 0 );
+	channel_conf_t *channel = stub_channel( conf, "SMS", "SMS" );
+	char path[_POSIX_PATH_MAX];
+	int failed = 0;
+
+	conf->synthetic_events = COUNT;
+	strcpy( channel_state( channel, conf->stores )->sync_time, "2011-12-31-23:59:59:000" );
+	if (save_state_config( conf, 0, 0 ))
+		failed = 1;
+	nfsnprintf( path, sizeof(path), "%s/." EXE ".state", conf->home );
+	if (!access( path, F_OK )) {
+		fprintf( stderr, "a synthetic run wrote %s\n", path );
+		failed = 1;
+	}
+	*channel->states->sync_time = 0;
+	if (load_state_config( conf, 0, 1 ) || strcmp( channel->states->sync_time, "2011-12-31-23:59:59:000" )) {
+		fprintf( stderr, "the synthetic state did not read back\n" );
+		failed = 1;
+	}
+	stub_config_free( conf );
+	return failed;
+}
+
+int
+main( void )
+{
+	int failed;
+
+	Quiet = 2;
+	failed = check_events();
+	failed |= check_state();
+	if (!failed)
+		printf( "%d synthetic events, separate state: ok\n", COUNT );
+	return failed;
+}
@@ -0,0 +1,69 @@
+-- A tracker database cut down to the tables SyncSqliteSource reads, for
+-- tests/test_sqlite. Two accounts: ring/tel/ring with SMS and calls to
+-- two contacts, and a jabber account whose message must not show up.
+-- Dates are seconds since the epoch, as tracker keeps them.
+
+PRAGMA user_version = 25;
+
+CREATE TABLE Resource (ID INTEGER PRIMARY KEY, Uri TEXT NOT NULL UNIQUE);
+CREATE TABLE "rdfs:Resource_rdf:type" (ID INTEGER NOT NULL, "rdf:type" INTEGER NOT NULL);
+CREATE TABLE "nmo:Message" (ID INTEGER PRIMARY KEY,
+    "nmo:sentDate" INTEGER, "nmo:receivedDate" INTEGER, "nmo:isSent" INTEGER,
+    "nmo:from" INTEGER, "nmo:communicationChannel" INTEGER,
+    "nmo:messageId" TEXT, "nmo:isAnswered" INTEGER);
+CREATE TABLE "nmo:Message_nmo:to" (ID INTEGER NOT NULL, "nmo:to" INTEGER NOT NULL);
+CREATE TABLE "nie:InformationElement" (ID INTEGER PRIMARY KEY, "nie:plainTextContent" TEXT);
+CREATE TABLE "nco:Role_nco:hasContactMedium" (ID INTEGER NOT NULL, "nco:hasContactMedium" INTEGER NOT NULL);
+
+INSERT INTO Resource VALUES
+    (1, 'http://www.semanticdesktop.org/ontologies/2007/03/22/nmo#SMSMessage'),
+    (2, 'http://www.semanticdesktop.org/ontologies/2007/03/22/nmo#Call'),
+    (3, 'http://www.semanticdesktop.org/ontologies/2007/03/22/nmo#IMMessage'),
+    (10, 'telepathy:/org/freedesktop/Telepathy/Account/ring/tel/ring'),
+    (11, 'telepathy:/org/freedesktop/Telepathy/Account/ring/tel/ring!+358401111111'),
+    (12, 'telepathy:/org/freedesktop/Telepathy/Account/ring/tel/ring!+358402222222'),
+    (13, 'telepathy:/org/freedesktop/Telepathy/Account/gabble/jabber/me'),
+    (14, 'telepathy:/org/freedesktop/Telepathy/Account/gabble/jabber/me!friend@example.com'),
+    (20, 'urn:role:me'),
+    (21, 'urn:role:first'),
+    (22, 'urn:role:second'),
+    (23, 'urn:role:jabber-me'),
+    (24, 'urn:role:friend'),
+    (30, 'conversation:1'),
+    (31, 'conversation:2'),
+    (32, 'conversation:3'),
+    (101, 'message:1'),
+    (102, 'message:2'),
+    (103, 'message:3'),
+    (104, 'call:4'),
+    (105, 'call:5'),
+    (106, 'message:6'),
+    (107, 'message:7');
+
+INSERT INTO "nco:Role_nco:hasContactMedium" VALUES
+    (20, 10), (21, 11), (22, 12), (23, 13), (24, 14);
+
+-- 1 in from the first contact, 2 out to it, 3 in from the second at the
+-- same second as 2, 4 a missed call from the first, 5 an answered one,
+-- 6 the jabber message, 7 an SMS of 2009, before the sync times the test uses
+INSERT INTO "nmo:Message" VALUES
+    (101, 1391421600, 1391421601, 0, 21, 30, 'token-1', 0),
+    (102, 1391421700, 1391421700, 1, 20, 30, 'token-2', 0),
+    (103, 1391421690, 1391421700, 0, 22, 31, 'token-3', 0),
+    (104, 1391425200, 1391425230, 0, 21, 30, NULL, 0),
+    (105, 1391428800, 1391428920, 0, 22, 31, NULL, 1),
+    (106, 1391421650, 1391421650, 0, 24, 32, NULL, 0),
+    (107, 1240000000, 1240000005, 0, 21, 30, 'token-7', 0);
+
+INSERT INTO "nmo:Message_nmo:to" VALUES
+    (101, 20), (102, 21), (103, 20), (104, 20), (105, 20), (106, 23), (107, 20);
+
+INSERT INTO "rdfs:Resource_rdf:type" VALUES
+    (101, 1), (102, 1), (103, 1), (104, 2), (105, 2), (106, 3), (107, 1);
+
+INSERT INTO "nie:InformationElement" VALUES
+    (101, 'Hei, tuletko huomenna?'),
+    (102, 'Joo, kello 10 '  || char(8364) || ' ' || char(128512)),
+    (103, 'Second contact'),
+    (106, 'jabber, not ring'),
+    (107, 'old');
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <pwd.h>
 #include <ctype.h>
+#include <limits.h>
 
 int Verbose, Quiet, Debug;
 
@@ -159,6 +160,199 @@ strip_cr( msg_data_t *msgdata )
 	}
 }
 
+void
+msg_buf_init( msg_buf_t *buf )
+{
+	buf->data = 0;
+	buf->len = buf->size = 0;
+}
+
+/* make room for len more bytes and return where they go; the caller
+ * accounts for them in buf->len */
+char *
+msg_buf_reserve( msg_buf_t *buf, int len )
+{
+	int size;
+
+	if (buf->len + len > buf->size) {
+		size = buf->size ? buf->size * 2 : 2048;
+		if (size < buf->len + len)
+			size = buf->len + len;
+		buf->data = nfrealloc( buf->data, size );
+		buf->size = size;
+	}
+	return buf->data + buf->len;
+}
+
+void
+msg_buf_add( msg_buf_t *buf, const char *str, int len )
+{
+	memcpy( msg_buf_reserve( buf, len ), str, len );
+	buf->len += len;
+}
+
+void
+date_fmt_init( date_fmt_t *fmt )
+{
+	int i;
+
+	for (i = 0; i < DATE_FMT_DAYS; i++)
+		fmt->zone[i].day = -1;
+	fmt->day = LONG_MIN;
+}
+
+static int
+zone_offset( time_t t )
+{
+	struct tm tm;
+
+	localtime_r( &t, &tm );
+	return tm.tm_gmtoff;
+}
+
+/* The offset at t. localtime_r() is asked twice per UTC day, for its
+ * first and last second; if they differ, the change is searched for.
+ * This is a cache in front of the C library, not a transition table:
+ * a day that leaves the cache is worked out again, and a second change
+ * within the same UTC day would go unnoticed. */
+static int
+date_fmt_offset( date_fmt_t *fmt, time_t t )
+{
+	long day = t >= 0 ? t / 86400 : -((-t + 86399) / 86400);
+	long lo, hi, mid;
+	int slot = (unsigned long)day % DATE_FMT_DAYS;
+
+	if (fmt->zone[slot].day != day) {
+		lo = day * 86400;
+		hi = lo + 86399;
+		fmt->zone[slot].day = day;
+		fmt->zone[slot].off[0] = zone_offset( lo );
+		fmt->zone[slot].off[1] = zone_offset( hi );
+		if (fmt->zone[slot].off[0] == fmt->zone[slot].off[1]) {
+			hi = lo;
+		} else {
+			while (lo + 1 < hi) {
+				mid = lo + (hi - lo) / 2;
+				if (zone_offset( mid ) == fmt->zone[slot].off[0])
+					lo = mid;
+				else
+					hi = mid;
+			}
+		}
+		fmt->zone[slot].change = hi;
+	}
+	return fmt->zone[slot].off[t >= fmt->zone[slot].change];
+}
+
+static void
+put2( char *out, int n )
+{
+	out[0] = '0' + n / 10;
+	out[1] = '0' + n % 10;
+}
+
+/* Local seconds since the epoch; lays out the date prefixes when the
+ * day is a new one. Returns the seconds into the day. */
+static int
+date_fmt_local( date_fmt_t *fmt, time_t t, int *off )
+{
+	static const char wdays[] = "ThuFriSatSunMonTueWed";
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	long local, day, era, doe, yoe, doy, mp;
+	int year, mon, mday;
+	char *p;
+
+	*off = date_fmt_offset( fmt, t );
+	local = (long)t + *off;
+	day = local >= 0 ? local / 86400 : -((-local + 86399) / 86400);
+	if (day != fmt->day) {
+		/* civil date from day number, after H. Hinnant */
+		fmt->day = day;
+		day += 719468;
+		era = (day >= 0 ? day : day - 146096) / 146097;
+		doe = day - era * 146097;
+		yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+		doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+		mp = (5 * doy + 2) / 153;
+		mday = doy - (153 * mp + 2) / 5 + 1;
+		mon = mp < 10 ? mp + 3 : mp - 9;
+		year = yoe + era * 400 + (mon <= 2);
+
+		p = fmt->rfc5322;
+		memcpy( p, wdays + ((fmt->day % 7 + 7) % 7) * 3, 3 );
+		p[3] = ',';
+		p[4] = ' ';
+		p += 5;
+		if (mday >= 10)
+			*p++ = '0' + mday / 10;
+		*p++ = '0' + mday % 10;
+		*p++ = ' ';
+		memcpy( p, months + (mon - 1) * 3, 3 );
+		p[3] = ' ';
+		put2( p + 4, year / 100 % 100 );
+		put2( p + 6, year % 100 );
+		p[8] = ' ';
+		fmt->rfc5322_len = p + 9 - fmt->rfc5322;
+
+		p = fmt->stamp;
+		put2( p, year / 100 % 100 );
+		put2( p + 2, year % 100 );
+		p[4] = '-';
+		put2( p + 5, mon );
+		p[7] = '-';
+		put2( p + 8, mday );
+		p[10] = '-';
+	}
+	return local - fmt->day * 86400;
+}
+
+/* "Mon, 3 Feb 2014 12:03:04 +0100"; out has RFC5322_DATE_LENGTH bytes */
+int
+date_fmt_rfc5322( date_fmt_t *fmt, time_t t, char *out )
+{
+	int secs, off, len;
+	char *p;
+
+	secs = date_fmt_local( fmt, t, &off );
+	len = fmt->rfc5322_len;
+	memcpy( out, fmt->rfc5322, len );
+	p = out + len;
+	put2( p, secs / 3600 );
+	p[2] = ':';
+	put2( p + 3, secs / 60 % 60 );
+	p[5] = ':';
+	put2( p + 6, secs % 60 );
+	p[8] = ' ';
+	p[9] = off < 0 ? '-' : '+';
+	if (off < 0)
+		off = -off;
+	put2( p + 10, off / 3600 );
+	put2( p + 12, off / 60 % 60 );
+	p[14] = 0;
+	return len + 14;
+}
+
+/* the state file's "yyyy-MM-dd-hh:mm:ss:zzz", in local time */
+int
+date_fmt_stamp( date_fmt_t *fmt, time_t t, int msec, char *out )
+{
+	int secs, off;
+	char *p = out + 11;
+
+	secs = date_fmt_local( fmt, t, &off );
+	memcpy( out, fmt->stamp, 11 );
+	put2( p, secs / 3600 );
+	p[2] = ':';
+	put2( p + 3, secs / 60 % 60 );
+	p[5] = ':';
+	put2( p + 6, secs % 60 );
+	p[8] = ':';
+	p[9] = '0' + msec / 100;
+	put2( p + 10, msec % 100 );
+	p[12] = 0;
+	return 23;
+}
+
 #ifndef HAVE_VASPRINTF
 static int
 vasprintf( char **strp, const char *fmt, va_list ap )
@@ -294,7 +488,7 @@ my_strndup( const char *s, size_t nchars )
 }
 
 char *
-expand_strdup( const char *s )
+expand_strdup( const char *s, const char *home )
 {
 	struct passwd *pw;
 	const char *p, *q;
@@ -304,10 +498,10 @@ expand_strdup( const char *s )
 		s++;
 		if (!*s) {
 			p = 0;
-			q = Home;
+			q = home;
 		} else if (*s == '/') {
 			p = s;
-			q = Home;
+			q = home;
 		} else {
 			if ((p = strchr( s, '/' ))) {
 				r = my_strndup( s, (int)(p - s) );
@@ -337,13 +531,18 @@ sort_ints( int *arr, int len )
 	qsort( arr, len, sizeof(int), compare_ints );
 }
 
+/* monotonic clock, for timing */
+long long
+get_usec( void )
+{
+	struct timespec ts;
 
-static struct {
-	unsigned char i, j, s[256];
-} rs;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
 void
-arc4_init( void )
+arc4_init( arc4_t *rs )
 {
 	int i, fd;
 	unsigned char j, si, dat[128];
@@ -359,29 +558,29 @@ arc4_init( void )
 	close( fd );
 
 	for (i = 0; i < 256; i++)
-		rs.s[i] = i;
+		rs->s[i] = i;
 	for (i = j = 0; i < 256; i++) {
-		si = rs.s[i];
+		si = rs->s[i];
 		j += si + dat[i & 127];
-		rs.s[i] = rs.s[j];
-		rs.s[j] = si;
+		rs->s[i] = rs->s[j];
+		rs->s[j] = si;
 	}
-	rs.i = rs.j = 0;
+	rs->i = rs->j = 0;
 
 	for (i = 0; i < 256; i++)
-		arc4_getbyte();
+		arc4_getbyte( rs );
 }
 
 unsigned char
-arc4_getbyte( void )
+arc4_getbyte( arc4_t *rs )
 {
 	unsigned char si, sj;
 
-	rs.i++;
-	si = rs.s[rs.i];
-	rs.j += si;
-	sj = rs.s[rs.j];
-	rs.s[rs.i] = sj;
-	rs.s[rs.j] = si;
-	return rs.s[(si + sj) & 0xff];
+	rs->i++;
+	si = rs->s[rs->i];
+	rs->j += si;
+	sj = rs->s[rs->j];
+	rs->s[rs->i] = sj;
+	rs->s[rs->j] = si;
+	return rs->s[(si + sj) & 0xff];
 }